@@ -44,6 +44,7 @@
 
 int debugflag = 0;
 int force_restore = 1;
+int skip_unchanged = 0;
 int ignore_nocards = 0;
 int do_lock = 0;
 int use_syslog = 0;
@@ -59,6 +60,7 @@ char *lockfile = SYS_LOCKFILE;
 #define EMPCMD	0x2000
 #define CARDCMD 0x4000
 #define KILLCMD 0x8000
+#define NUMCMD  0x10000
 
 struct arg {
 	int sarg;
@@ -81,6 +83,8 @@ static struct arg args[] = {
 { 0, NULL, "  (default mode)" },
 { 'g', "ignore", "ignore 'No soundcards found' error" },
 { 'P', "pedantic", "do not restore mismatching controls (old default)" },
+{ 'u', "skip-unchanged", "do not write the controls which already have" },
+{ 0, NULL, "  the restored value" },
 { 'I', "no-init-fallback", "" },
 { 0, NULL, "don't initialize even if restore fails" },
 { FILEARG | 'r', "runstate", "save restore and init state to this file (only errors)" },
@@ -96,6 +100,10 @@ static struct arg args[] = {
 { 's', "syslog", "use syslog for messages" },
 { INTARG | 'n', "nice", "set the process priority (see 'man nice')" },
 { 'c', "sched-idle", "set the process scheduling policy to idle (SCHED_IDLE)" },
+{ HEADER, NULL, "Available monitor options:" },
+{ FILEARG | 'M', "format", "event output format (text, json or binary)" },
+{ INTARG | 'W', "coalesce", "coalesce the value events of one control" },
+{ 0, NULL, "  within the given time in milliseconds" },
 { HEADER, NULL, "Available commands:" },
 { CARDCMD, "store", "save current driver setup for one or each soundcards" },
 { EMPCMD, NULL, "  to configuration file" },
@@ -107,6 +115,8 @@ static struct arg args[] = {
 { CARDCMD, "rdaemon", "like daemon but do the state restore at first" },
 { KILLCMD, "kill", "notify daemon to quit, rescan or save_and_quit" },
 { CARDCMD, "monitor", "monitor control events" },
+{ NUMCMD, "bench", "measure store, restore and init using a mock device" },
+{ EMPCMD, NULL, "  with the given number of controls (default 4096)" },
 { 0, NULL, NULL }
 };
 
@@ -130,11 +140,13 @@ static void help(void)
 		}
 		buf[0] = '\0';
 		larg = a->larg;
-		if (sarg & (EMPCMD|CARDCMD|KILLCMD)) {
+		if (sarg & (EMPCMD|CARDCMD|KILLCMD|NUMCMD)) {
 			if (sarg & CARDCMD)
 				strcat(buf, "<card>");
 			else if (sarg & KILLCMD)
 				strcat(buf, "<cmd>");
+			else if (sarg & NUMCMD)
+				strcat(buf, "<num>");
 			printf("  %-8s  %-6s  %s\n", larg ? larg : "",
 							buf, a->comment);
 			continue;
@@ -191,6 +203,8 @@ int main(int argc, char *argv[])
 	int daemoncmd = 0;
 	int use_nice = NO_NICE;
 	int sched_idle = 0;
+	char *monitor_format = NULL;
+	int coalesce = 0;
 	struct arg *a;
 	struct option *o;
 	int i, j, k, res;
@@ -263,6 +277,9 @@ int main(int argc, char *argv[])
 		case 'I':
 			init_fallback = 0;
 			break;
+		case 'u':
+			skip_unchanged = 1;
+			break;
 		case 'r':
 			statefile = optarg;
 			break;
@@ -298,6 +315,14 @@ int main(int argc, char *argv[])
 		case 'c':
 			sched_idle = 1;
 			break;
+		case 'M':
+			monitor_format = optarg;
+			break;
+		case 'W':
+			coalesce = atoi(optarg);
+			if (coalesce < 0)
+				coalesce = 0;
+			break;
 		case 'd':
 			debugflag = 1;
 			break;
@@ -377,12 +402,15 @@ int main(int argc, char *argv[])
 	} else if (!strcmp(cmd, "kill")) {
 		res = state_daemon_kill(pidfile, cardname);
 	} else if (!strcmp(cmd, "monitor")) {
-		res = monitor(cardname);
+		res = monitor(cardname, monitor_format, coalesce);
+	} else if (!strcmp(cmd, "bench")) {
+		res = bench(initfile, cardname);
 	} else {
 		fprintf(stderr, "alsactl: Unknown command '%s'...\n", cmd);
 		res = -ENODEV;
 	}
 
+	init_cleanup();
 	snd_config_update_free_global();
 	if (use_syslog) {
 		if (daemoncmd)
@@ -1,5 +1,6 @@
 extern int debugflag;
 extern int force_restore;
+extern int skip_unchanged;
 extern int ignore_nocards;
 extern int do_lock;
 extern int use_syslog;
@@ -24,14 +25,43 @@ void dbg_(const char *fcn, long line, const char *fmt, ...);
 #define dbg(args...) do { dbg_(__FUNCTION__, __LINE__, ##args); }  while (0)
 #endif	
 
+struct state_cache_card;
+struct state_cache_file;
+
 int init(const char *file, const char *cardname);
+int init_cardno(const char *file, int card);
+void init_cleanup(void);
 int state_lock(const char *file, int timeout);
 int state_unlock(int fd, const char *file);
 int save_state(const char *file, const char *cardname);
 int load_state(const char *file, const char *initfile, const char *cardname,
 	       int do_init);
+int state_mirror_load(const char *file, snd_config_t **config);
+int state_mirror_card(snd_config_t *config, int cardno);
+int state_mirror_control(snd_config_t *config, snd_ctl_t *handle,
+			 const char *cardid, snd_ctl_elem_id_t *id);
+int state_mirror_save(const char *file, snd_config_t *config);
+int get_controls(int cardno, snd_config_t *top,
+		 struct state_cache_card **cache);
+int set_controls(int card, snd_config_t *top, int doit);
+
+/* binary state cache */
+
+unsigned int state_cache_fingerprint(snd_ctl_elem_list_t *list);
+struct state_cache_card *state_cache_card_new(const char *id,
+					      unsigned int fingerprint);
+void state_cache_card_free(struct state_cache_card *card);
+int state_cache_card_add(struct state_cache_card *card,
+			 snd_ctl_elem_info_t *info, snd_ctl_elem_value_t *ctl);
+int state_cache_save(const char *file, struct state_cache_card **cards,
+		     int count);
+void state_cache_remove(const char *file);
+int state_cache_current(const char *file);
+struct state_cache_file *state_cache_open(const char *file);
+void state_cache_close(struct state_cache_file *cache);
+int state_cache_restore(struct state_cache_file *cache, int card);
 int power(const char *argv[], int argc);
-int monitor(const char *name);
+int monitor(const char *name, const char *format, int coalesce);
 int state_daemon(const char *file, const char *cardname, int period,
 		 const char *pidfile);
 int state_daemon_kill(const char *pidfile, const char *cmd);
@@ -42,6 +72,47 @@ int file_map(const char *filename, char **buf, size_t *bufsize);
 void file_unmap(void *buf, size_t bufsize);
 size_t line_width(const char *buf, size_t bufsize, size_t pos);
 void initfailed(int cardnumber, const char *reason, int exitcode);
+int ctl_value_equal(snd_ctl_elem_type_t type, unsigned int count,
+		    snd_ctl_elem_value_t *val1, snd_ctl_elem_value_t *val2);
+int card_ctl_open(snd_ctl_t **handle, int card, int mode);
+
+/* mock control device and benchmark (bench command) */
+
+#define MOCK_CARD	1000		/* card number of the mock device */
+
+enum {
+	BENCH_ENUMERATE,
+	BENCH_INFO,
+	BENCH_READ,
+	BENCH_SERIALIZE,
+	BENCH_PARSE,
+	BENCH_MATCH,
+	BENCH_WRITE,
+	BENCH_INIT,
+	BENCH_PHASES
+};
+
+int mock_init(unsigned int count);
+void mock_free(void);
+int mock_ctl_open(snd_ctl_t **handle, int mode);
+long long bench_time(void);
+void bench_add(int phase, snd_ctl_elem_type_t type, long long start);
+int bench(const char *initfile, const char *arg);
+
+/* card hotplug detection */
+
+#define DEV_DIR		"/dev"
+#define DEV_SND_DIR	"/dev/snd"
+
+struct hotplug {
+	int fd;				/* inotify */
+	int dev_wd;			/* DEV_DIR watch (DEV_SND_DIR is missing) */
+	int snd_wd;			/* DEV_SND_DIR watch */
+};
+
+int hotplug_init(struct hotplug *hp);
+int hotplug_events(struct hotplug *hp);
+void hotplug_close(struct hotplug *hp);
 
 static inline int hextodigit(int c)
 {
@@ -0,0 +1,204 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - Benchmark
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The bench command runs the store, restore and init code against the
+ * mock control device (mock.c) and prints the time spent in each phase
+ * for each control type. The state is serialized to and parsed from
+ * a memory buffer, so the file I/O is not measured. The phases are
+ * measured in the state and init code using bench_time() and
+ * bench_add(), which do nothing outside of this command.
+ */
+
+#include "aconfig.h"
+#include "version.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include "alsactl.h"
+
+#define BENCH_CONTROLS	4096
+
+struct bench_stat {
+	long long nsec;
+	unsigned int calls;
+};
+
+static const char *const phase_names[BENCH_PHASES] = {
+	[BENCH_ENUMERATE] = "enumerate",
+	[BENCH_INFO] = "info",
+	[BENCH_READ] = "read",
+	[BENCH_SERIALIZE] = "serialize",
+	[BENCH_PARSE] = "parse",
+	[BENCH_MATCH] = "match",
+	[BENCH_WRITE] = "write",
+	[BENCH_INIT] = "init",
+};
+
+static int bench_enabled;
+static struct bench_stat stats[BENCH_PHASES][SND_CTL_ELEM_TYPE_LAST + 1];
+
+/* returns the monotonic time in ns (0 when the bench is not running) */
+long long bench_time(void)
+{
+	struct timespec ts;
+
+	if (!bench_enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void bench_add(int phase, snd_ctl_elem_type_t type, long long start)
+{
+	struct bench_stat *s;
+
+	if (!bench_enabled)
+		return;
+	if ((unsigned int)type > SND_CTL_ELEM_TYPE_LAST)
+		type = SND_CTL_ELEM_TYPE_NONE;
+	s = &stats[phase][type];
+	s->nsec += bench_time() - start;
+	s->calls++;
+}
+
+static void print_stat(const char *phase, const char *type,
+		       struct bench_stat *s)
+{
+	printf("%-10s  %-10s  %8u  %12.1f  %10.1f\n", phase, type, s->calls,
+	       s->nsec / 1000.0, (double)s->nsec / s->calls);
+}
+
+static void bench_report(void)
+{
+	struct bench_stat total;
+	int phase, type, types;
+
+	printf("%-10s  %-10s  %8s  %12s  %10s\n",
+	       "phase", "type", "calls", "total us", "ns/call");
+	for (phase = 0; phase < BENCH_PHASES; phase++) {
+		memset(&total, 0, sizeof(total));
+		types = 0;
+		for (type = 0; type <= SND_CTL_ELEM_TYPE_LAST; type++) {
+			struct bench_stat *s = &stats[phase][type];
+			if (s->calls == 0)
+				continue;
+			print_stat(phase_names[phase],
+				   type == SND_CTL_ELEM_TYPE_NONE ? "all" :
+				   snd_ctl_elem_type_name(type), s);
+			total.nsec += s->nsec;
+			total.calls += s->calls;
+			types++;
+		}
+		if (types > 1)
+			print_stat(phase_names[phase], "total", &total);
+	}
+}
+
+int bench(const char *initfile, const char *arg)
+{
+	snd_config_t *top = NULL, *restored = NULL;
+	snd_output_t *out = NULL;
+	snd_input_t *in;
+	char *buf;
+	size_t size;
+	long long start;
+	int count, err;
+
+	count = arg ? atoi(arg) : BENCH_CONTROLS;
+	err = mock_init(count);
+	if (err < 0) {
+		error("Cannot create the mock device with %i controls: %s",
+		      count, snd_strerror(err));
+		return err;
+	}
+	memset(stats, 0, sizeof(stats));
+	bench_enabled = 1;
+
+	/* store */
+	err = snd_config_top(&top);
+	if (err < 0) {
+		error("snd_config_top error: %s", snd_strerror(err));
+		goto _end;
+	}
+	err = get_controls(MOCK_CARD, top, NULL);
+	if (err < 0)
+		goto _end;
+	err = snd_output_buffer_open(&out);
+	if (err < 0) {
+		error("snd_output_buffer_open error: %s", snd_strerror(err));
+		goto _end;
+	}
+	start = bench_time();
+	err = snd_config_save(top, out);
+	if (err < 0) {
+		error("snd_config_save: %s", snd_strerror(err));
+		goto _end;
+	}
+	bench_add(BENCH_SERIALIZE, SND_CTL_ELEM_TYPE_NONE, start);
+
+	/* restore */
+	size = snd_output_buffer_string(out, &buf);
+	err = snd_input_buffer_open(&in, buf, size);
+	if (err < 0) {
+		error("snd_input_buffer_open error: %s", snd_strerror(err));
+		goto _end;
+	}
+	err = snd_config_top(&restored);
+	if (err >= 0) {
+		start = bench_time();
+		err = snd_config_load(restored, in);
+		bench_add(BENCH_PARSE, SND_CTL_ELEM_TYPE_NONE, start);
+	}
+	snd_input_close(in);
+	if (err < 0) {
+		error("snd_config_load error: %s", snd_strerror(err));
+		goto _end;
+	}
+	err = set_controls(MOCK_CARD, restored, 1);
+	if (err < 0)
+		goto _end;
+
+	/* init (the mock driver is not known, exit code 99 is expected) */
+	start = bench_time();
+	err = init_cardno(initfile, MOCK_CARD);
+	bench_add(BENCH_INIT, SND_CTL_ELEM_TYPE_NONE, start);
+	if (err == -99)
+		err = 0;
+	else if (err < 0)
+		error("Init of the mock device failed: %i", err);
+
+	bench_enabled = 0;
+	printf("mock device: %i controls, %zu bytes of state\n", count, size);
+	bench_report();
+ _end:
+	bench_enabled = 0;
+	if (out)
+		snd_output_close(out);
+	if (restored)
+		snd_config_delete(restored);
+	if (top)
+		snd_config_delete(top);
+	mock_free();
+	return err;
+}
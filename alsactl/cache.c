@@ -0,0 +1,544 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - Binary State Cache
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The cache is written next to the state file by 'alsactl store' and it
+ * contains the values of the writable controls in the native binary form:
+ *
+ *   struct cache_header
+ *   struct cache_card + entries (for each card)
+ *
+ * The entries are struct cache_entry followed by the values (64-bit
+ * integers or bytes padded to 8 bytes). The cache is used by 'alsactl
+ * restore' only when the state file was not changed after the store
+ * (same inode, size and modification time in nanoseconds) and when
+ * the control list of the card has the same fingerprint.
+ */
+
+#include "aconfig.h"
+#include "version.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <alsa/asoundlib.h>
+#include "alsactl.h"
+
+#define CACHE_MAGIC	0x43534c41	/* "ALSC" */
+#define CACHE_VERSION	2
+
+#define CACHE_ALIGN(x)	(((x) + 7) & ~7)
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cards;
+	uint32_t reserved;
+	uint64_t state_ino;	/* stamp of the state file */
+	int64_t state_mtime;
+	int64_t state_mtime_nsec;
+	int64_t state_size;
+};
+
+struct cache_card {
+	char id[32];
+	uint32_t fingerprint;	/* hash of the control list */
+	uint32_t entries;
+	uint32_t size;		/* size of all entries in bytes */
+	uint32_t reserved;
+};
+
+struct cache_entry {
+	uint32_t numid;
+	uint32_t type;
+	uint32_t count;		/* values or bytes */
+	uint32_t size;		/* size of this entry with the values */
+};
+
+struct state_cache_card {
+	struct cache_card hdr;
+	char *data;
+	size_t alloc;
+};
+
+/* the mapped cache file, shared (read only) by the restore jobs */
+struct state_cache_file {
+	char *buf;
+	size_t size;
+};
+
+static char *cache_name(const char *file)
+{
+	char *name;
+
+	name = malloc(strlen(file) + 7);
+	if (name == NULL)
+		return NULL;
+	strcpy(name, file);
+	strcat(name, ".cache");
+	return name;
+}
+
+static void set_stamp(struct cache_header *hdr, struct stat *st)
+{
+	hdr->state_ino = st->st_ino;
+	hdr->state_mtime = st->st_mtim.tv_sec;
+	hdr->state_mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->state_size = st->st_size;
+}
+
+static int check_header(const struct cache_header *hdr, size_t size,
+			struct stat *st, const char *file)
+{
+	if (size < sizeof(*hdr) || hdr->magic != CACHE_MAGIC ||
+	    hdr->version != CACHE_VERSION) {
+		dbg("invalid cache header");
+		return 0;
+	}
+	if (hdr->state_ino != (uint64_t)st->st_ino ||
+	    hdr->state_mtime != st->st_mtim.tv_sec ||
+	    hdr->state_mtime_nsec != st->st_mtim.tv_nsec ||
+	    hdr->state_size != st->st_size) {
+		dbg("cache is older than %s", file);
+		return 0;
+	}
+	return 1;
+}
+
+/* FNV-1a */
+static uint32_t hash_add(uint32_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	while (size-- > 0) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+unsigned int state_cache_fingerprint(snd_ctl_elem_list_t *list)
+{
+	uint32_t hash = 2166136261U, v[5];
+	unsigned int idx, count;
+	const char *name;
+
+	count = snd_ctl_elem_list_get_used(list);
+	for (idx = 0; idx < count; idx++) {
+		v[0] = snd_ctl_elem_list_get_numid(list, idx);
+		v[1] = snd_ctl_elem_list_get_interface(list, idx);
+		v[2] = snd_ctl_elem_list_get_device(list, idx);
+		v[3] = snd_ctl_elem_list_get_subdevice(list, idx);
+		v[4] = snd_ctl_elem_list_get_index(list, idx);
+		hash = hash_add(hash, v, sizeof(v));
+		name = snd_ctl_elem_list_get_name(list, idx);
+		hash = hash_add(hash, name, strlen(name) + 1);
+	}
+	return hash;
+}
+
+struct state_cache_card *state_cache_card_new(const char *id,
+					      unsigned int fingerprint)
+{
+	struct state_cache_card *card;
+
+	card = calloc(1, sizeof(*card));
+	if (card == NULL)
+		return NULL;
+	snprintf(card->hdr.id, sizeof(card->hdr.id), "%s", id);
+	card->hdr.fingerprint = fingerprint;
+	return card;
+}
+
+void state_cache_card_free(struct state_cache_card *card)
+{
+	if (card == NULL)
+		return;
+	free(card->data);
+	free(card);
+}
+
+int state_cache_card_add(struct state_cache_card *card,
+			 snd_ctl_elem_info_t *info, snd_ctl_elem_value_t *ctl)
+{
+	struct cache_entry *entry;
+	snd_ctl_elem_type_t type;
+	unsigned int idx, count;
+	int64_t *values;
+	size_t size;
+	char *n;
+
+	type = snd_ctl_elem_info_get_type(info);
+	count = snd_ctl_elem_info_get_count(info);
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+	case SND_CTL_ELEM_TYPE_INTEGER:
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		size = count * sizeof(int64_t);
+		break;
+	case SND_CTL_ELEM_TYPE_IEC958:
+		count = sizeof(snd_aes_iec958_t);
+		/* fall through */
+	case SND_CTL_ELEM_TYPE_BYTES:
+		size = CACHE_ALIGN(count);
+		break;
+	default:
+		return -EINVAL;
+	}
+	size += sizeof(*entry);
+	if (card->hdr.size + size > card->alloc) {
+		n = realloc(card->data, card->alloc + size + 4096);
+		if (n == NULL)
+			return -ENOMEM;
+		card->data = n;
+		card->alloc += size + 4096;
+	}
+	entry = (struct cache_entry *)(card->data + card->hdr.size);
+	memset(entry, 0, size);
+	entry->numid = snd_ctl_elem_info_get_numid(info);
+	entry->type = type;
+	entry->count = count;
+	entry->size = size;
+	values = (int64_t *)(entry + 1);
+	for (idx = 0; idx < count; idx++) {
+		switch (type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+			values[idx] = snd_ctl_elem_value_get_boolean(ctl, idx);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER:
+			values[idx] = snd_ctl_elem_value_get_integer(ctl, idx);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+			values[idx] = snd_ctl_elem_value_get_integer64(ctl, idx);
+			break;
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+			values[idx] = snd_ctl_elem_value_get_enumerated(ctl, idx);
+			break;
+		default:
+			memcpy(values, snd_ctl_elem_value_get_bytes(ctl), count);
+			idx = count;
+			break;
+		}
+	}
+	card->hdr.entries++;
+	card->hdr.size += size;
+	return 0;
+}
+
+void state_cache_remove(const char *file)
+{
+	char *name;
+
+	if (!strcmp(file, "-"))
+		return;
+	name = cache_name(file);
+	if (name == NULL)
+		return;
+	if (unlink(name) < 0 && errno != ENOENT)
+		error("Cannot remove %s: %s", name, strerror(errno));
+	free(name);
+}
+
+int state_cache_save(const char *file, struct state_cache_card **cards,
+		     int count)
+{
+	struct cache_header hdr;
+	struct stat st;
+	char *name, *nname = NULL;
+	FILE *out = NULL;
+	int i, err = 0;
+
+	if (!strcmp(file, "-"))
+		return 0;
+	if (stat(file, &st) < 0)
+		return -errno;
+	name = cache_name(file);
+	if (name == NULL)
+		return -ENOMEM;
+	nname = malloc(strlen(name) + 5);
+	if (nname == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	strcpy(nname, name);
+	strcat(nname, ".new");
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.cards = count;
+	set_stamp(&hdr, &st);
+	out = fopen(nname, "w");
+	if (out == NULL) {
+		err = -errno;
+		error("Cannot open %s for writing: %s", nname, strerror(errno));
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		goto _werr;
+	for (i = 0; i < count; i++) {
+		if (fwrite(&cards[i]->hdr, sizeof(cards[i]->hdr), 1, out) != 1)
+			goto _werr;
+		if (cards[i]->hdr.size > 0 &&
+		    fwrite(cards[i]->data, cards[i]->hdr.size, 1, out) != 1)
+			goto _werr;
+	}
+	if (fclose(out)) {
+		out = NULL;
+		goto _werr;
+	}
+	out = NULL;
+	if (rename(nname, name) < 0) {
+		err = -errno;
+		error("rename failed: %s (%s)", strerror(errno), name);
+		unlink(nname);
+	}
+	goto out;
+
+ _werr:
+	err = -EIO;
+	error("Cannot write %s", nname);
+	if (out)
+		fclose(out);
+	out = NULL;
+	unlink(nname);
+ out:
+	free(nname);
+	free(name);
+	return err;
+}
+
+static int restore_entries(snd_ctl_t *handle, const char *data, size_t size)
+{
+	const struct cache_entry *entry;
+	const int64_t *values;
+	snd_ctl_elem_value_t *ctl, *old;
+	unsigned int idx, written = 0, skipped = 0;
+	size_t pos;
+	int err;
+	snd_ctl_elem_value_alloca(&ctl);
+	snd_ctl_elem_value_alloca(&old);
+
+	for (pos = 0; pos < size; pos += entry->size) {
+		entry = (const struct cache_entry *)(data + pos);
+		if (entry->size < sizeof(*entry) || entry->size > size - pos)
+			return -EINVAL;
+		values = (const int64_t *)(entry + 1);
+		if (entry->type == SND_CTL_ELEM_TYPE_BYTES ||
+		    entry->type == SND_CTL_ELEM_TYPE_IEC958) {
+			if (entry->count > entry->size - sizeof(*entry))
+				return -EINVAL;
+		} else if (entry->count > (entry->size - sizeof(*entry)) / sizeof(int64_t)) {
+			return -EINVAL;
+		}
+		snd_ctl_elem_value_clear(ctl);
+		snd_ctl_elem_value_set_numid(ctl, entry->numid);
+		for (idx = 0; idx < entry->count; idx++) {
+			switch (entry->type) {
+			case SND_CTL_ELEM_TYPE_BOOLEAN:
+				snd_ctl_elem_value_set_boolean(ctl, idx, values[idx]);
+				break;
+			case SND_CTL_ELEM_TYPE_INTEGER:
+				snd_ctl_elem_value_set_integer(ctl, idx, values[idx]);
+				break;
+			case SND_CTL_ELEM_TYPE_INTEGER64:
+				snd_ctl_elem_value_set_integer64(ctl, idx, values[idx]);
+				break;
+			case SND_CTL_ELEM_TYPE_ENUMERATED:
+				snd_ctl_elem_value_set_enumerated(ctl, idx, values[idx]);
+				break;
+			case SND_CTL_ELEM_TYPE_BYTES:
+			case SND_CTL_ELEM_TYPE_IEC958:
+				snd_ctl_elem_value_set_byte(ctl, idx,
+					((const unsigned char *)values)[idx]);
+				break;
+			default:
+				return -EINVAL;
+			}
+		}
+		if (skip_unchanged) {
+			snd_ctl_elem_value_set_numid(old, entry->numid);
+			if (snd_ctl_elem_read(handle, old) >= 0 &&
+			    ctl_value_equal(entry->type, entry->count, ctl, old)) {
+				skipped++;
+				continue;
+			}
+		}
+		err = snd_ctl_elem_write(handle, ctl);
+		if (err < 0) {
+			dbg("cannot write control #%u: %s", entry->numid,
+			    snd_strerror(err));
+			return err;
+		}
+		written++;
+	}
+	dbg("%u controls written, %u unchanged", written, skipped);
+	return 0;
+}
+
+static int restore_card(int cardno, const char *data, size_t size,
+			unsigned int cards)
+{
+	const struct cache_card *card;
+	snd_ctl_t *handle;
+	snd_ctl_card_info_t *info;
+	snd_ctl_elem_list_t *list;
+	unsigned int i, count, fingerprint;
+	const char *id;
+	size_t pos;
+	int err;
+	snd_ctl_card_info_alloca(&info);
+	snd_ctl_elem_list_alloca(&list);
+
+	err = card_ctl_open(&handle, cardno, 0);
+	if (err < 0) {
+		error("snd_ctl_open error: %s", snd_strerror(err));
+		return err;
+	}
+	err = snd_ctl_card_info(handle, info);
+	if (err < 0) {
+		error("snd_ctl_card_info error: %s", snd_strerror(err));
+		goto _close;
+	}
+	id = snd_ctl_card_info_get_id(info);
+	err = snd_ctl_elem_list(handle, list);
+	if (err < 0)
+		goto _close;
+	count = snd_ctl_elem_list_get_count(list);
+	if (count > 0) {
+		err = snd_ctl_elem_list_alloc_space(list, count);
+		if (err < 0)
+			goto _close;
+		err = snd_ctl_elem_list(handle, list);
+		if (err < 0)
+			goto _free;
+	}
+	fingerprint = state_cache_fingerprint(list);
+	err = 1;
+	for (i = 0, pos = 0; i < cards; i++) {
+		if (size - pos < sizeof(*card))
+			break;
+		card = (const struct cache_card *)(data + pos);
+		pos += sizeof(*card);
+		if (card->size > size - pos)
+			break;
+		if (strncmp(card->id, id, sizeof(card->id)) == 0) {
+			if (card->fingerprint != fingerprint) {
+				dbg("card %s: control list changed", id);
+				break;
+			}
+			err = restore_entries(handle, data + pos, card->size);
+			break;
+		}
+		pos += card->size;
+	}
+ _free:
+	snd_ctl_elem_list_free_space(list);
+ _close:
+	snd_ctl_close(handle);
+	return err;
+}
+
+/* check if the cache matches the current state file */
+int state_cache_current(const char *file)
+{
+	struct stat st;
+	char *name, *buf;
+	size_t size;
+	int res;
+
+	if (stat(file, &st) < 0)
+		return 0;
+	name = cache_name(file);
+	if (name == NULL)
+		return 0;
+	res = file_map(name, &buf, &size);
+	free(name);
+	if (res < 0)
+		return 0;
+	res = check_header((const struct cache_header *)buf, size, &st, file);
+	file_unmap(buf, size);
+	return res;
+}
+
+/*
+ * Map the cache of the state file. Returns NULL when the cache does not
+ * exist or when it does not match the state file.
+ */
+struct state_cache_file *state_cache_open(const char *file)
+{
+	struct state_cache_file *cache;
+	struct stat st;
+	char *name;
+	int err;
+
+	if (!strcmp(file, "-") || stat(file, &st) < 0)
+		return NULL;
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+	name = cache_name(file);
+	if (name == NULL)
+		goto _free;
+	err = file_map(name, &cache->buf, &cache->size);
+	free(name);
+	if (err < 0)
+		goto _free;
+	if (!check_header((const struct cache_header *)cache->buf,
+			  cache->size, &st, file)) {
+		file_unmap(cache->buf, cache->size);
+		goto _free;
+	}
+	return cache;
+ _free:
+	free(cache);
+	return NULL;
+}
+
+void state_cache_close(struct state_cache_file *cache)
+{
+	file_unmap(cache->buf, cache->size);
+	free(cache);
+}
+
+/*
+ * Restore one card from the cache. Returns zero when the card was
+ * restored, otherwise the state file must be used for this card.
+ */
+int state_cache_restore(struct state_cache_file *cache, int card)
+{
+	const struct cache_header *hdr;
+	struct timespec start, now;
+	int err;
+
+	hdr = (const struct cache_header *)cache->buf;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	err = restore_card(card, cache->buf + sizeof(*hdr),
+			   cache->size - sizeof(*hdr), hdr->cards);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dbg("card %i: cache restore %s in %li us", card,
+	    err ? "failed" : "done",
+	    (long)((now.tv_sec - start.tv_sec) * 1000000L +
+		   (now.tv_nsec - start.tv_nsec) / 1000L));
+	return err ? 1 : 0;
+}
@@ -29,12 +29,37 @@
 #include <signal.h>
 #include <time.h>
 #include <poll.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <alsa/asoundlib.h>
 #include "alsactl.h"
 
+/*
+ * The element sets are hashed by numid. The entries are allocated
+ * in chunks and the unused entries are kept for the reuse.
+ */
+
+#define ID_HASH_MIN	64
+#define ID_POOL_CHUNK	64
+
+struct id_entry {
+	struct id_entry *next;
+	unsigned int numid;
+};
+
+struct id_pool {
+	struct id_pool *next;
+	struct id_entry entries[ID_POOL_CHUNK];
+};
+
 struct id_list {
-	snd_ctl_elem_id_t **list;
-	int size;
+	struct id_entry **hash;
+	unsigned int mask;		/* hash size - 1 */
+	unsigned int count;
+	struct id_entry *free;		/* unused entries */
+	struct id_pool *pool;
 };
 
 struct card {
@@ -43,8 +68,19 @@ struct card {
 	snd_ctl_t *handle;
 	struct id_list whitelist;
 	struct id_list blacklist;
+	struct id_list changed;		/* controls to be read again */
+	int full;			/* read all controls again */
 };
 
+struct mirror {
+	snd_config_t *config;		/* in-memory copy of the state file */
+	struct stat st;			/* state file stamp after last access */
+};
+
+/* epoll tags (the upper 32 bits), the card slot is used otherwise */
+#define EP_INOTIFY	0xffffffffU
+#define EP_TIMER	0xfffffffeU
+
 static int quit = 0;
 static int rescan = 0;
 static int save_now = 0;
@@ -69,17 +105,41 @@ static void signal_handler_rescan(int sig)
 
 static void free_list(struct id_list *list)
 {
-	int i;
+	struct id_pool *pool;
 
-	for (i = 0; i < list->size; i++)
-		free(list->list[i]);
-	free(list->list);
+	while (list->pool) {
+		pool = list->pool;
+		list->pool = pool->next;
+		free(pool);
+	}
+	free(list->hash);
+	memset(list, 0, sizeof(*list));
+}
+
+/* bulk invalidation, all entries are returned to the pool */
+static void clear_list(struct id_list *list)
+{
+	struct id_entry *e;
+	unsigned int i;
+
+	if (list->count == 0)
+		return;
+	for (i = 0; list->hash && i <= list->mask; i++) {
+		while (list->hash[i]) {
+			e = list->hash[i];
+			list->hash[i] = e->next;
+			e->next = list->free;
+			list->free = e;
+		}
+	}
+	list->count = 0;
 }
 
 static void card_free(struct card **card)
 {
 	struct card *c = *card;
 
+	free_list(&c->changed);
 	free_list(&c->blacklist);
 	free_list(&c->whitelist);
 	if (c->handle)
@@ -88,7 +148,27 @@ static void card_free(struct card **card)
 	*card = NULL;
 }
 
-static void add_card(struct card ***cards, int *count, const char *cardname)
+static int card_watch(int epfd, struct card *card, unsigned int slot)
+{
+	struct pollfd *pfd;
+	struct epoll_event ev;
+	int i;
+
+	pfd = alloca(sizeof(*pfd) * card->pfds);
+	if (snd_ctl_poll_descriptors(card->handle, pfd, card->pfds) != card->pfds)
+		return -EIO;
+	for (i = 0; i < card->pfds; i++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = ((uint64_t)slot << 32) | i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, pfd[i].fd, &ev) < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+static void add_card(int epfd, struct card ***cards, int *count,
+		     const char *cardname)
 {
 	struct card *card, **cc;
 	int i, index, findex;
@@ -109,6 +189,7 @@ static void add_card(struct card ***cards, int *count, const char *cardname)
 	if (card == NULL)
 		return;
 	card->index = index;
+	card->full = 1;
 	sprintf(device, "hw:%i", index);
 	if (snd_ctl_open(&card->handle, device, SND_CTL_READONLY|SND_CTL_NONBLOCK) < 0) {
 		card_free(&card);
@@ -123,21 +204,27 @@ static void add_card(struct card ***cards, int *count, const char *cardname)
 		card_free(&card);
 		return;
 	}
-	if (findex >= 0) {
-		(*cards)[findex] = card;
-	} else {
+	if (findex < 0) {
 		cc = realloc(*cards, sizeof(void *) * (*count + 1));
 		if (cc == NULL) {
 			card_free(&card);
 			return;
 		}
-		cc[*count] = card;
+		findex = *count;
+		cc[*count] = NULL;
 		*count = *count + 1;
 		*cards = cc;
 	}
+	if (card_watch(epfd, card, findex) < 0) {
+		error("cannot watch card %i", index);
+		card_free(&card);
+		return;
+	}
+	(*cards)[findex] = card;
+	dbg("card %i added", index);
 }
 
-static void add_cards(struct card ***cards, int *count)
+static void add_cards(int epfd, struct card ***cards, int *count)
 {
 	int card = -1;
 	char cardname[16];
@@ -149,94 +236,126 @@ static void add_cards(struct card ***cards, int *count)
 			break;
 		if (card >= 0) {
 			sprintf(cardname, "%i", card);
-			add_card(cards, count, cardname);
+			add_card(epfd, cards, count, cardname);
 		}
 	}
 }
 
-static int compare_ids(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2)
+static struct id_entry **find_in_list(struct id_list *list,
+				      unsigned int numid)
 {
-	if (id1 == NULL || id2 == NULL)
-		return 0;
-	return snd_ctl_elem_id_get_interface(id1) == snd_ctl_elem_id_get_interface(id2) &&
-	       snd_ctl_elem_id_get_index(id1) == snd_ctl_elem_id_get_index(id2) &&
-	       strcmp(snd_ctl_elem_id_get_name(id1), snd_ctl_elem_id_get_name(id2)) == 0 &&
-	       snd_ctl_elem_id_get_device(id1) == snd_ctl_elem_id_get_device(id2) &&
-	       snd_ctl_elem_id_get_subdevice(id1) == snd_ctl_elem_id_get_subdevice(id2);
+	struct id_entry **e;
+
+	if (list->hash == NULL)
+		return NULL;
+	for (e = &list->hash[numid & list->mask]; *e; e = &(*e)->next) {
+		if ((*e)->numid == numid)
+			return e;
+	}
+	return NULL;
 }
 
-static int in_list(struct id_list *list, snd_ctl_elem_id_t *id)
+static int in_list(struct id_list *list, unsigned int numid)
 {
-	int i;
-	snd_ctl_elem_id_t *id1;
-
-	for (i = 0; i < list->size; i++) {
-		id1 = list->list[i];
-		if (id1 == NULL)
-			continue;
-		if (compare_ids(id, id1))
-			return 1;
-	}
-	return 0;
+	return find_in_list(list, numid) != NULL;
 }
 
-static void remove_from_list(struct id_list *list, snd_ctl_elem_id_t *id)
+static void remove_from_list(struct id_list *list, unsigned int numid)
 {
-	int i;
+	struct id_entry **e, *n;
 
-	for (i = 0; i < list->size; i++) {
-		if (compare_ids(id, list->list[i])) {
-			free(list->list[i]);
-			list->list[i] = NULL;
+	e = find_in_list(list, numid);
+	if (e == NULL)
+		return;
+	n = *e;
+	*e = n->next;
+	n->next = list->free;
+	list->free = n;
+	list->count--;
+}
+
+static int grow_list(struct id_list *list)
+{
+	struct id_entry **hash, *e;
+	unsigned int i, size;
+
+	size = list->hash ? (list->mask + 1) * 2 : ID_HASH_MIN;
+	hash = calloc(size, sizeof(*hash));
+	if (hash == NULL)
+		return -ENOMEM;
+	for (i = 0; list->hash && i <= list->mask; i++) {
+		while (list->hash[i]) {
+			e = list->hash[i];
+			list->hash[i] = e->next;
+			e->next = hash[e->numid & (size - 1)];
+			hash[e->numid & (size - 1)] = e;
 		}
 	}
+	free(list->hash);
+	list->hash = hash;
+	list->mask = size - 1;
+	return 0;
 }
 
-static void add_to_list(struct id_list *list, snd_ctl_elem_id_t *id)
+static void add_to_list(struct id_list *list, unsigned int numid)
 {
-	snd_ctl_elem_id_t *id1;
-	snd_ctl_elem_id_t **n;
+	struct id_pool *pool;
+	struct id_entry *e;
 	int i;
 
-	if (snd_ctl_elem_id_malloc(&id1))
+	if (in_list(list, numid))
+		return;
+	if ((list->hash == NULL || list->count > list->mask) &&
+	    grow_list(list) < 0 && list->hash == NULL)
 		return;
-	snd_ctl_elem_id_copy(id1, id);
-	for (i = 0; i < list->size; i++) {
-		if (list->list[i] == NULL) {
-			list->list[i] = id1;
+	if (list->free == NULL) {
+		pool = malloc(sizeof(*pool));
+		if (pool == NULL)
 			return;
+		pool->next = list->pool;
+		list->pool = pool;
+		for (i = 0; i < ID_POOL_CHUNK; i++) {
+			pool->entries[i].next = list->free;
+			list->free = &pool->entries[i];
 		}
 	}
-	n = realloc(list->list, sizeof(void *) * (list->size + 1));
-	if (n == NULL)
-		return;
-	n[list->size] = id1;
-	list->size++;
-	list->list = n;
+	e = list->free;
+	list->free = e->next;
+	e->numid = numid;
+	e->next = list->hash[numid & list->mask];
+	list->hash[numid & list->mask] = e;
+	list->count++;
 }
 
 static int check_lists(struct card *card, snd_ctl_elem_id_t *id)
 {
+	unsigned int numid = snd_ctl_elem_id_get_numid(id);
 	snd_ctl_elem_info_t *info;
 	snd_ctl_elem_info_alloca(&info);
 
-	if (in_list(&card->blacklist, id))
+	if (in_list(&card->blacklist, numid))
 		return 0;
-	if (in_list(&card->whitelist, id))
+	if (in_list(&card->whitelist, numid))
 		return 1;
 	snd_ctl_elem_info_set_id(info, id);
 	if (snd_ctl_elem_info(card->handle, info) < 0)
 		return 0;
 	if (snd_ctl_elem_info_is_writable(info) ||
 	    snd_ctl_elem_info_is_tlv_writable(info)) {
-		add_to_list(&card->whitelist, id);
+		add_to_list(&card->whitelist, numid);
 		return 1;
 	} else {
-		add_to_list(&card->blacklist, id);
+		add_to_list(&card->blacklist, numid);
 		return 0;
 	}
 }
 
+static void mark_changed(struct card *card, snd_ctl_elem_id_t *id)
+{
+	if (!card->full)
+		add_to_list(&card->changed, snd_ctl_elem_id_get_numid(id));
+}
+
 static int card_events(struct card *card)
 {
 	int res = 0;
@@ -244,6 +363,7 @@ static int card_events(struct card *card)
 	snd_ctl_event_type_t type;
 	unsigned int mask;
 	snd_ctl_elem_id_t *id;
+	unsigned int numid;
 	snd_ctl_event_alloca(&ev);
 	snd_ctl_elem_id_alloca(&id);
 
@@ -253,25 +373,110 @@ static int card_events(struct card *card)
 			continue;
 		mask = snd_ctl_event_elem_get_mask(ev);
 		snd_ctl_event_elem_get_id(ev, id);
+		numid = snd_ctl_elem_id_get_numid(id);
 		if (mask == SND_CTL_EVENT_MASK_REMOVE) {
-			remove_from_list(&card->whitelist, id);
-			remove_from_list(&card->blacklist, id);
+			remove_from_list(&card->whitelist, numid);
+			remove_from_list(&card->blacklist, numid);
+			mark_changed(card, id);
 			continue;
 		}
 		if (mask & SND_CTL_EVENT_MASK_INFO) {
-			remove_from_list(&card->whitelist, id);
-			remove_from_list(&card->blacklist, id);
+			remove_from_list(&card->whitelist, numid);
+			remove_from_list(&card->blacklist, numid);
 		}
 		if (mask & (SND_CTL_EVENT_MASK_VALUE|
 			    SND_CTL_EVENT_MASK_ADD|
 			    SND_CTL_EVENT_MASK_TLV)) {
-			if (check_lists(card, id))
+			if (check_lists(card, id)) {
+				mark_changed(card, id);
 				res = 1;
+			}
 		}
 	}
 	return res;
 }
 
+static int card_flush(struct card *card, snd_config_t *config)
+{
+	snd_ctl_card_info_t *info;
+	snd_ctl_elem_id_t *id;
+	struct id_entry *e;
+	const char *cardid;
+	unsigned int i;
+	int err = 0;
+	snd_ctl_card_info_alloca(&info);
+	snd_ctl_elem_id_alloca(&id);
+
+	if (card->full)
+		goto _full;
+	if (card->changed.count == 0)
+		return 0;
+	err = snd_ctl_card_info(card->handle, info);
+	if (err < 0) {
+		error("snd_ctl_card_info error: %s", snd_strerror(err));
+		goto _full;
+	}
+	cardid = snd_ctl_card_info_get_id(info);
+	for (i = 0; i <= card->changed.mask; i++) {
+		for (e = card->changed.hash[i]; e; e = e->next) {
+			snd_ctl_elem_id_set_numid(id, e->numid);
+			err = state_mirror_control(config, card->handle,
+						   cardid, id);
+			if (err < 0)
+				goto _full;
+		}
+	}
+	dbg("card %i: %u controls updated", card->index, card->changed.count);
+	clear_list(&card->changed);
+	return 0;
+
+ _full:
+	clear_list(&card->changed);
+	err = state_mirror_card(config, card->index);
+	card->full = err < 0;
+	dbg("card %i: all controls updated (%i)", card->index, err);
+	return err;
+}
+
+static int same_file(struct stat *st1, struct stat *st2)
+{
+	return st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino &&
+	       st1->st_size == st2->st_size && st1->st_mtime == st2->st_mtime;
+}
+
+static void mirror_save(struct mirror *mirror, const char *file,
+			struct card **cards, int count)
+{
+	struct stat st;
+	int i;
+
+	if (stat(file, &st) < 0)
+		memset(&st, 0, sizeof(st));
+	/* the file was changed by somebody else (alsactl store) */
+	if (mirror->config && !same_file(&mirror->st, &st)) {
+		snd_config_delete(mirror->config);
+		mirror->config = NULL;
+	}
+	if (mirror->config == NULL) {
+		if (state_mirror_load(file, &mirror->config) < 0)
+			return;
+		for (i = 0; i < count; i++) {
+			if (cards[i] == NULL)
+				continue;
+			clear_list(&cards[i]->changed);
+			cards[i]->full = 1;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (cards[i] == NULL)
+			continue;
+		card_flush(cards[i], mirror->config);
+	}
+	state_mirror_save(file, mirror->config);
+	if (stat(file, &mirror->st) < 0)
+		memset(&mirror->st, 0, sizeof(mirror->st));
+}
+
 static long read_pid_file(const char *pidfile)
 {
 	int fd, err;
@@ -357,14 +562,65 @@ static int check_another_instance(const char *pidfile)
 	return 0;
 }
 
+static int hotplug_watch(int epfd, struct hotplug *hp)
+{
+	struct epoll_event ev;
+	int err;
+
+	err = hotplug_init(hp);
+	if (err < 0)
+		return err;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)EP_INOTIFY << 32;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, hp->fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+
+static void card_event(struct card **cards, unsigned int slot, unsigned int k,
+		       unsigned int events, int *changed)
+{
+	struct card *card = cards[slot];
+	struct pollfd *pfd;
+	unsigned short revents;
+	int i;
+
+	pfd = alloca(sizeof(*pfd) * card->pfds);
+	if (snd_ctl_poll_descriptors(card->handle, pfd, card->pfds) != card->pfds)
+		return;
+	for (i = 0; i < card->pfds; i++)
+		pfd[i].revents = i == k ? events : 0;
+	if (snd_ctl_poll_descriptors_revents(card->handle, pfd, card->pfds,
+					     &revents) < 0)
+		revents = POLLERR;
+	if (revents & (POLLERR|POLLNVAL|POLLHUP)) {
+		dbg("card %i removed", card->index);
+		card_free(&cards[slot]);
+	} else if (revents & POLLIN) {
+		if (card_events(card))
+			*changed = 1;
+	}
+}
+
+/*
+ * All descriptors are registered once to epoll, the new cards are
+ * detected using inotify and the state write is delayed using timerfd,
+ * so the daemon does not wake up when nothing happens.
+ */
 int state_daemon(const char *file, const char *cardname, int period,
 		 const char *pidfile)
 {
-	int count = 0, pcount, psize = 0, i, j, k, changed = 0;
-	time_t last_write, now;
-	unsigned short revents;
+	int count = 0, changed = 0, pending = 0, expired = 0, i, n;
+	int epfd = -1, tfd = -1;
+	unsigned int slot;
+	uint64_t expirations;
 	struct card **cards = NULL;
-	struct pollfd *pfd = NULL, *pfdn;
+	struct epoll_event evs[16], ev;
+	struct itimerspec its;
+	struct hotplug hp;
+	struct mirror mirror;
+	sigset_t mask, waitmask;
 
 	if (check_another_instance(pidfile))
 		return 0;
@@ -374,85 +630,110 @@ int state_daemon(const char *file, const char *cardname, int period,
 	signal(SIGINT, signal_handler_quit);
 	signal(SIGUSR1, signal_handler_rescan);
 	signal(SIGUSR2, signal_handler_save_and_quit);
+	/* the signals are delivered only in epoll_pwait() */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGABRT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, &waitmask);
+	sigdelset(&waitmask, SIGABRT);
+	sigdelset(&waitmask, SIGTERM);
+	sigdelset(&waitmask, SIGINT);
+	sigdelset(&waitmask, SIGUSR1);
+	sigdelset(&waitmask, SIGUSR2);
 	write_pid_file(pidfile);
-	time(&last_write);
+	memset(&mirror, 0, sizeof(mirror));
+	hp.fd = -1;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		error("epoll_create failed: %s", strerror(errno));
+		goto out;
+	}
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (tfd < 0) {
+		error("timerfd_create failed: %s", strerror(errno));
+		goto out;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)EP_TIMER << 32;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) < 0) {
+		error("epoll_ctl failed: %s", strerror(errno));
+		goto out;
+	}
+	/* without inotify, the new cards are added on SIGUSR1 only */
+	if (hotplug_watch(epfd, &hp) < 0)
+		error("cannot watch %s for new cards", DEV_SND_DIR);
 	while (!quit || save_now) {
 		if (save_now)
 			goto save;
 		if (rescan) {
+			rescan = 0;
 			if (cardname) {
-				add_card(&cards, &count, cardname);
+				add_card(epfd, &cards, &count, cardname);
 			} else {
-				add_cards(&cards, &count);
+				add_cards(epfd, &cards, &count);
 			}
 			snd_config_update_free_global();
-			rescan = 0;
 		}
-		for (i = pcount = 0; i < count; i++) {
-			if (cards[i] == NULL)
-				continue;
-			pcount += cards[i]->pfds;
-		}
-		if (pcount > psize) {
-			pfdn = realloc(pfd, sizeof(struct pollfd) * pcount);
-			if (pfdn) {
-				psize = pcount;
-				pfd = pfdn;
-			} else {
-				error("No enough memory...");
-				goto out;
-			}
-		}
-		for (i = j = 0; i < count; i++) {
-			if (cards[i] == NULL)
-				continue;
-			k = snd_ctl_poll_descriptors(cards[i]->handle, pfd + j, pcount - j);
-			if (k != cards[i]->pfds) {
-				error("poll prepare failed: %i", k);
-				goto out;
-			}
-			j += k;
-		}
-		i = poll(pfd, j, (period / 2) * 1000);
-		if (i < 0 && errno == EINTR)
+		n = epoll_pwait(epfd, evs, ARRAY_SIZE(evs), -1, &waitmask);
+		if (n < 0 && errno == EINTR)
 			continue;
-		if (i < 0) {
-			error("poll failed: %s", strerror(errno));
+		if (n < 0) {
+			error("epoll_wait failed: %s", strerror(errno));
 			break;
 		}
-		time(&now);
-		for (i = j = 0; i < count; i++) {
-			if (cards[i] == NULL)
-				continue;
-			k = snd_ctl_poll_descriptors_revents(cards[i]->handle,
-					pfd + j, cards[i]->pfds, &revents);
-			if (k < 0) {
-				error("poll post failed: %i\n", k);
-				goto out;
+		for (i = 0; i < n; i++) {
+			slot = evs[i].data.u64 >> 32;
+			if (slot == EP_INOTIFY) {
+				if (hotplug_events(&hp))
+					rescan = 1;
+			} else if (slot == EP_TIMER) {
+				if (read(tfd, &expirations, sizeof(expirations)) > 0 &&
+				    pending)
+					expired = 1;
+			} else if (slot < count && cards[slot]) {
+				card_event(cards, slot,
+					   evs[i].data.u64 & 0xffffffffU,
+					   evs[i].events, &changed);
 			}
-			j += cards[i]->pfds;
-			if (revents & (POLLERR|POLLNVAL)) {
-				card_free(&cards[i]);
-			} else if (revents & POLLIN) {
-				if (card_events(cards[i])) {
-					/* delay the write */
-					if (!changed)
-						last_write = now;
-					changed = 1;
-				}
+		}
+		/* delay the write */
+		if (changed && !pending) {
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = period;
+			if (timerfd_settime(tfd, 0, &its, NULL) == 0) {
+				pending = 1;
+			} else {
+				error("timerfd_settime failed: %s", strerror(errno));
+				expired = 1;
 			}
 		}
-		if ((now - last_write >= period && changed) || save_now) {
+		if ((changed && expired) || save_now) {
 save:
-			changed = save_now = 0;
-			save_state(file, cardname);
+			if (pending) {
+				memset(&its, 0, sizeof(its));
+				timerfd_settime(tfd, 0, &its, NULL);
+			}
+			changed = save_now = pending = expired = 0;
+			mirror_save(&mirror, file, cards, count);
 		}
 	}
 out:
-	free(pfd);
 	remove(pidfile);
 	for (i = 0; i < count; i++)
 		card_free(&cards[i]);
 	free(cards);
+	hotplug_close(&hp);
+	if (tfd >= 0)
+		close(tfd);
+	if (epfd >= 0)
+		close(epfd);
+	if (mirror.config)
+		snd_config_delete(mirror.config);
+	snd_config_update_free_global();
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
 	return 0;
 }
@@ -37,6 +37,7 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <math.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 #include "aconfig.h"
 #include "alsactl.h"
@@ -55,14 +56,111 @@ enum key_op {
 	KEY_OP_ASSIGN_FINAL
 };
 
+#define PAIR_HASH_SIZE	64
+
 struct pair {
 	char *key;
 	char *value;
 	struct pair *next;
 };
 
+/*
+ * The rules files are compiled once to the list of rules (one rule per
+ * line) with the classified keys and the resolved GOTO targets. The
+ * compiled files are cached (the cache is validated using the file
+ * stamp) and executed for each card.
+ */
+
+enum key_type {
+	KEY_UNKNOWN,
+	KEY_INVALID,		/* syntax error, the rest of the line */
+	KEY_LABEL,
+	KEY_CTL,
+	KEY_RESULT,
+	KEY_PROGRAM,
+	KEY_CARDINFO,
+	KEY_ATTR,
+	KEY_ENV,
+	KEY_GOTO,
+	KEY_INCLUDE,
+	KEY_ACCESS,
+	KEY_PRINT,
+	KEY_ERROR,
+	KEY_EXIT,
+	KEY_CONFIG
+};
+
+struct rule_key {
+	enum key_type type;
+	enum key_op op;
+	char *key;
+	char *value;
+	char *attr;		/* KEY{attr} */
+	int jump_rule;		/* GOTO target, -1 = end of file */
+	int jump_key;
+};
+
+struct rule {
+	int linenum;
+	int too_long;
+	int count;
+	struct rule_key *keys;
+	char *line;		/* storage for key and value strings */
+};
+
+struct rules {
+	struct rules *next;
+	char *filename;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	int count;
+	struct rule *rules;
+};
+
+static struct rules *rules_cache;
+
+/*
+ * The per-card control index is built once when the card is opened.
+ * The exact ids are hashed, the wildcard name patterns are served from
+ * the name trie. The element info, the values and the enum item names
+ * are read once and reused by the following rules.
+ */
+
+#define CTL_HASH_SIZE	256
+
+struct ctl_elem {
+	snd_hctl_elem_t *elem;
+	unsigned int pos;		/* position in the hctl list */
+	struct ctl_elem *hnext;		/* hash chain */
+	struct ctl_elem *nnext;		/* same name, hctl order */
+	snd_ctl_elem_info_t *info;
+	unsigned int info_gen;		/* valid if equal to index gen */
+	snd_ctl_elem_value_t *value;
+	unsigned int value_gen;		/* valid if equal to index gen */
+	unsigned int nitems;
+	char **items;			/* enum item names */
+};
+
+struct ctl_trie {
+	char c;
+	struct ctl_trie *child;
+	struct ctl_trie *next;
+	struct ctl_elem *elems, *last;	/* names ending at this node */
+};
+
+struct ctl_index {
+	unsigned int count;
+	struct ctl_elem *elems;
+	struct ctl_elem *hash[CTL_HASH_SIZE];
+	struct ctl_trie root;
+	struct ctl_elem **match;	/* search result */
+	unsigned int value_gen;		/* bumped by each write or program */
+};
+
 struct space {
-	struct pair *pairs;
+	struct pair *pairs[PAIR_HASH_SIZE];
 	char *rootdir;
 	char *go_to;
 	char *program_result;
@@ -71,8 +169,12 @@ struct space {
 	int log_run;
 	int exit_code;
 	int quit;
+	long long sysfs_time;		/* profiling in usec (debug mode) */
+	long long program_time;
 	unsigned int ctl_id_changed;
 	snd_hctl_t *ctl_handle;
+	struct ctl_index ctl_index;
+	struct ctl_elem *ctl_elem;	/* element of ctl_id */
 	snd_ctl_card_info_t *ctl_card_info;
 	snd_ctl_elem_id_t *ctl_id;
 	snd_ctl_elem_info_t *ctl_info;
@@ -94,19 +196,45 @@ static void Perror(struct space *space, const char *fmt, ...)
 #include "init_utils_run.c"
 #include "init_sysfs.c"
 
+static long long prof_time(void)
+{
+	struct timespec ts;
+
+	if (!debugflag)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static char *sysfs_attr_get(struct space *space, const char *devpath,
+			    const char *attr_name)
+{
+	long long start = prof_time();
+	char *value;
+
+	value = sysfs_attr_get_value(devpath, attr_name);
+	space->sysfs_time += prof_time() - start;
+	return value;
+}
+
+static void ctl_index_free(struct ctl_index *index);
+
 static void free_space(struct space *space)
 {
-	struct pair *pair = space->pairs;
-	struct pair *next = pair;
+	struct pair *pair, *next;
+	int i;
 
-	while (next) {
-		pair = next;
-		next = pair->next;
-		free(pair->value);
-		free(pair->key);
-		free(pair);
+	for (i = 0; i < PAIR_HASH_SIZE; i++) {
+		next = space->pairs[i];
+		while (next) {
+			pair = next;
+			next = pair->next;
+			free(pair->value);
+			free(pair->key);
+			free(pair);
+		}
+		space->pairs[i] = NULL;
 	}
-	space->pairs = NULL;
 	if (space->ctl_value) {
 		snd_ctl_elem_value_free(space->ctl_value);
 		space->ctl_value = NULL;
@@ -123,6 +251,7 @@ static void free_space(struct space *space)
 		snd_ctl_card_info_free(space->ctl_card_info);
 		space->ctl_card_info = NULL;
 	}
+	ctl_index_free(&space->ctl_index);
 	if (space->ctl_handle) {
 		snd_hctl_close(space->ctl_handle);
 		space->ctl_handle = NULL;
@@ -136,9 +265,18 @@ static void free_space(struct space *space)
 	free(space);
 }
 
+static unsigned int pair_hash(const char *key)
+{
+	unsigned int hash = 5381;
+
+	while (*key)
+		hash = hash * 33 + (unsigned char)*key++;
+	return hash % PAIR_HASH_SIZE;
+}
+
 static struct pair *value_find(struct space *space, const char *key)
 {
-	struct pair *pair = space->pairs;
+	struct pair *pair = space->pairs[pair_hash(key)];
 	
 	while (pair && strcmp(pair->key, key) != 0)
 		pair = pair->next;
@@ -170,16 +308,345 @@ static int value_set(struct space *space, const char *key, const char *value)
 			free(pair);
 			return -ENOMEM;
 		}
-		pair->next = space->pairs;
-		space->pairs = pair;
+		pair->next = space->pairs[pair_hash(key)];
+		space->pairs[pair_hash(key)] = pair;
+	}
+	return 0;
+}
+
+static unsigned int ctl_hash(snd_ctl_elem_iface_t iface,
+			     unsigned int device, unsigned int subdevice,
+			     const char *name, unsigned int index)
+{
+	unsigned int hash = 5381;
+
+	hash = hash * 33 + iface;
+	hash = hash * 33 + device;
+	hash = hash * 33 + subdevice;
+	hash = hash * 33 + index;
+	while (*name)
+		hash = hash * 33 + (unsigned char)*name++;
+	return hash % CTL_HASH_SIZE;
+}
+
+static unsigned int ctl_elem_hash(snd_hctl_elem_t *elem)
+{
+	return ctl_hash(snd_hctl_elem_get_interface(elem),
+			snd_hctl_elem_get_device(elem),
+			snd_hctl_elem_get_subdevice(elem),
+			snd_hctl_elem_get_name(elem),
+			snd_hctl_elem_get_index(elem));
+}
+
+static struct ctl_trie *trie_child(struct ctl_trie *node, char c, int create)
+{
+	struct ctl_trie *t;
+
+	for (t = node->child; t; t = t->next)
+		if (t->c == c)
+			return t;
+	if (!create)
+		return NULL;
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->c = c;
+	t->next = node->child;
+	node->child = t;
+	return t;
+}
+
+static void trie_free(struct ctl_trie *node)
+{
+	struct ctl_trie *t, *next;
+
+	for (t = node->child; t; t = next) {
+		next = t->next;
+		trie_free(t);
+		free(t);
+	}
+	node->child = NULL;
+}
+
+static void ctl_elem_items_free(struct ctl_elem *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->nitems; i++)
+		free(e->items[i]);
+	free(e->items);
+	e->items = NULL;
+	e->nitems = 0;
+}
+
+static void ctl_index_free(struct ctl_index *index)
+{
+	struct ctl_elem *e;
+	unsigned int i;
+
+	for (i = 0; i < index->count; i++) {
+		e = &index->elems[i];
+		if (e->info)
+			snd_ctl_elem_info_free(e->info);
+		if (e->value)
+			snd_ctl_elem_value_free(e->value);
+		ctl_elem_items_free(e);
+	}
+	free(index->elems);
+	free(index->match);
+	trie_free(&index->root);
+	memset(index, 0, sizeof(*index));
+}
+
+static int ctl_index_build(struct ctl_index *index, snd_hctl_t *handle)
+{
+	snd_hctl_elem_t *elem;
+	struct ctl_elem *e;
+	struct ctl_trie *node;
+	const char *name;
+	unsigned int count, h;
+
+	count = snd_hctl_get_count(handle);
+	index->elems = calloc(count + 1, sizeof(*index->elems));
+	index->match = calloc(count + 1, sizeof(*index->match));
+	if (index->elems == NULL || index->match == NULL)
+		return -ENOMEM;
+	for (elem = snd_hctl_first_elem(handle); elem && index->count < count;
+	     elem = snd_hctl_elem_next(elem)) {
+		e = &index->elems[index->count];
+		e->elem = elem;
+		e->pos = index->count++;
+		h = ctl_elem_hash(elem);
+		e->hnext = index->hash[h];
+		index->hash[h] = e;
+		node = &index->root;
+		for (name = snd_hctl_elem_get_name(elem); *name && node; name++)
+			node = trie_child(node, *name, 1);
+		if (node == NULL)
+			return -ENOMEM;
+		if (node->last)
+			node->last->nnext = e;
+		else
+			node->elems = e;
+		node->last = e;
+	}
+	dbg("control index: %u elements", index->count);
+	return 0;
+}
+
+/* exact lookup, like snd_hctl_find_elem() without numid */
+static struct ctl_elem *ctl_index_find(struct ctl_index *index,
+				       snd_ctl_elem_id_t *id)
+{
+	struct ctl_elem *e;
+	const char *name = snd_ctl_elem_id_get_name(id);
+	snd_ctl_elem_iface_t iface = snd_ctl_elem_id_get_interface(id);
+	unsigned int device = snd_ctl_elem_id_get_device(id);
+	unsigned int subdevice = snd_ctl_elem_id_get_subdevice(id);
+	unsigned int idx = snd_ctl_elem_id_get_index(id);
+
+	e = index->hash[ctl_hash(iface, device, subdevice, name, idx)];
+	for (; e; e = e->hnext) {
+		if (snd_hctl_elem_get_interface(e->elem) == iface &&
+		    snd_hctl_elem_get_device(e->elem) == device &&
+		    snd_hctl_elem_get_subdevice(e->elem) == subdevice &&
+		    snd_hctl_elem_get_index(e->elem) == idx &&
+		    strcmp(snd_hctl_elem_get_name(e->elem), name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static unsigned int trie_collect(struct ctl_trie *node, struct ctl_elem **res,
+				 unsigned int count)
+{
+	struct ctl_elem *e;
+	struct ctl_trie *t;
+
+	for (e = node->elems; e; e = e->nnext)
+		res[count++] = e;
+	for (t = node->child; t; t = t->next)
+		count = trie_collect(t, res, count);
+	return count;
+}
+
+static int ctl_elem_cmp(const void *a, const void *b)
+{
+	const struct ctl_elem *e1 = *(const struct ctl_elem **)a;
+	const struct ctl_elem *e2 = *(const struct ctl_elem **)b;
+
+	return e1->pos < e2->pos ? -1 : e1->pos > e2->pos;
+}
+
+static int ctl_match(snd_ctl_elem_id_t *pattern, snd_hctl_elem_t *elem)
+{
+	if (snd_ctl_elem_id_get_interface(pattern) != -1 &&
+	    snd_ctl_elem_id_get_interface(pattern) != snd_hctl_elem_get_interface(elem))
+	    	return 0;
+	if (snd_ctl_elem_id_get_device(pattern) != -1 &&
+	    snd_ctl_elem_id_get_device(pattern) != snd_hctl_elem_get_device(elem))
+		return 0;
+	if (snd_ctl_elem_id_get_subdevice(pattern) != -1 &&
+	    snd_ctl_elem_id_get_subdevice(pattern) != snd_hctl_elem_get_subdevice(elem))
+	    	return 0;
+	if (snd_ctl_elem_id_get_index(pattern) != -1 &&
+	    snd_ctl_elem_id_get_index(pattern) != snd_hctl_elem_get_index(elem))
+	    	return 0;
+	if (fnmatch(snd_ctl_elem_id_get_name(pattern), snd_hctl_elem_get_name(elem), 0) != 0)
+		return 0;
+	return 1;
+}
+
+/*
+ * Find the elements matching the pattern (-1 fields and the fnmatch name)
+ * in the hctl order. The literal prefix of the name selects the trie
+ * subtree, only the elements below it are matched.
+ */
+static unsigned int ctl_index_search(struct ctl_index *index,
+				     snd_ctl_elem_id_t *pattern,
+				     struct ctl_elem ***res)
+{
+	struct ctl_trie *node = &index->root;
+	struct ctl_elem *e;
+	const char *name = snd_ctl_elem_id_get_name(pattern);
+	unsigned int i, count = 0, found = 0;
+	size_t len;
+
+	len = strcspn(name, "*?[\\");
+	for (i = 0; i < len && node; i++)
+		node = trie_child(node, name[i], 0);
+	if (node) {
+		if (name[len] == '\0') {
+			/* the same name, already in the hctl order */
+			for (e = node->elems; e; e = e->nnext)
+				index->match[count++] = e;
+		} else {
+			count = trie_collect(node, index->match, 0);
+			qsort(index->match, count, sizeof(*index->match),
+			      ctl_elem_cmp);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (ctl_match(pattern, index->match[i]->elem))
+			index->match[found++] = index->match[i];
+	}
+	*res = index->match;
+	return found;
+}
+
+/* the info is read again after a write or program, like the value */
+static int ctl_elem_info(struct ctl_index *index, struct ctl_elem *e,
+			 snd_ctl_elem_info_t *info)
+{
+	int err;
+
+	if (e->info == NULL || e->info_gen != index->value_gen) {
+		if (e->info == NULL) {
+			err = snd_ctl_elem_info_malloc(&e->info);
+			if (err < 0)
+				return err;
+		}
+		ctl_elem_items_free(e);
+		err = snd_hctl_elem_info(e->elem, e->info);
+		if (err < 0) {
+			snd_ctl_elem_info_free(e->info);
+			e->info = NULL;
+			return err;
+		}
+		e->info_gen = index->value_gen;
+	}
+	if (info)
+		snd_ctl_elem_info_copy(info, e->info);
+	return 0;
+}
+
+static int ctl_elem_read(struct ctl_index *index, struct ctl_elem *e,
+			 snd_ctl_elem_value_t *value)
+{
+	int err;
+
+	err = ctl_elem_info(index, e, NULL);
+	if (err < 0)
+		return err;
+	if (e->value && e->value_gen == index->value_gen) {
+		snd_ctl_elem_value_copy(value, e->value);
+		return 0;
+	}
+	err = snd_hctl_elem_read(e->elem, value);
+	if (err < 0)
+		return err;
+	if (snd_ctl_elem_info_is_volatile(e->info))
+		return 0;
+	if (e->value == NULL && snd_ctl_elem_value_malloc(&e->value) < 0)
+		return 0;
+	snd_ctl_elem_value_copy(e->value, value);
+	e->value_gen = index->value_gen;
+	return 0;
+}
+
+static int ctl_elem_write(struct space *space, struct ctl_elem *e,
+			  snd_ctl_elem_value_t *value)
+{
+	struct ctl_index *index = &space->ctl_index;
+	snd_ctl_elem_value_t *old;
+	int err;
+
+	err = ctl_elem_info(index, e, NULL);
+	if (err < 0)
+		return err;
+	if (skip_unchanged) {
+		snd_ctl_elem_value_alloca(&old);
+		if (ctl_elem_read(index, e, old) == 0 &&
+		    ctl_value_equal(snd_ctl_elem_info_get_type(e->info),
+				    snd_ctl_elem_info_get_count(e->info),
+				    old, value)) {
+			dbg("ctl write skipped (unchanged)");
+			return 0;
+		}
+	}
+	err = snd_ctl_elem_write(snd_hctl_ctl(space->ctl_handle), value);
+	if (err < 0)
+		return err;
+	/* the write might change other controls */
+	index->value_gen++;
+	if (e->value && !snd_ctl_elem_info_is_volatile(e->info)) {
+		snd_ctl_elem_value_copy(e->value, value);
+		e->value_gen = index->value_gen;
 	}
 	return 0;
 }
 
+static const char *ctl_elem_item(struct ctl_index *index, struct ctl_elem *e,
+				 unsigned int item)
+{
+	snd_ctl_elem_info_t *info;
+	unsigned int idx, items;
+
+	if (ctl_elem_info(index, e, NULL) < 0 ||
+	    item >= snd_ctl_elem_info_get_items(e->info))
+		return NULL;
+	if (e->items == NULL) {
+		items = snd_ctl_elem_info_get_items(e->info);
+		e->items = calloc(items, sizeof(*e->items));
+		if (e->items == NULL)
+			return NULL;
+		e->nitems = items;
+		snd_ctl_elem_info_alloca(&info);
+		snd_ctl_elem_info_copy(info, e->info);
+		for (idx = 0; idx < items; idx++) {
+			snd_ctl_elem_info_set_item(info, idx);
+			if (snd_hctl_elem_info(e->elem, info) < 0)
+				break;
+			e->items[idx] = strdup(snd_ctl_elem_info_get_item_name(info));
+		}
+	}
+	return e->items[item];
+}
+
 static int init_space(struct space **space, int card)
 {
 	struct space *res;
-	char device[16];
+	snd_ctl_t *ctl;
 	int err;
 
 	res = calloc(1, sizeof(struct space));
@@ -187,11 +654,18 @@ static int init_space(struct space **space, int card)
 		return -ENOMEM;
 	res->ctl_id_changed = ~0;
 	res->linenum = -1;
-	sprintf(device, "hw:%u", card);
-	err = snd_hctl_open(&res->ctl_handle, device, 0);
+	err = card_ctl_open(&ctl, card, 0);
 	if (err < 0)
 		goto error;
+	err = snd_hctl_open_ctl(&res->ctl_handle, ctl);
+	if (err < 0) {
+		snd_ctl_close(ctl);
+		goto error;
+	}
 	err = snd_hctl_load(res->ctl_handle);
+	if (err < 0)
+		goto error;
+	err = ctl_index_build(&res->ctl_index, res->ctl_handle);
 	if (err < 0)
 		goto error;
 	err = snd_ctl_card_info_malloc(&res->ctl_card_info);
@@ -241,28 +715,27 @@ static const char *cardinfo_get(struct space *space, const char *attr)
 
 static int check_id_changed(struct space *space, unsigned int what)
 {
-	snd_hctl_elem_t *elem;
 	int err;
 
 	if ((space->ctl_id_changed & what & 1) != 0) {
-		snd_ctl_elem_id_set_numid(space->ctl_id, 0);
-		elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
-		if (!elem)
+		space->ctl_elem = ctl_index_find(&space->ctl_index, space->ctl_id);
+		if (!space->ctl_elem)
 			return -ENOENT;
-		err = snd_hctl_elem_info(elem, space->ctl_info);
-		if (err == 0)
-			space->ctl_id_changed &= ~1;
-		return err;
+		err = ctl_elem_info(&space->ctl_index, space->ctl_elem,
+				    space->ctl_info);
+		if (err < 0)
+			return err;
+		space->ctl_id_changed &= ~1;
 	}
 	if ((space->ctl_id_changed & what & 2) != 0) {
-		snd_ctl_elem_id_set_numid(space->ctl_id, 0);
-		elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
-		if (!elem)
+		if ((space->ctl_id_changed & 1) != 0)
+			space->ctl_elem = ctl_index_find(&space->ctl_index, space->ctl_id);
+		if (!space->ctl_elem)
 			return -ENOENT;
-		err = snd_hctl_elem_read(elem, space->ctl_value);
-		if (err == 0)
-			space->ctl_id_changed &= ~2;
-		return err;
+		err = ctl_elem_read(&space->ctl_index, space->ctl_elem, space->ctl_value);
+		if (err < 0)
+			return err;
+		space->ctl_id_changed &= ~2;
 	}
 	return 0;
 }
@@ -343,7 +816,6 @@ static int set_ctl_value(struct space *space, const char *value, int all)
 	snd_ctl_elem_type_t type;
 	unsigned int idx, idx2, count, items;
 	const char *pos, *pos2;
-	snd_hctl_elem_t *elem;
 	int val;
 	long lval;
 
@@ -432,14 +904,11 @@ static int set_ctl_value(struct space *space, const char *value, int all)
 				remove_trailing_chars((char *)value, ' ');
 				items = snd_ctl_elem_info_get_items(space->ctl_info);
 				for (idx2 = 0; idx2 < items; idx2++) {
-					snd_ctl_elem_info_set_item(space->ctl_info, idx2);
-					elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
-					if (elem == NULL)
+					pos2 = ctl_elem_item(&space->ctl_index,
+							     space->ctl_elem, idx2);
+					if (pos2 == NULL)
 						return -ENOENT;
-					val = snd_hctl_elem_info(elem, space->ctl_info);
-					if (val < 0)
-						return val;
-					if (strcasecmp(snd_ctl_elem_info_get_item_name(space->ctl_info), value) == 0) {
+					if (strcasecmp(pos2, value) == 0) {
 						snd_ctl_elem_value_set_enumerated(space->ctl_value, idx, idx2);
 						break;
 					}
@@ -506,25 +975,6 @@ static int do_match(const char *key, enum key_op op,
 	return 0;
 }
 
-static int ctl_match(snd_ctl_elem_id_t *pattern, snd_ctl_elem_id_t *id)
-{
-	if (snd_ctl_elem_id_get_interface(pattern) != -1 &&
-	    snd_ctl_elem_id_get_interface(pattern) != snd_ctl_elem_id_get_interface(id))
-	    	return 0;
-	if (snd_ctl_elem_id_get_device(pattern) != -1 &&
-	    snd_ctl_elem_id_get_device(pattern) != snd_ctl_elem_id_get_device(id))
-		return 0;
-	if (snd_ctl_elem_id_get_subdevice(pattern) != -1 &&
-	    snd_ctl_elem_id_get_subdevice(pattern) != snd_ctl_elem_id_get_subdevice(id))
-	    	return 0;
-	if (snd_ctl_elem_id_get_index(pattern) != -1 &&
-	    snd_ctl_elem_id_get_index(pattern) != snd_ctl_elem_id_get_index(id))
-	    	return 0;
-	if (fnmatch(snd_ctl_elem_id_get_name(pattern), snd_ctl_elem_id_get_name(id), 0) != 0)
-		return 0;
-	return 1;
-}
-
 static const char *elemid_get(struct space *space, const char *attr)
 {
 	long long val;
@@ -670,7 +1120,7 @@ dbvalue:
 	}
 	if (strncasecmp(attr, "enums", 5) == 0) {
 		unsigned int idx, items;
-		snd_hctl_elem_t *elem;
+		const char *item;
 		if (check_id_changed(space, 1))
 			return NULL;
 		if (snd_ctl_elem_info_get_type(space->ctl_info) != SND_CTL_ELEM_TYPE_ENUMERATED)
@@ -678,64 +1128,36 @@ dbvalue:
 		items = snd_ctl_elem_info_get_items(space->ctl_info);
 		strcpy(res, "|");
 		for (idx = 0; idx < items; idx++) {
-			snd_ctl_elem_info_set_item(space->ctl_info, idx);
-			elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
-			if (elem == NULL)
-				break;
-			if (snd_hctl_elem_info(elem, space->ctl_info) < 0)
+			item = ctl_elem_item(&space->ctl_index,
+					     space->ctl_elem, idx);
+			if (item == NULL)
 				break;
-			strlcat(res, snd_ctl_elem_info_get_item_name(space->ctl_info), sizeof(res));
+			strlcat(res, item, sizeof(res));
 			strlcat(res, "|", sizeof(res));
 		}
 		return res;
 	}
 	if (strncasecmp(attr, "do_search", 9) == 0) {
-		int err, index = 0;
-		snd_hctl_elem_t *elem;
-		snd_ctl_elem_id_t *id;
+		struct ctl_elem **match;
+		unsigned int count;
+		int index = 0;
 		char *pos = strchr(attr, ' ');
 		if (pos)
 			index = strtol(pos, NULL, 0);
-		err = snd_ctl_elem_id_malloc(&id);
-		if (err < 0)
-			return NULL;
-		elem = snd_hctl_first_elem(space->ctl_handle);
-		while (elem) {
-			snd_hctl_elem_get_id(elem, id);
-			if (!ctl_match(space->ctl_id, id))
-				goto next_search;
-			if (index > 0) {
-				index--;
-				goto next_search;
-			}
+		count = ctl_index_search(&space->ctl_index, space->ctl_id, &match);
+		if (index >= 0 && (unsigned int)index < count) {
 			strcpy(res, "1");
-			snd_ctl_elem_id_copy(space->ctl_id, id);
-			snd_ctl_elem_id_free(id);
+			snd_hctl_elem_get_id(match[index]->elem, space->ctl_id);
+			space->ctl_id_changed = ~0;
 			dbg("do_ctl_search found a control");
 			return res;
-		      next_search:
-			elem = snd_hctl_elem_next(elem);
 		}
-		snd_ctl_elem_id_free(id);
 		strcpy(res, "0");
 		return res;
 	}
 	if (strncasecmp(attr, "do_count", 8) == 0) {
-		int err, index = 0;
-		snd_hctl_elem_t *elem;
-		snd_ctl_elem_id_t *id;
-		err = snd_ctl_elem_id_malloc(&id);
-		if (err < 0)
-			return NULL;
-		elem = snd_hctl_first_elem(space->ctl_handle);
-		while (elem) {
-			snd_hctl_elem_get_id(elem, id);
-			if (ctl_match(space->ctl_id, id))
-				index++;
-			elem = snd_hctl_elem_next(elem);
-		}
-		snd_ctl_elem_id_free(id);
-		sprintf(res, "%u", index);
+		struct ctl_elem **match;
+		sprintf(res, "%u", ctl_index_search(&space->ctl_index, space->ctl_id, &match));
 		dbg("do_ctl_count found %s controls", res);
 		return res;
 	}
@@ -819,7 +1241,7 @@ static int elemid_set(struct space *space, const char *attr, const char *value)
 		} else {
 			space->ctl_id_changed &= ~2;
 			snd_ctl_elem_value_set_id(space->ctl_value, space->ctl_id);
-			err = snd_ctl_elem_write(snd_hctl_ctl(space->ctl_handle), space->ctl_value);
+			err = ctl_elem_write(space, space->ctl_elem, space->ctl_value);
 			if (err < 0) {
 				Perror(space, "value write error: %s", snd_strerror(err));
 				return err;
@@ -939,30 +1361,6 @@ static int get_key(char **line, char **key, enum key_op *op, char **value)
 	return 0;
 }
 
-/* extract possible KEY{attr} */
-static char *get_key_attribute(struct space *space, char *str, char *res, size_t ressize)
-{
-	char *pos;
-	char *attr;
-
-	attr = strchr(str, '{');
-	if (attr != NULL) {
-		attr++;
-		pos = strchr(attr, '}');
-		if (pos == NULL) {
-			Perror(space, "missing closing brace for format");
-			return NULL;
-		}
-		pos[0] = '\0';
-		strlcpy(res, attr, ressize);
-		pos[0] = '}';
-		dbg("attribute='%s'", res);
-		return res;
-	}
-
-	return NULL;
-}
-
 /* extract possible {attr} and move str behind it */
 static char *get_format_attribute(struct space *space, char **str)
 {
@@ -1158,7 +1556,7 @@ found:
 				pair = value_find(space, "sysfs_device");
 				if (pair == NULL)
 					break;
-				value = sysfs_attr_get_value(pair->value, attr);
+				value = sysfs_attr_get(space, pair->value, attr);
 
 				if (value == NULL)
 					break;
@@ -1285,43 +1683,346 @@ static int conf_name_filter(const struct dirent *d)
 	return ext && !strcmp(ext, ".conf");
 }
 
-static int parse_line(struct space *space, char *line, size_t linesize)
+static void rules_free(struct rules *rules)
 {
-	char *linepos;
-	char *key, *value, *attr, *temp;
-	struct pair *pair;
+	int i, k;
+
+	for (i = 0; i < rules->count; i++) {
+		for (k = 0; k < rules->rules[i].count; k++)
+			free(rules->rules[i].keys[k].attr);
+		free(rules->rules[i].keys);
+		free(rules->rules[i].line);
+	}
+	free(rules->rules);
+	free(rules->filename);
+	free(rules);
+}
+
+static enum key_type key_type(const char *key)
+{
+	/* the order of the original key checks */
+	if (strncasecmp(key, "LABEL", 5) == 0)
+		return KEY_LABEL;
+	if (strncasecmp(key, "CTL{", 4) == 0)
+		return KEY_CTL;
+	if (strcasecmp(key, "RESULT") == 0)
+		return KEY_RESULT;
+	if (strcasecmp(key, "PROGRAM") == 0)
+		return KEY_PROGRAM;
+	if (strncasecmp(key, "CARDINFO{", 9) == 0)
+		return KEY_CARDINFO;
+	if (strncasecmp(key, "ATTR{", 5) == 0)
+		return KEY_ATTR;
+	if (strncasecmp(key, "ENV{", 4) == 0)
+		return KEY_ENV;
+	if (strcasecmp(key, "GOTO") == 0)
+		return KEY_GOTO;
+	if (strcasecmp(key, "INCLUDE") == 0)
+		return KEY_INCLUDE;
+	if (strncasecmp(key, "ACCESS", 6) == 0)
+		return KEY_ACCESS;
+	if (strncasecmp(key, "PRINT", 5) == 0)
+		return KEY_PRINT;
+	if (strncasecmp(key, "ERROR", 5) == 0)
+		return KEY_ERROR;
+	if (strncasecmp(key, "EXIT", 4) == 0)
+		return KEY_EXIT;
+	if (strncasecmp(key, "CONFIG{", 7) == 0)
+		return KEY_CONFIG;
+	return KEY_UNKNOWN;
+}
+
+static char *rule_key_attr(struct space *space, struct rule_key *rkey)
+{
+	if (rkey->attr == NULL)
+		Perror(space, "missing closing brace for format");
+	return rkey->attr;
+}
+
+/* extract KEY{attr} */
+static char *compile_attr(const char *key)
+{
+	const char *attr, *pos;
+	char *res;
+	size_t len;
+
+	attr = strchr(key, '{');
+	if (attr == NULL)
+		return NULL;
+	attr++;
+	pos = strchr(attr, '}');
+	if (pos == NULL)
+		return NULL;
+	len = pos - attr;
+	if (len > PATH_SIZE - 1)
+		len = PATH_SIZE - 1;
+	res = malloc(len + 1);
+	if (res == NULL)
+		return NULL;
+	memcpy(res, attr, len);
+	res[len] = '\0';
+	return res;
+}
+
+static int compile_line(struct rule *rule, char *line)
+{
+	struct rule_key *rkey, *n;
+	char *linepos, *key, *value;
 	enum key_op op;
-	int err = 0, count;
-	char string[PATH_SIZE];
-	char result[PATH_SIZE];
+	int err, alloc = 0;
 
+	rule->line = line;
 	linepos = line;
 	while (*linepos != '\0') {
+		if (rule->count >= alloc) {
+			alloc += 8;
+			n = realloc(rule->keys, sizeof(*n) * alloc);
+			if (n == NULL)
+				return -ENOMEM;
+			rule->keys = n;
+		}
+		rkey = &rule->keys[rule->count++];
+		memset(rkey, 0, sizeof(*rkey));
+		rkey->jump_rule = -1;
 		op = KEY_OP_UNSET;
-		
 		err = get_key(&linepos, &key, &op, &value);
-		if (err < 0)
+		if (err < 0) {
+			rkey->type = KEY_INVALID;
+			break;
+		}
+		rkey->type = key_type(key);
+		rkey->op = op;
+		rkey->key = key;
+		rkey->value = value;
+		switch (rkey->type) {
+		case KEY_CTL:
+		case KEY_CARDINFO:
+		case KEY_ATTR:
+		case KEY_ENV:
+		case KEY_CONFIG:
+			rkey->attr = compile_attr(key);
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the LABEL for GOTO. The lines after GOTO are skipped until
+ * a line starting with the matching LABEL, the invalid lines stop
+ * the search (the error is reported when they are executed).
+ */
+static void compile_goto(struct rules *rules, int r, int k)
+{
+	struct rule_key *rkey = &rules->rules[r].keys[k];
+	struct rule *rule;
+	int i;
+
+	for (k++; r < rules->count; r++, k = 0) {
+		rule = &rules->rules[r];
+		if (rule->too_long)
+			goto found;
+		for (i = k; i < rule->count; i++) {
+			if (rule->keys[i].type == KEY_INVALID)
+				goto found;
+			if (rule->keys[i].type != KEY_LABEL)
+				break;
+			if (rule->keys[i].op != KEY_OP_ASSIGN)
+				goto found;
+			if (strcmp(rule->keys[i].value, rkey->value) == 0) {
+				i++;
+				goto found;
+			}
+		}
+	}
+	return;
+
+ found:
+	rkey->jump_rule = r;
+	rkey->jump_key = i;
+	return;
+}
+
+static struct rules *compile(const char *filename, struct stat *st)
+{
+	struct rules *rules;
+	struct rule *rule;
+	char *buf, *bufline, *line;
+	size_t bufsize, pos, count;
+	unsigned int linenum, i, j, linenum_adj;
+	int alloc = 0, err = 0, r, k;
+
+	if (file_map(filename, &buf, &bufsize) != 0) {
+		err = errno;
+		error("Unable to open file '%s': %s", filename, strerror(err));
+		errno = err;
+		return NULL;
+	}
+	rules = calloc(1, sizeof(*rules));
+	if (rules == NULL)
+		goto _nomem;
+	rules->filename = strdup(filename);
+	if (rules->filename == NULL)
+		goto _nomem;
+	rules->dev = st->st_dev;
+	rules->ino = st->st_ino;
+	rules->size = st->st_size;
+	rules->mtime = st->st_mtime;
+	pos = 0;
+	linenum = 0;
+	while (pos < bufsize) {
+		count = line_width(buf, bufsize, pos);
+		bufline = buf + pos;
+		pos += count + 1;
+		linenum++;
+
+		/* skip whitespaces */
+		while (count > 0 && isspace(bufline[0])) {
+			bufline++;
+			count--;
+		}
+		if (count == 0)
+			continue;
+
+		/* comment check */
+		if (bufline[0] == '#')
+			continue;
+
+		if (rules->count >= alloc) {
+			alloc += 64;
+			rule = realloc(rules->rules, sizeof(*rule) * alloc);
+			if (rule == NULL)
+				goto _nomem;
+			rules->rules = rule;
+		}
+		rule = &rules->rules[rules->count++];
+		memset(rule, 0, sizeof(*rule));
+		rule->linenum = linenum;
+		if (count >= 2048) {
+			rule->too_long = 1;
+			break;
+		}
+
+		line = malloc(count + 1);
+		if (line == NULL)
+			goto _nomem;
+		/* skip backslash and newline from multiline rules */
+		linenum_adj = 0;
+		for (i = j = 0; i < count; i++) {
+			if (bufline[i] == '\\' && bufline[i+1] == '\n') {
+				linenum_adj++;
+				continue;
+			}
+			line[j++] = bufline[i];
+		}
+		line[j] = '\0';
+
+		dbg("read (%i) '%s'", linenum, line);
+		if (compile_line(rule, line) < 0)
+			goto _nomem;
+		linenum += linenum_adj;
+	}
+	file_unmap(buf, bufsize);
+	for (r = 0; r < rules->count; r++) {
+		for (k = 0; k < rules->rules[r].count; k++) {
+			if (rules->rules[r].keys[k].type == KEY_GOTO)
+				compile_goto(rules, r, k);
+		}
+	}
+	dbg("compiled file '%s' (%i rules)", filename, rules->count);
+	return rules;
+
+ _nomem:
+	file_unmap(buf, bufsize);
+	if (rules)
+		rules_free(rules);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* get the compiled file from the cache or compile it */
+static struct rules *rules_get(const char *filename)
+{
+	struct rules *rules, **prev;
+	struct stat st;
+
+	if (stat(filename, &st) < 0) {
+		error("Unable to open file '%s': %s", filename, strerror(errno));
+		return NULL;
+	}
+	for (prev = &rules_cache; *prev; prev = &(*prev)->next) {
+		rules = *prev;
+		if (strcmp(rules->filename, filename))
+			continue;
+		if (rules->dev == st.st_dev && rules->ino == st.st_ino &&
+		    rules->size == st.st_size && rules->mtime == st.st_mtime)
+			return rules;
+		/* the file was changed */
+		*prev = rules->next;
+		rules_free(rules);
+		break;
+	}
+	rules = compile(filename, &st);
+	if (rules) {
+		rules->next = rules_cache;
+		rules_cache = rules;
+	}
+	return rules;
+}
+
+void init_cleanup(void)
+{
+	struct rules *rules;
+
+	while (rules_cache) {
+		rules = rules_cache;
+		rules_cache = rules->next;
+		rules_free(rules);
+	}
+}
+
+/*
+ * Execute the rule from the given key. The position of the next rule
+ * (or the GOTO target) is returned in *prule and *pkey.
+ */
+static int exec_rule(struct space *space, struct rules *rules,
+		     int *prule, int *pkey)
+{
+	struct rule *rule = &rules->rules[*prule];
+	struct rule_key *rkey;
+	char *key, *value, *attr, *temp;
+	struct pair *pair;
+	enum key_op op;
+	int err = 0, count, k;
+	long long start;
+	char string[PATH_SIZE];
+	char result[PATH_SIZE];
+
+	if (rule->too_long) {
+		error("file %s, line %i too long", rules->filename, rule->linenum);
+		return -EINVAL;
+	}
+	for (k = *pkey; k < rule->count; k++) {
+		rkey = &rule->keys[k];
+		if (rkey->type == KEY_INVALID)
 			goto invalid;
+		key = rkey->key;
+		op = rkey->op;
+		value = rkey->value;
 
-		if (strncasecmp(key, "LABEL", 5) == 0) {
+		if (rkey->type == KEY_LABEL) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid LABEL operation");
 				goto invalid;
 			}
-			if (space->go_to && strcmp(space->go_to, value) == 0) {
-				free(space->go_to);
-				space->go_to = NULL;
-			}
+			/* the labels are resolved by compile_goto() */
 			continue;
 		}
-		
-		if (space->go_to) {
-			dbg("skip (GOTO '%s')", space->go_to);
-			break;		/* not for us */
-		}
 
-		if (strncasecmp(key, "CTL{", 4) == 0) {
-			attr = get_key_attribute(space, key + 3, string, sizeof(string));
+		if (rkey->type == KEY_CTL) {
+			attr = rule_key_attr(space, rkey);
 			if (attr == NULL) {
 				Perror(space, "error parsing CTL attribute");
 				goto invalid;
@@ -1362,7 +2063,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strcasecmp(key, "RESULT") == 0) {
+		if (rkey->type == KEY_RESULT) {
 			if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				if (!do_match(key, op, value, space->program_result))
 					break;
@@ -1382,7 +2083,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strcasecmp(key, "PROGRAM") == 0) {
+		if (rkey->type == KEY_PROGRAM) {
 			if (op == KEY_OP_UNSET)
 				continue;
 			strlcpy(string, value, sizeof(string));
@@ -1391,7 +2092,12 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 				free(space->program_result);
 				space->program_result = NULL;
 			}
-			if (run_program(space, string, result, sizeof(result), NULL, space->log_run) != 0) {
+			/* the program may change the controls */
+			space->ctl_index.value_gen++;
+			start = prof_time();
+			count = run_program(space, string, result, sizeof(result), NULL, space->log_run);
+			space->program_time += prof_time() - start;
+			if (count != 0) {
 				dbg("PROGRAM '%s' is false", string);
 				if (op != KEY_OP_NOMATCH)
 					break;
@@ -1411,8 +2117,8 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			dbg("PROGRAM key is true");
 			continue;
 		}
-		if (strncasecmp(key, "CARDINFO{", 9) == 0) {
-			attr = get_key_attribute(space, key + 8, string, sizeof(string));
+		if (rkey->type == KEY_CARDINFO) {
+			attr = rule_key_attr(space, rkey);
 			if (attr == NULL) {
 				Perror(space, "error parsing CARDINFO attribute");
 				goto invalid;
@@ -1428,8 +2134,8 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strncasecmp(key, "ATTR{", 5) == 0) {
-			attr = get_key_attribute(space, key + 4, string, sizeof(string));
+		if (rkey->type == KEY_ATTR) {
+			attr = rule_key_attr(space, rkey);
 			if (attr == NULL) {
 				Perror(space, "error parsing ATTR attribute");
 				goto invalid;
@@ -1439,7 +2145,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 				if (pair == NULL)
 					break;
 				dbg("sysfs_attr: '%s' '%s'", pair->value, attr);
-				temp = sysfs_attr_get_value(pair->value, attr);
+				temp = sysfs_attr_get(space, pair->value, attr);
 				if (!do_match(key, op, value, temp))
 					break;
 			} else {
@@ -1448,8 +2154,8 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strncasecmp(key, "ENV{", 4) == 0) {
-			attr = get_key_attribute(space, key + 3, string, sizeof(string));
+		if (rkey->type == KEY_ENV) {
+			attr = rule_key_attr(space, rkey);
 			if (attr == NULL) {
 				Perror(space, "error parsing ENV attribute");
 				goto invalid;
@@ -1472,19 +2178,25 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strcasecmp(key, "GOTO") == 0) {
+		if (rkey->type == KEY_GOTO) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid GOTO operation");
 				goto invalid;
 			}
-			space->go_to = strdup(value);
-			if (space->go_to == NULL) {
-				err = -ENOMEM;
-				break;
+			if (rkey->jump_rule >= 0) {
+				dbg("GOTO '%s' (line %i)", value,
+				    rules->rules[rkey->jump_rule].linenum);
+				*prule = rkey->jump_rule;
+				*pkey = rkey->jump_key;
+				return 0;
 			}
-			continue;
+			/* no label, skip the rest of file */
+			space->go_to = strdup(value);
+			*prule = rules->count;
+			*pkey = 0;
+			return space->go_to ? 0 : -ENOMEM;
 		}
-		if (strcasecmp(key, "INCLUDE") == 0) {
+		if (rkey->type == KEY_INCLUDE) {
 			char *rootdir, *go_to;
 			const char *filename;
 			struct stat st;
@@ -1561,7 +2273,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 				break;
 			continue;
 		}
-		if (strncasecmp(key, "ACCESS", 6) == 0) {
+		if (rkey->type == KEY_ACCESS) {
 			if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				if (value[0] == '$') {
 					strlcpy(string, value, sizeof(string));
@@ -1590,7 +2302,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strncasecmp(key, "PRINT", 5) == 0) {
+		if (rkey->type == KEY_PRINT) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid PRINT operation");
 				goto invalid;
@@ -1600,7 +2312,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			fwrite(string, strlen(string), 1, stdout);
 			continue;
 		}
-		if (strncasecmp(key, "ERROR", 5) == 0) {
+		if (rkey->type == KEY_ERROR) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid ERROR operation");
 				goto invalid;
@@ -1610,7 +2322,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			fwrite(string, strlen(string), 1, stderr);
 			continue;
 		}
-		if (strncasecmp(key, "EXIT", 4) == 0) {
+		if (rkey->type == KEY_EXIT) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid EXIT operation");
 				goto invalid;
@@ -1623,8 +2335,8 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			space->quit = 1;
 			break;
 		}
-		if (strncasecmp(key, "CONFIG{", 7) == 0) {
-			attr = get_key_attribute(space, key + 6, string, sizeof(string));
+		if (rkey->type == KEY_CONFIG) {
+			attr = rule_key_attr(space, rkey);
 			if (attr == NULL) {
 				Perror(space, "error parsing CONFIG attribute");
 				goto invalid;
@@ -1649,6 +2361,8 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 
 		Perror(space, "unknown key '%s'", key);
 	}
+	*prule += 1;
+	*pkey = 0;
 	return err;
 
 invalid:
@@ -1658,92 +2372,70 @@ invalid:
 
 static int parse(struct space *space, const char *filename)
 {
-	char *buf, *bufline, *line;
-	size_t bufsize, pos, count, linesize;
-	unsigned int linenum, i, j, linenum_adj;
-	int err;
+	struct rules *rules;
+	long long sysfs_time, program_time;
+	int err = 0, r = 0, k = 0, linenum;
 
 	dbg("start of file '%s'", filename);
 
-	if (file_map(filename, &buf, &bufsize) != 0) {
-		err = errno;
-		error("Unable to open file '%s': %s", filename, strerror(err));
-		return -err;
-	}
-
-	err = 0;	
-	pos = 0;
-	linenum = 0;
-	linesize = 128;
-	line = malloc(linesize);
-	if (line == NULL)
-		return -ENOMEM;
-	space->filename = filename;
-	while (!err && pos < bufsize && !space->quit) {
-		count = line_width(buf, bufsize, pos);
-		bufline = buf + pos;
-		pos += count + 1;
-		linenum++;
-		
-		/* skip whitespaces */
-		while (count > 0 && isspace(bufline[0])) {
-			bufline++;
-			count--;
-		}
-		if (count == 0)
-			continue;
-			
-		/* comment check */
-		if (bufline[0] == '#')
-			continue;
-		
-		if (count > linesize - 1) {
-			free(line);
-			linesize = (count + 127 + 1) & ~127;
-			if (linesize > 2048) {
-				error("file %s, line %i too long", filename, linenum);
-				err = -EINVAL;
-				break;
-			}
-			line = malloc(linesize);
-			if (line == NULL) {
-				err = -EINVAL;
-				break;
-			}
-		}
-		
-		/* skip backslash and newline from multiline rules */
-		linenum_adj = 0;
-		for (i = j = 0; i < count; i++) {
-			if (bufline[i] == '\\' && bufline[i+1] == '\n') {
-				linenum_adj++;
-				continue;
-			}
-			line[j++] = bufline[i];
-		}
-		line[j] = '\0';
-
-		dbg("read (%i) '%s'", linenum, line);
-		space->linenum = linenum;
-		err = parse_line(space, line, linesize);
+	rules = rules_get(filename);
+	if (rules == NULL)
+		return -errno;
+
+	space->filename = rules->filename;
+	while (!err && r < rules->count && !space->quit) {
+		linenum = space->linenum = rules->rules[r].linenum;
+		sysfs_time = space->sysfs_time;
+		program_time = space->program_time;
+		err = exec_rule(space, rules, &r, &k);
+		/* the included files are counted to the INCLUDE rule, too */
+		if (space->sysfs_time != sysfs_time ||
+		    space->program_time != program_time)
+			dbg("%s:%i: sysfs %lli us, program %lli us",
+			    rules->filename, linenum,
+			    space->sysfs_time - sysfs_time,
+			    space->program_time - program_time);
 		if (err == -EJUSTRETURN) {
 			err = 0;
 			break;
 		}
-		linenum += linenum_adj;
 	}
 
-	free(line);
 	space->filename = NULL;
 	space->linenum = -1;
-	file_unmap(buf, bufsize);
 	dbg("end of file '%s'", filename);
 	return err ? err : -abs(space->exit_code);
 }
 
-int init(const char *filename, const char *cardname)
+static int init_card(const char *filename, int card)
 {
 	struct space *space;
+	int err;
+
+	err = init_space(&space, card);
+	if (err < 0)
+		return err;
+	space->rootdir = new_root_dir(filename);
+	if (space->rootdir != NULL)
+		err = parse(space, filename);
+	dbg("card %i: sysfs %lli us, programs %lli us", card,
+	    space->sysfs_time, space->program_time);
+	free_space(space);
+	return err;
+}
+
+int init_cardno(const char *filename, int card)
+{
+	int err;
+
+	sysfs_init();
+	err = init_card(filename, card);
+	sysfs_cleanup();
+	return err;
+}
+
+int init(const char *filename, const char *cardname)
+{
 	int err = 0, card, first;
 	
 	sysfs_init();
@@ -1761,13 +2453,7 @@ int init(const char *filename, const char *cardname)
 				break;
 			}
 			first = 0;
-			err = init_space(&space, card);
-			if (err == 0) {
-				space->rootdir = new_root_dir(filename);
-				if (space->rootdir != NULL)
-					err = parse(space, filename);
-				free_space(space);
-			}
+			err = init_card(filename, card);
 			if (err < 0)
 				break;
 		}
@@ -1777,14 +2463,7 @@ int init(const char *filename, const char *cardname)
 			error("Cannot find soundcard '%s'...", cardname);
 			goto error;
 		}
-		memset(&space, 0, sizeof(space));
-		err = init_space(&space, card);
-		if (err == 0) {
-			space->rootdir = new_root_dir(filename);
-			if (space->rootdir  != NULL)
-				err = parse(space, filename);
-			free_space(space);
-		}
+		err = init_card(filename, card);
 	}
   error:
 	sysfs_cleanup();
@@ -20,8 +20,9 @@
 
 static char sysfs_path[PATH_SIZE];
 
-/* attribute value cache */
-static LIST_HEAD(attr_list);
+/* attribute value cache (also the missing attributes are cached) */
+#define ATTR_HASH_SIZE	128
+static struct list_head attr_hash[ATTR_HASH_SIZE];
 struct sysfs_attr {
 	struct list_head node;
 	char path[PATH_SIZE];
@@ -33,6 +34,7 @@ static int sysfs_init(void)
 {
 	const char *env;
 	char sysfs_test[PATH_SIZE];
+	int i;
 
 	env = getenv("SYSFS_PATH");
 	if (env) {
@@ -49,7 +51,8 @@ static int sysfs_init(void)
 		return -errno;
 	}
 
-	INIT_LIST_HEAD(&attr_list);
+	for (i = 0; i < ATTR_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&attr_hash[i]);
 	return 0;
 }
 
@@ -57,13 +60,27 @@ static void sysfs_cleanup(void)
 {
 	struct sysfs_attr *attr_loop;
 	struct sysfs_attr *attr_temp;
-
-	list_for_each_entry_safe(attr_loop, attr_temp, &attr_list, node) {
-		list_del(&attr_loop->node);
-		free(attr_loop);
+	int i;
+
+	for (i = 0; i < ATTR_HASH_SIZE; i++) {
+		if (attr_hash[i].next == NULL)
+			continue;
+		list_for_each_entry_safe(attr_loop, attr_temp, &attr_hash[i], node) {
+			list_del(&attr_loop->node);
+			free(attr_loop);
+		}
 	}
 }
 
+static struct list_head *sysfs_attr_hash(const char *path)
+{
+	unsigned int hash = 5381;
+
+	while (*path)
+		hash = hash * 33 + (unsigned char)*path++;
+	return &attr_hash[hash % ATTR_HASH_SIZE];
+}
+
 static char *sysfs_attr_get_value(const char *devpath, const char *attr_name)
 {
 	char path_full[PATH_SIZE];
@@ -71,6 +88,7 @@ static char *sysfs_attr_get_value(const char *devpath, const char *attr_name)
 	char value[NAME_SIZE];
 	struct sysfs_attr *attr_loop;
 	struct sysfs_attr *attr;
+	struct list_head *head;
 	struct stat statbuf;
 	int fd;
 	ssize_t size;
@@ -84,7 +102,8 @@ static char *sysfs_attr_get_value(const char *devpath, const char *attr_name)
 	strlcat(path_full, attr_name, sizeof(path_full));
 
 	/* look for attribute in cache */
-	list_for_each_entry(attr_loop, &attr_list, node) {
+	head = sysfs_attr_hash(path);
+	list_for_each_entry(attr_loop, head, node) {
 		if (strcmp(attr_loop->path, path) == 0) {
 			dbg("found in cache '%s'", attr_loop->path);
 			return attr_loop->value;
@@ -99,7 +118,7 @@ static char *sysfs_attr_get_value(const char *devpath, const char *attr_name)
 	memset(attr, 0x00, sizeof(struct sysfs_attr));
 	strlcpy(attr->path, path, sizeof(attr->path));
 	dbg("add to cache '%s'", path_full);
-	list_add(&attr->node, &attr_list);
+	list_add(&attr->node, head);
 
 	if (lstat(path_full, &statbuf) != 0) {
 		dbg("stat '%s' failed: %s", path_full, strerror(errno));
@@ -26,6 +26,152 @@ int run_program1(struct space *space,
 	         const char *command0, char *result,
 		 size_t ressize, size_t *reslen, int log);
 
+/*
+ * The common helpers from the standard paths are run in-process,
+ * without fork and exec. The results and the exit codes are same.
+ * The options are not implemented (except echo -n), the real program
+ * is run when an option is given.
+ */
+static int builtin_true(struct space *space, char **argv,
+			char *result, size_t ressize, size_t *respos)
+{
+	return 0;
+}
+
+static int builtin_false(struct space *space, char **argv,
+			 char *result, size_t ressize, size_t *respos)
+{
+	return -1;
+}
+
+static int builtin_output(struct space *space, const char *buf, size_t count,
+			  char *result, size_t ressize, size_t *respos)
+{
+	if (result) {
+		if (*respos + count >= ressize) {
+			Perror(space, "ressize %ld too short", (long)ressize);
+			return -1;
+		}
+		memcpy(&result[*respos], buf, count);
+		*respos += count;
+		result[*respos] = '\0';
+	}
+	return 0;
+}
+
+static int builtin_echo(struct space *space, char **argv,
+			char *result, size_t ressize, size_t *respos)
+{
+	int i = 1, nl = 1;
+
+	if (argv[i] && strcmp(argv[i], "-n") == 0) {
+		nl = 0;
+		i++;
+	}
+	for (; argv[i]; i++) {
+		if (builtin_output(space, argv[i], strlen(argv[i]),
+				   result, ressize, respos) < 0)
+			return -1;
+		if (argv[i + 1] &&
+		    builtin_output(space, " ", 1, result, ressize, respos) < 0)
+			return -1;
+	}
+	if (nl)
+		return builtin_output(space, "\n", 1, result, ressize, respos);
+	return 0;
+}
+
+static int builtin_cat(struct space *space, char **argv,
+		       char *result, size_t ressize, size_t *respos)
+{
+	char buf[1024];
+	ssize_t count;
+	int i, fd, retval = 0;
+
+	for (i = 1; argv[i]; i++) {
+		fd = open(argv[i], O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			info("'%s' (stderr) '%s: %s'", argv[0], argv[i], strerror(errno));
+			retval = -1;
+			continue;
+		}
+		while ((count = read(fd, buf, sizeof(buf))) > 0) {
+			if (builtin_output(space, buf, count,
+					   result, ressize, respos) < 0) {
+				retval = -1;
+				break;
+			}
+		}
+		if (count < 0)
+			retval = -1;
+		close(fd);
+	}
+	return retval;
+}
+
+static const struct builtin {
+	const char *name;
+	int (*fcn)(struct space *space, char **argv,
+		   char *result, size_t ressize, size_t *respos);
+} builtins[] = {
+	{ "true", builtin_true },
+	{ "false", builtin_false },
+	{ "echo", builtin_echo },
+	{ "cat", builtin_cat },
+};
+
+/* the options (except the leading echo -n) are left to the real program */
+static int builtin_options(const char *name, char **argv)
+{
+	int i;
+
+	if (strcmp(name, "echo") == 0) {
+		i = argv[1] && strcmp(argv[1], "-n") == 0 ? 2 : 1;
+		return argv[i] && argv[i][0] == '-';
+	}
+	for (i = 1; argv[i]; i++)
+		if (argv[i][0] == '-')
+			return 1;
+	return 0;
+}
+
+static const struct builtin *find_builtin(char **argv)
+{
+	const char *name;
+	unsigned int i;
+
+	if (strncmp(argv[0], "/bin/", 5) == 0)
+		name = argv[0] + 5;
+	else if (strncmp(argv[0], "/usr/bin/", 9) == 0)
+		name = argv[0] + 9;
+	else
+		return NULL;
+	for (i = 0; i < ARRAY_SIZE(builtins); i++) {
+		if (strcmp(name, builtins[i].name) == 0)
+			return builtin_options(name, argv) ? NULL : &builtins[i];
+	}
+	return NULL;
+}
+
+static int run_builtin(struct space *space, const struct builtin *b,
+		       char **argv, char *result, size_t ressize,
+		       size_t *reslen)
+{
+	size_t respos = 0;
+	int retval;
+
+	if (result)
+		result[0] = '\0';
+	retval = b->fcn(space, argv, result, ressize, &respos);
+	if (result) {
+		dbg("result='%s'", result);
+		if (reslen)
+			*reslen = respos;
+	}
+	info("'%s' returned with status %i", argv[0], retval ? 1 : 0);
+	return retval;
+}
+
 static
 int run_program0(struct space *space,
 	         const char *command0, char *result,
@@ -39,6 +185,7 @@ int run_program0(struct space *space,
 	char arg[PATH_SIZE];
 	char program[PATH_SIZE];
 	char *argv[(sizeof(arg) / 2) + 1];
+	const struct builtin *b;
 	int devnull;
 	int i;
 
@@ -68,6 +215,10 @@ int run_program0(struct space *space,
 	}
 	info("'%s'", command0);
 
+	b = find_builtin(argv);
+	if (b)
+		return run_builtin(space, b, argv, result, ressize, reslen);
+
 	/* prepare pipes from child to parent */
 	if (result || log) {
 		if (pipe(outpipe) != 0) {
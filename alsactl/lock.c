@@ -27,16 +27,107 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <alsa/asoundlib.h>
 #include "alsactl.h"
 
+/*
+ * The open file description locks are owned by the file descriptor,
+ * so the lock also serializes the threads of one process. The older
+ * kernels fall back to the process associated locks.
+ */
+#ifdef F_OFD_SETLK
+static int lock_cmd = F_OFD_SETLK;
+#else
+static int lock_cmd = F_SETLK;
+#endif
+
+static long long now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_lock(int fd, struct flock *lck)
+{
+	if (fcntl(fd, lock_cmd, lck) == 0)
+		return 0;
+#ifdef F_OFD_SETLK
+	if (errno == EINVAL && lock_cmd == F_OFD_SETLK) {
+		lock_cmd = F_SETLK;
+		return set_lock(fd, lck);
+	}
+#endif
+	return -errno;
+}
+
+/*
+ * Wait for the lock. The lock holder closes the lock file when the lock
+ * is released (also when it is killed), so the close events of the lock
+ * file wake up the waiter. The watch is added before the first attempt,
+ * so no release is missed.
+ */
+static int wait_lock(int fd, const char *nfile, struct flock *lck,
+		     int timeout, long long *waited)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	struct pollfd pfd;
+	long long start, now, end;
+	int ifd, err;
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd >= 0 && inotify_add_watch(ifd, nfile, IN_CLOSE) < 0) {
+		close(ifd);
+		ifd = -1;
+	}
+	start = now_msec();
+	end = start + (long long)timeout * 1000;
+	*waited = -1;
+	while (1) {
+		err = set_lock(fd, lck);
+		if (err != -EAGAIN && err != -EACCES)
+			break;
+		now = now_msec();
+		if (*waited < 0)
+			*waited = 0;
+		if (now >= end) {
+			err = -EBUSY;
+			break;
+		}
+		if (ifd < 0) {
+			/* no inotify, check the lock periodically */
+			poll(NULL, 0, end - now < 100 ? end - now : 100);
+			continue;
+		}
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, end - now) < 0 && errno != EINTR) {
+			err = -errno;
+			break;
+		}
+		while (read(ifd, buf, sizeof(buf)) > 0)
+			;
+	}
+	if (*waited == 0)
+		*waited = now_msec() - start;
+	if (ifd >= 0)
+		close(ifd);
+	return err;
+}
+
 static int state_lock_(const char *file, int lock, int timeout, int _fd)
 {
 	int fd = -1, err = 0;
 	struct flock lck;
-	struct stat st;
 	char lcktxt[12];
 	char *nfile = lockfile;
+	long long waited;
 
 	if (do_lock <= 0)
 		return 0;
@@ -48,67 +139,35 @@ static int state_lock_(const char *file, int lock, int timeout, int _fd)
 	lck.l_pid = 0;
 	if (lock) {
 		snprintf(lcktxt, sizeof(lcktxt), "%10li\n", (long)getpid());
-	} else {
-		snprintf(lcktxt, sizeof(lcktxt), "%10s\n", "");
-		fd = _fd;
-	}
-	while (fd < 0 && timeout-- > 0) {
-		fd = open(nfile, O_RDWR);
-		if (!lock && fd < 0) {
-			err = -EIO;
-			goto out;
-		}
+		fd = open(nfile, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
 		if (fd < 0) {
-			fd = open(nfile, O_RDWR|O_CREAT|O_EXCL, 0644);
-			if (fd < 0) {
-				if (errno == EBUSY || errno == EAGAIN) {
-					sleep(1);
-					timeout--;
-				} else {
-					err = -errno;
-					goto out;
-				}
-			}
-		}
-	}
-	if (fd < 0 && timeout <= 0) {
-		err = -EBUSY;
-		goto out;
-	}
-	if (fstat(fd, &st) < 0) {
-		err = -errno;
-		goto out;
-	}
-	if (st.st_size != 11 || !lock) {
-		if (write(fd, lcktxt, 11) != 11) {
-			err = -EIO;
-			goto out;
-		}
-		if (lock && lseek(fd, 0, SEEK_SET)) {
 			err = -errno;
 			goto out;
 		}
-	}
-	while (timeout > 0) {
-		if (fcntl(fd, F_SETLK, &lck) < 0) {
-			sleep(1);
-			timeout--;
-		} else {
-			break;
-		}
-	}
-	if (timeout <= 0) {
-		err = -EBUSY;
-		goto out;
-	}
-	if (lock) {
-		if (write(fd, lcktxt, 11) != 11) {
+		err = wait_lock(fd, nfile, &lck, timeout, &waited);
+		if (waited >= 0)
+			info("%s: waited %lli.%03llis for the lock %s", file,
+			     waited / 1000, waited % 1000, nfile);
+		if (err < 0)
+			goto out;
+		if (pwrite(fd, lcktxt, 11, 0) != 11) {
 			err = -EIO;
 			goto out;
 		}
 		return fd;
 	}
-	err = 0;
+
+	fd = _fd;
+	if (fd < 0) {
+		err = -EIO;
+		goto out;
+	}
+	snprintf(lcktxt, sizeof(lcktxt), "%10s\n", "");
+	if (pwrite(fd, lcktxt, 11, 0) != 11) {
+		err = -EIO;
+		goto out;
+	}
+	err = set_lock(fd, &lck);
 
 out:
 	if (fd >= 0)
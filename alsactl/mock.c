@@ -0,0 +1,554 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - Mock Control Device
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The mock device is a synthetic card used by the bench command. It is
+ * implemented in-process using the external control API of alsa-lib, so
+ * the state and init code use it through the usual snd_ctl_* calls. The
+ * elements are generated from a fixed set of kinds (all element types,
+ * dB ranges, enumerated items) and the element names are unique. The
+ * values are kept in memory for the whole run, so the restore and init
+ * passes see the values of the previous passes.
+ */
+
+#include "aconfig.h"
+#include "version.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <alsa/asoundlib.h>
+#include <alsa/control_external.h>
+#include "alsactl.h"
+
+#define MOCK_MAX_ELEMS	(1024 * 1024)
+
+struct mock_kind {
+	const char *suffix;
+	snd_ctl_elem_iface_t iface;
+	snd_ctl_elem_type_t type;
+	unsigned int count;
+	long long min, max, step;
+	const unsigned int *tlv;
+	unsigned int items;
+	const char *const *item_names;
+};
+
+struct mock_elem {
+	char name[44];
+	unsigned int index;
+	const struct mock_kind *kind;
+	void *value;
+	struct mock_elem *next;		/* hash chain */
+};
+
+struct mock_card {
+	unsigned int count;
+	struct mock_elem *elems;
+	unsigned int hash_mask;
+	struct mock_elem **hash;
+};
+
+static struct mock_card *mock;
+
+static const unsigned int tlv_volume[] = {
+	SND_CTL_TLVT_DB_SCALE, 2 * sizeof(unsigned int), -5100, 20
+};
+
+static const unsigned int tlv_capture[] = {
+	SND_CTL_TLVT_DB_MINMAX, 2 * sizeof(unsigned int), -1200, 3525
+};
+
+static const unsigned int tlv_boost[] = {
+	SND_CTL_TLVT_DB_SCALE, 2 * sizeof(unsigned int), 0, 1000
+};
+
+static const char *const route_names[] = {
+	"Off", "Front", "Rear", "Both"
+};
+
+static const char *const source_names[] = {
+	"Mic", "Front Mic", "Line", "CD", "Aux", "Video", "Phone", "Mix"
+};
+
+static const struct mock_kind kinds[] = {
+	{ "Playback Volume", SND_CTL_ELEM_IFACE_MIXER,
+	  SND_CTL_ELEM_TYPE_INTEGER, 2, 0, 255, 1, tlv_volume },
+	{ "Playback Switch", SND_CTL_ELEM_IFACE_MIXER,
+	  SND_CTL_ELEM_TYPE_BOOLEAN, 2, 0, 1, 0 },
+	{ "Capture Volume", SND_CTL_ELEM_IFACE_MIXER,
+	  SND_CTL_ELEM_TYPE_INTEGER, 2, 0, 63, 1, tlv_capture },
+	{ "Capture Switch", SND_CTL_ELEM_IFACE_MIXER,
+	  SND_CTL_ELEM_TYPE_BOOLEAN, 2, 0, 1, 0 },
+	{ "Boost Volume", SND_CTL_ELEM_IFACE_MIXER,
+	  SND_CTL_ELEM_TYPE_INTEGER, 1, 0, 3, 1, tlv_boost },
+	{ "Playback Route", SND_CTL_ELEM_IFACE_MIXER,
+	  SND_CTL_ELEM_TYPE_ENUMERATED, 1, 0, 0, 0, NULL,
+	  ARRAY_SIZE(route_names), route_names },
+	{ "Capture Source", SND_CTL_ELEM_IFACE_MIXER,
+	  SND_CTL_ELEM_TYPE_ENUMERATED, 2, 0, 0, 0, NULL,
+	  ARRAY_SIZE(source_names), source_names },
+	{ "Sample Counter", SND_CTL_ELEM_IFACE_CARD,
+	  SND_CTL_ELEM_TYPE_INTEGER64, 1, 0, 1LL << 40, 1 },
+	{ "EQ Coefficients", SND_CTL_ELEM_IFACE_CARD,
+	  SND_CTL_ELEM_TYPE_BYTES, 64 },
+	{ "IEC958 Playback Default", SND_CTL_ELEM_IFACE_PCM,
+	  SND_CTL_ELEM_TYPE_IEC958, 1 },
+};
+
+static const char *const bases[] = {
+	"Master", "Headphone", "Speaker", "PCM", "Front", "Surround",
+	"Center", "LFE", "Side", "Line", "Mic", "CD", "Aux", "Beep",
+	"Phone", "Video", "Digital", "Analog", "Monitor", "Loopback",
+	"Mix", "Input", "Output", "Bass"
+};
+
+static unsigned int mock_hash(const char *name, unsigned int index)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h * 33 + index;
+}
+
+static size_t value_size(const struct mock_kind *kind)
+{
+	switch (kind->type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		return kind->count * sizeof(long);
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		return kind->count * sizeof(int64_t);
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		return kind->count * sizeof(unsigned int);
+	case SND_CTL_ELEM_TYPE_IEC958:
+		return sizeof(snd_aes_iec958_t);
+	default:
+		return kind->count;
+	}
+}
+
+static void value_init(struct mock_elem *e, unsigned int seed)
+{
+	const struct mock_kind *kind = e->kind;
+	unsigned int idx;
+
+	for (idx = 0; idx < kind->count; idx++, seed += 7) {
+		switch (kind->type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+		case SND_CTL_ELEM_TYPE_INTEGER:
+			((long *)e->value)[idx] = kind->min +
+				seed % (kind->max - kind->min + 1);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+			((int64_t *)e->value)[idx] = (int64_t)seed << 20;
+			break;
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+			((unsigned int *)e->value)[idx] = seed % kind->items;
+			break;
+		case SND_CTL_ELEM_TYPE_BYTES:
+			((unsigned char *)e->value)[idx] = seed;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+int mock_init(unsigned int count)
+{
+	struct mock_elem *e;
+	unsigned int idx, k, b, h;
+
+	if (count == 0 || count > MOCK_MAX_ELEMS)
+		return -EINVAL;
+	mock_free();
+	mock = calloc(1, sizeof(*mock));
+	if (mock == NULL)
+		return -ENOMEM;
+	mock->elems = calloc(count, sizeof(*mock->elems));
+	for (h = 1; h < count; h <<= 1)
+		;
+	mock->hash_mask = h - 1;
+	mock->hash = calloc(h, sizeof(*mock->hash));
+	if (mock->elems == NULL || mock->hash == NULL)
+		goto _nomem;
+	for (idx = 0; idx < count; idx++) {
+		e = &mock->elems[idx];
+		k = idx % ARRAY_SIZE(kinds);
+		b = (idx / ARRAY_SIZE(kinds)) % ARRAY_SIZE(bases);
+		e->kind = &kinds[k];
+		e->index = idx / (ARRAY_SIZE(kinds) * ARRAY_SIZE(bases));
+		snprintf(e->name, sizeof(e->name), "%s %s", bases[b],
+			 e->kind->suffix);
+		e->value = calloc(1, value_size(e->kind));
+		if (e->value == NULL)
+			goto _nomem;
+		mock->count++;
+		value_init(e, idx);
+		h = mock_hash(e->name, e->index) & mock->hash_mask;
+		e->next = mock->hash[h];
+		mock->hash[h] = e;
+	}
+	return 0;
+
+ _nomem:
+	mock_free();
+	return -ENOMEM;
+}
+
+void mock_free(void)
+{
+	unsigned int idx;
+
+	if (mock == NULL)
+		return;
+	for (idx = 0; idx < mock->count; idx++)
+		free(mock->elems[idx].value);
+	free(mock->elems);
+	free(mock->hash);
+	free(mock);
+	mock = NULL;
+}
+
+static struct mock_elem *mock_elem(snd_ctl_ext_key_t key)
+{
+	if (key >= mock->count)
+		return NULL;
+	return &mock->elems[key];
+}
+
+static void mock_close(snd_ctl_ext_t *ext)
+{
+	free(ext);
+}
+
+static int mock_elem_count(snd_ctl_ext_t *ext)
+{
+	return mock->count;
+}
+
+static int mock_elem_list(snd_ctl_ext_t *ext,
+			  unsigned int offset, snd_ctl_elem_id_t *id)
+{
+	struct mock_elem *e = mock_elem(offset);
+
+	if (e == NULL)
+		return -EINVAL;
+	snd_ctl_elem_id_set_interface(id, e->kind->iface);
+	snd_ctl_elem_id_set_name(id, e->name);
+	snd_ctl_elem_id_set_index(id, e->index);
+	return 0;
+}
+
+static snd_ctl_ext_key_t mock_find_elem(snd_ctl_ext_t *ext,
+					const snd_ctl_elem_id_t *id)
+{
+	struct mock_elem *e;
+	const char *name;
+	unsigned int numid, index;
+
+	/* the external control API numbers the elements from 1 */
+	numid = snd_ctl_elem_id_get_numid(id);
+	if (numid > 0 && numid <= mock->count)
+		return numid - 1;
+	name = snd_ctl_elem_id_get_name(id);
+	index = snd_ctl_elem_id_get_index(id);
+	e = mock->hash[mock_hash(name, index) & mock->hash_mask];
+	for (; e; e = e->next) {
+		if (e->index == index &&
+		    e->kind->iface == snd_ctl_elem_id_get_interface(id) &&
+		    strcmp(e->name, name) == 0)
+			return e - mock->elems;
+	}
+	return SND_CTL_EXT_KEY_NOT_FOUND;
+}
+
+static int mock_get_attribute(snd_ctl_ext_t *ext,
+			      snd_ctl_ext_key_t key, int *type,
+			      unsigned int *acc, unsigned int *count)
+{
+	struct mock_elem *e = mock_elem(key);
+
+	if (e == NULL)
+		return -EINVAL;
+	*type = e->kind->type;
+	*acc = SND_CTL_EXT_ACCESS_READWRITE;
+	if (e->kind->tlv)
+		*acc |= SND_CTL_EXT_ACCESS_TLV_READ |
+			SND_CTL_EXT_ACCESS_TLV_CALLBACK;
+	*count = e->kind->count;
+	return 0;
+}
+
+static int mock_get_integer_info(snd_ctl_ext_t *ext,
+				 snd_ctl_ext_key_t key,
+				 long *imin, long *imax, long *istep)
+{
+	struct mock_elem *e = mock_elem(key);
+
+	if (e == NULL)
+		return -EINVAL;
+	*imin = e->kind->min;
+	*imax = e->kind->max;
+	*istep = e->kind->step;
+	return 0;
+}
+
+static int mock_get_integer64_info(snd_ctl_ext_t *ext,
+				   snd_ctl_ext_key_t key, int64_t *imin,
+				   int64_t *imax, int64_t *istep)
+{
+	struct mock_elem *e = mock_elem(key);
+
+	if (e == NULL)
+		return -EINVAL;
+	*imin = e->kind->min;
+	*imax = e->kind->max;
+	*istep = e->kind->step;
+	return 0;
+}
+
+static int mock_get_enumerated_info(snd_ctl_ext_t *ext,
+				    snd_ctl_ext_key_t key, unsigned int *items)
+{
+	struct mock_elem *e = mock_elem(key);
+
+	if (e == NULL)
+		return -EINVAL;
+	*items = e->kind->items;
+	return 0;
+}
+
+static int mock_get_enumerated_name(snd_ctl_ext_t *ext,
+				    snd_ctl_ext_key_t key, unsigned int item,
+				    char *name, size_t name_max_len)
+{
+	struct mock_elem *e = mock_elem(key);
+
+	if (e == NULL || item >= e->kind->items)
+		return -EINVAL;
+	snprintf(name, name_max_len, "%s", e->kind->item_names[item]);
+	return 0;
+}
+
+static int mock_read(snd_ctl_ext_key_t key, void *value, size_t size)
+{
+	struct mock_elem *e = mock_elem(key);
+	size_t len;
+
+	if (e == NULL)
+		return -EINVAL;
+	len = value_size(e->kind);
+	memcpy(value, e->value, len < size ? len : size);
+	return 0;
+}
+
+static int mock_read_integer(snd_ctl_ext_t *ext,
+			     snd_ctl_ext_key_t key, long *value)
+{
+	return mock_read(key, value, (size_t)-1);
+}
+
+static int mock_read_integer64(snd_ctl_ext_t *ext,
+			       snd_ctl_ext_key_t key, int64_t *value)
+{
+	return mock_read(key, value, (size_t)-1);
+}
+
+static int mock_read_enumerated(snd_ctl_ext_t *ext,
+				snd_ctl_ext_key_t key, unsigned int *items)
+{
+	return mock_read(key, items, (size_t)-1);
+}
+
+static int mock_read_bytes(snd_ctl_ext_t *ext,
+			   snd_ctl_ext_key_t key, unsigned char *data,
+			   size_t max_bytes)
+{
+	return mock_read(key, data, max_bytes);
+}
+
+static int mock_read_iec958(snd_ctl_ext_t *ext,
+			    snd_ctl_ext_key_t key, snd_aes_iec958_t *iec958)
+{
+	return mock_read(key, iec958, sizeof(*iec958));
+}
+
+/* returns 1 when the value was changed like the driver put callback */
+static int mock_write(snd_ctl_ext_key_t key, const void *value, size_t size)
+{
+	struct mock_elem *e = mock_elem(key);
+	const struct mock_kind *kind;
+	unsigned int idx;
+	size_t len;
+
+	if (e == NULL)
+		return -EINVAL;
+	kind = e->kind;
+	for (idx = 0; idx < kind->count; idx++) {
+		switch (kind->type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+		case SND_CTL_ELEM_TYPE_INTEGER:
+			if (((const long *)value)[idx] < kind->min ||
+			    ((const long *)value)[idx] > kind->max)
+				return -EINVAL;
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+			if (((const int64_t *)value)[idx] < kind->min ||
+			    ((const int64_t *)value)[idx] > kind->max)
+				return -EINVAL;
+			break;
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+			if (((const unsigned int *)value)[idx] >= kind->items)
+				return -EINVAL;
+			break;
+		default:
+			break;
+		}
+	}
+	len = value_size(kind);
+	if (len > size)
+		len = size;
+	if (memcmp(e->value, value, len) == 0)
+		return 0;
+	memcpy(e->value, value, len);
+	return 1;
+}
+
+static int mock_write_integer(snd_ctl_ext_t *ext,
+			      snd_ctl_ext_key_t key, long *value)
+{
+	return mock_write(key, value, (size_t)-1);
+}
+
+static int mock_write_integer64(snd_ctl_ext_t *ext,
+				snd_ctl_ext_key_t key, int64_t *value)
+{
+	return mock_write(key, value, (size_t)-1);
+}
+
+static int mock_write_enumerated(snd_ctl_ext_t *ext,
+				 snd_ctl_ext_key_t key, unsigned int *items)
+{
+	return mock_write(key, items, (size_t)-1);
+}
+
+static int mock_write_bytes(snd_ctl_ext_t *ext,
+			    snd_ctl_ext_key_t key, unsigned char *data,
+			    size_t max_bytes)
+{
+	return mock_write(key, data, max_bytes);
+}
+
+static int mock_write_iec958(snd_ctl_ext_t *ext,
+			     snd_ctl_ext_key_t key, snd_aes_iec958_t *iec958)
+{
+	return mock_write(key, iec958, sizeof(*iec958));
+}
+
+static void mock_subscribe_events(snd_ctl_ext_t *ext,
+				  int subscribe)
+{
+}
+
+/* the values are changed only by the writes, no events are generated */
+static int mock_read_event(snd_ctl_ext_t *ext,
+			   snd_ctl_elem_id_t *id,
+			   unsigned int *event_mask)
+{
+	return -EAGAIN;
+}
+
+static int mock_tlv(snd_ctl_ext_t *ext,
+		    snd_ctl_ext_key_t key, int op_flag,
+		    unsigned int numid,
+		    unsigned int *tlv, unsigned int tlv_size)
+{
+	struct mock_elem *e = mock_elem(key);
+	unsigned int size;
+
+	if (e == NULL || e->kind->tlv == NULL)
+		return -ENXIO;
+	if (op_flag != 0)		/* only read */
+		return -ENXIO;
+	size = e->kind->tlv[1] + 2 * sizeof(unsigned int);
+	if (size > tlv_size)
+		return -ENOMEM;
+	memcpy(tlv, e->kind->tlv, size);
+	return 0;
+}
+
+static const snd_ctl_ext_callback_t mock_callback = {
+	.close = mock_close,
+	.elem_count = mock_elem_count,
+	.elem_list = mock_elem_list,
+	.find_elem = mock_find_elem,
+	.get_attribute = mock_get_attribute,
+	.get_integer_info = mock_get_integer_info,
+	.get_integer64_info = mock_get_integer64_info,
+	.get_enumerated_info = mock_get_enumerated_info,
+	.get_enumerated_name = mock_get_enumerated_name,
+	.read_integer = mock_read_integer,
+	.read_integer64 = mock_read_integer64,
+	.read_enumerated = mock_read_enumerated,
+	.read_bytes = mock_read_bytes,
+	.read_iec958 = mock_read_iec958,
+	.write_integer = mock_write_integer,
+	.write_integer64 = mock_write_integer64,
+	.write_enumerated = mock_write_enumerated,
+	.write_bytes = mock_write_bytes,
+	.write_iec958 = mock_write_iec958,
+	.subscribe_events = mock_subscribe_events,
+	.read_event = mock_read_event,
+};
+
+/* each open creates a new handle, the elements are shared */
+int mock_ctl_open(snd_ctl_t **handle, int mode)
+{
+	snd_ctl_ext_t *ext;
+	int err;
+
+	if (mock == NULL)
+		return -ENODEV;
+	ext = calloc(1, sizeof(*ext));
+	if (ext == NULL)
+		return -ENOMEM;
+	ext->version = SND_CTL_EXT_VERSION;
+	ext->card_idx = MOCK_CARD;
+	strcpy(ext->id, "Mock");
+	strcpy(ext->driver, "Mock");
+	strcpy(ext->name, "Mock");
+	snprintf(ext->longname, sizeof(ext->longname),
+		 "Mock control device with %u controls", mock->count);
+	strcpy(ext->mixername, "Mock Mixer");
+	ext->poll_fd = -1;
+	ext->callback = &mock_callback;
+	ext->tlv.c = mock_tlv;
+	err = snd_ctl_ext_create(ext, "mock", mode);
+	if (err < 0) {
+		free(ext);
+		return err;
+	}
+	*handle = ext->handle;
+	return 0;
+}
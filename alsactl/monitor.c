@@ -20,14 +20,106 @@
 #include "aconfig.h"
 #include "version.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <alsa/asoundlib.h>
+#include "alsactl.h"
+
+/*
+ * The events are written in the text, JSON lines or binary format with
+ * the monotonic timestamps. The VALUE events can be coalesced per
+ * element: the first event opens the window, the element value is read
+ * and written once when the window expires.
+ */
+
+enum {
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_BINARY,
+};
+
+/* binary record, followed by 'size' bytes of the value (native endian) */
+struct monitor_record {
+	uint64_t tstamp;		/* CLOCK_MONOTONIC in nanoseconds */
+	int32_t card;			/* -1 = not known */
+	uint32_t numid;
+	uint32_t mask;			/* SND_CTL_EVENT_MASK_* */
+	uint32_t events;		/* coalesced events */
+	uint32_t iface;
+	uint32_t device;
+	uint32_t subdevice;
+	uint32_t index;
+	char name[44];
+	uint32_t type;			/* SND_CTL_ELEM_TYPE_*, 0 = no value */
+	uint32_t count;			/* values */
+	uint32_t size;			/* int64_t per value, bytes otherwise */
+};
+
+/* epoll tags (the upper 32 bits), the card slot is used otherwise */
+#define EP_INOTIFY	0xffffffffU
+#define EP_TIMER	0xfffffffeU
+
+#define ELEM_CHUNK	64
+
+struct mon_elem {
+	struct mon_card *card;
+	unsigned int mask;		/* pending mask */
+	unsigned int events;		/* pending events */
+	uint64_t tstamp;		/* the last event */
+	uint64_t deadline;
+	struct mon_elem *next;		/* pending list */
+	snd_ctl_elem_id_t *id;
+	snd_ctl_elem_type_t type;	/* 0 = not known yet */
+	unsigned int count;
+	int readable;
+};
+
+struct mon_card {
+	snd_ctl_t *ctl;
+	int card;
+	int pfds;
+	unsigned int nchunks;
+	struct mon_elem **chunks;	/* indexed by numid / ELEM_CHUNK */
+};
+
+struct monitor {
+	int format;
+	uint64_t window;		/* coalescing window in nanoseconds */
+	int show_cards;
+	int epfd;
+	int tfd;
+	struct mon_card **cards;
+	int count;
+	struct mon_elem *pending, *pending_last;
+	snd_ctl_elem_info_t *info;
+	snd_ctl_elem_value_t *value;
+	unsigned char *buf;
+};
+
+static volatile sig_atomic_t quit;
+
+static void signal_handler_quit(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 static int open_ctl(const char *name, snd_ctl_t **ctlp)
 {
 	snd_ctl_t *ctl;
 	int err;
 
-	err = snd_ctl_open(&ctl, name, SND_CTL_READONLY);
+	err = snd_ctl_open(&ctl, name, SND_CTL_READONLY|SND_CTL_NONBLOCK);
 	if (err < 0) {
 		fprintf(stderr, "Cannot open ctl %s\n", name);
 		return err;
@@ -42,34 +134,226 @@ static int open_ctl(const char *name, snd_ctl_t **ctlp)
 	return 0;
 }
 
-static int print_event(int card, snd_ctl_t *ctl)
+static void card_free(struct monitor *mon, struct mon_card **cardp)
 {
-	snd_ctl_event_t *event;
-	unsigned int mask;
-	int err;
+	struct mon_card *card = *cardp;
+	struct mon_elem *e, **prev;
+	unsigned int i, j;
 
-	snd_ctl_event_alloca(&event);
-	err = snd_ctl_read(ctl, event);
-	if (err < 0)
+	if (card == NULL)
+		return;
+	/* drop the pending events of the card */
+	for (prev = &mon->pending, mon->pending_last = NULL; (e = *prev);) {
+		if (e->card == card) {
+			*prev = e->next;
+			continue;
+		}
+		mon->pending_last = e;
+		prev = &e->next;
+	}
+	for (i = 0; i < card->nchunks; i++) {
+		if (card->chunks[i] == NULL)
+			continue;
+		for (j = 0; j < ELEM_CHUNK; j++) {
+			if (card->chunks[i][j].id)
+				snd_ctl_elem_id_free(card->chunks[i][j].id);
+		}
+		free(card->chunks[i]);
+	}
+	free(card->chunks);
+	snd_ctl_close(card->ctl);
+	free(card);
+	*cardp = NULL;
+}
+
+static int card_add(struct monitor *mon, const char *name, int cardno)
+{
+	struct mon_card *card, **cards;
+	struct pollfd *pfd;
+	struct epoll_event ev;
+	int slot, i, err;
+
+	for (slot = 0; slot < mon->count; slot++)
+		if (mon->cards[slot] == NULL)
+			break;
+	if (slot >= mon->count) {
+		cards = realloc(mon->cards, sizeof(*cards) * (mon->count + 8));
+		if (cards == NULL)
+			return -ENOMEM;
+		memset(cards + mon->count, 0, sizeof(*cards) * 8);
+		mon->cards = cards;
+		mon->count += 8;
+	}
+	card = calloc(1, sizeof(*card));
+	if (card == NULL)
+		return -ENOMEM;
+	card->card = cardno;
+	err = open_ctl(name, &card->ctl);
+	if (err < 0) {
+		free(card);
 		return err;
+	}
+	mon->cards[slot] = card;
+	card->pfds = snd_ctl_poll_descriptors_count(card->ctl);
+	if (card->pfds <= 0)
+		goto _err;
+	pfd = alloca(sizeof(*pfd) * card->pfds);
+	if (snd_ctl_poll_descriptors(card->ctl, pfd, card->pfds) != card->pfds)
+		goto _err;
+	for (i = 0; i < card->pfds; i++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = pfd[i].events;
+		ev.data.u64 = ((uint64_t)slot << 32) | i;
+		if (epoll_ctl(mon->epfd, EPOLL_CTL_ADD, pfd[i].fd, &ev) < 0)
+			goto _err;
+	}
+	return 0;
+
+ _err:
+	card_free(mon, &mon->cards[slot]);
+	return -EIO;
+}
+
+static int card_present(struct monitor *mon, int cardno)
+{
+	int i;
+
+	for (i = 0; i < mon->count; i++)
+		if (mon->cards[i] && mon->cards[i]->card == cardno)
+			return 1;
+	return 0;
+}
+
+static int add_cards(struct monitor *mon)
+{
+	char cardname[16];
+	int card = -1, err;
 
-	if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+	while (snd_card_next(&card) >= 0 && card >= 0) {
+		if (card_present(mon, card))
+			continue;
+		sprintf(cardname, "hw:%d", card);
+		err = card_add(mon, cardname, card);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/* the elements are allocated in chunks, the pointers stay valid */
+static struct mon_elem *card_elem(struct mon_card *card, unsigned int numid)
+{
+	struct mon_elem **chunks, *chunk;
+	unsigned int i, n = numid / ELEM_CHUNK;
+
+	if (n >= card->nchunks) {
+		chunks = realloc(card->chunks, sizeof(*chunks) * (n + 1));
+		if (chunks == NULL)
+			return NULL;
+		memset(chunks + card->nchunks, 0,
+		       sizeof(*chunks) * (n + 1 - card->nchunks));
+		card->chunks = chunks;
+		card->nchunks = n + 1;
+	}
+	if (card->chunks[n] == NULL) {
+		chunk = calloc(ELEM_CHUNK, sizeof(*chunk));
+		if (chunk == NULL)
+			return NULL;
+		for (i = 0; i < ELEM_CHUNK; i++)
+			chunk[i].card = card;
+		card->chunks[n] = chunk;
+	}
+	return &card->chunks[n][numid % ELEM_CHUNK];
+}
+
+/* the element type is cached until the INFO event */
+static int elem_info(struct monitor *mon, struct mon_card *card,
+		     struct mon_elem *e)
+{
+	if (e->type)
 		return 0;
+	snd_ctl_elem_info_set_id(mon->info, e->id);
+	if (snd_ctl_elem_info(card->ctl, mon->info) < 0)
+		return -ENOENT;
+	e->type = snd_ctl_elem_info_get_type(mon->info);
+	e->count = snd_ctl_elem_info_get_count(mon->info);
+	e->readable = snd_ctl_elem_info_is_readable(mon->info);
+	return 0;
+}
 
-	if (card >= 0)
-		printf("card %d, ", card);
+/* read the value to mon->buf, returns the size or 0 */
+static unsigned int elem_value(struct monitor *mon, struct mon_card *card,
+			       struct mon_elem *e)
+{
+	int64_t *v = (int64_t *)mon->buf;
+	const void *bytes;
+	unsigned int idx, count;
+
+	if (elem_info(mon, card, e) < 0 || !e->readable)
+		return 0;
+	snd_ctl_elem_value_set_id(mon->value, e->id);
+	if (snd_ctl_elem_read(card->ctl, mon->value) < 0)
+		return 0;
+	count = e->count;
+	switch (e->type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		for (idx = 0; idx < count; idx++)
+			v[idx] = snd_ctl_elem_value_get_boolean(mon->value, idx);
+		return count * sizeof(*v);
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		for (idx = 0; idx < count; idx++)
+			v[idx] = snd_ctl_elem_value_get_integer(mon->value, idx);
+		return count * sizeof(*v);
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		for (idx = 0; idx < count; idx++)
+			v[idx] = snd_ctl_elem_value_get_integer64(mon->value, idx);
+		return count * sizeof(*v);
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		for (idx = 0; idx < count; idx++)
+			v[idx] = snd_ctl_elem_value_get_enumerated(mon->value, idx);
+		return count * sizeof(*v);
+	case SND_CTL_ELEM_TYPE_BYTES:
+	case SND_CTL_ELEM_TYPE_IEC958:
+		if (e->type == SND_CTL_ELEM_TYPE_IEC958)
+			count = sizeof(snd_aes_iec958_t);
+		bytes = snd_ctl_elem_value_get_bytes(mon->value);
+		memcpy(mon->buf, bytes, count);
+		return count;
+	default:
+		return 0;
+	}
+}
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_text(struct monitor *mon, struct mon_card *card,
+		       struct mon_elem *e, unsigned int mask)
+{
+	if (mon->show_cards)
+		printf("card %d, ", card->card);
 	printf("#%d (%i,%i,%i,%s,%i)",
-	       snd_ctl_event_elem_get_numid(event),
-	       snd_ctl_event_elem_get_interface(event),
-	       snd_ctl_event_elem_get_device(event),
-	       snd_ctl_event_elem_get_subdevice(event),
-	       snd_ctl_event_elem_get_name(event),
-	       snd_ctl_event_elem_get_index(event));
-
-	mask = snd_ctl_event_elem_get_mask(event);
+	       snd_ctl_elem_id_get_numid(e->id),
+	       snd_ctl_elem_id_get_interface(e->id),
+	       snd_ctl_elem_id_get_device(e->id),
+	       snd_ctl_elem_id_get_subdevice(e->id),
+	       snd_ctl_elem_id_get_name(e->id),
+	       snd_ctl_elem_id_get_index(e->id));
+
 	if (mask == SND_CTL_EVENT_MASK_REMOVE) {
 		printf(" REMOVE\n");
-		return 0;
+		return;
 	}
 
 	if (mask & SND_CTL_EVENT_MASK_VALUE)
@@ -81,65 +365,340 @@ static int print_event(int card, snd_ctl_t *ctl)
 	if (mask & SND_CTL_EVENT_MASK_TLV)
 		printf(" TLV");
 	printf("\n");
-	return 0;
 }
 
-#define MAX_CARDS	256
+static void print_json(struct monitor *mon, struct mon_card *card,
+		       struct mon_elem *e, unsigned int mask,
+		       unsigned int size)
+{
+	const int64_t *v = (const int64_t *)mon->buf;
+	unsigned int idx;
+	const char *sep = "";
+
+	printf("{\"time\":%llu.%09llu", (unsigned long long)(e->tstamp / 1000000000),
+	       (unsigned long long)(e->tstamp % 1000000000));
+	if (mon->show_cards)
+		printf(",\"card\":%d", card->card);
+	printf(",\"numid\":%u,\"iface\":\"%s\",\"device\":%u,\"subdevice\":%u,\"name\":",
+	       snd_ctl_elem_id_get_numid(e->id),
+	       snd_ctl_elem_iface_name(snd_ctl_elem_id_get_interface(e->id)),
+	       snd_ctl_elem_id_get_device(e->id),
+	       snd_ctl_elem_id_get_subdevice(e->id));
+	print_json_string(snd_ctl_elem_id_get_name(e->id));
+	printf(",\"index\":%u,\"events\":%u,\"mask\":[",
+	       snd_ctl_elem_id_get_index(e->id), e->events);
+	if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+		printf("\"remove\"]}\n");
+		return;
+	}
+	if (mask & SND_CTL_EVENT_MASK_VALUE) {
+		printf("%s\"value\"", sep);
+		sep = ",";
+	}
+	if (mask & SND_CTL_EVENT_MASK_INFO) {
+		printf("%s\"info\"", sep);
+		sep = ",";
+	}
+	if (mask & SND_CTL_EVENT_MASK_ADD) {
+		printf("%s\"add\"", sep);
+		sep = ",";
+	}
+	if (mask & SND_CTL_EVENT_MASK_TLV)
+		printf("%s\"tlv\"", sep);
+	putchar(']');
+	if (size > 0) {
+		printf(",\"type\":\"%s\",\"value\":", snd_ctl_elem_type_name(e->type));
+		if (e->type == SND_CTL_ELEM_TYPE_BYTES ||
+		    e->type == SND_CTL_ELEM_TYPE_IEC958) {
+			putchar('"');
+			for (idx = 0; idx < size; idx++)
+				printf("%02x", mon->buf[idx]);
+			putchar('"');
+		} else {
+			putchar('[');
+			for (idx = 0; idx < size / sizeof(*v); idx++)
+				printf(idx ? ",%lld" : "%lld", (long long)v[idx]);
+			putchar(']');
+		}
+	}
+	printf("}\n");
+}
 
-int monitor(const char *name)
+static void print_binary(struct monitor *mon, struct mon_card *card,
+			 struct mon_elem *e, unsigned int mask,
+			 unsigned int size)
 {
-	snd_ctl_t *ctls[MAX_CARDS];
-	int ncards = 0;
-	int show_cards;
-	int i, err = 0;
+	struct monitor_record rec;
 
-	if (!name) {
-		int card = -1;
-		while (snd_card_next(&card) >= 0 && card >= 0) {
-			char cardname[16];
-			if (ncards >= MAX_CARDS) {
-				fprintf(stderr, "alsactl: too many cards\n");
-				err = -E2BIG;
-				goto error;
-			}
-			sprintf(cardname, "hw:%d", card);
-			err = open_ctl(cardname, &ctls[ncards]);
-			if (err < 0)
-				goto error;
-			ncards++;
+	memset(&rec, 0, sizeof(rec));
+	rec.tstamp = e->tstamp;
+	rec.card = mon->show_cards ? card->card : -1;
+	rec.numid = snd_ctl_elem_id_get_numid(e->id);
+	rec.mask = mask;
+	rec.events = e->events;
+	rec.iface = snd_ctl_elem_id_get_interface(e->id);
+	rec.device = snd_ctl_elem_id_get_device(e->id);
+	rec.subdevice = snd_ctl_elem_id_get_subdevice(e->id);
+	rec.index = snd_ctl_elem_id_get_index(e->id);
+	strncpy(rec.name, snd_ctl_elem_id_get_name(e->id), sizeof(rec.name) - 1);
+	if (size > 0) {
+		rec.type = e->type;
+		rec.count = e->count;
+		rec.size = size;
+	}
+	fwrite(&rec, sizeof(rec), 1, stdout);
+	if (size > 0)
+		fwrite(mon->buf, size, 1, stdout);
+}
+
+static void emit(struct monitor *mon, struct mon_card *card,
+		 struct mon_elem *e)
+{
+	unsigned int mask = e->mask, size = 0;
+
+	if (mon->format != FORMAT_TEXT &&
+	    (mask & (SND_CTL_EVENT_MASK_VALUE|SND_CTL_EVENT_MASK_ADD)) &&
+	    mask != SND_CTL_EVENT_MASK_REMOVE)
+		size = elem_value(mon, card, e);
+	switch (mon->format) {
+	case FORMAT_JSON:
+		print_json(mon, card, e, mask, size);
+		break;
+	case FORMAT_BINARY:
+		print_binary(mon, card, e, mask, size);
+		break;
+	default:
+		print_text(mon, card, e, mask);
+		break;
+	}
+	e->mask = 0;
+	e->events = 0;
+}
+
+/* write the expired windows and arm the timer for the next one */
+static void flush_pending(struct monitor *mon, uint64_t now)
+{
+	struct itimerspec its;
+	struct mon_elem *e;
+
+	while ((e = mon->pending) != NULL && e->deadline <= now) {
+		mon->pending = e->next;
+		if (mon->pending == NULL)
+			mon->pending_last = NULL;
+		e->next = NULL;
+		e->deadline = 0;
+		/* already written by an INFO or REMOVE event */
+		if (e->mask)
+			emit(mon, e->card, e);
+	}
+	memset(&its, 0, sizeof(its));
+	if (e) {
+		its.it_value.tv_sec = e->deadline / 1000000000;
+		its.it_value.tv_nsec = e->deadline % 1000000000;
+	}
+	timerfd_settime(mon->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int card_events(struct monitor *mon, struct mon_card *card)
+{
+	snd_ctl_event_t *event;
+	struct mon_elem *e;
+	unsigned int mask, numid;
+	uint64_t now;
+	int err, armed;
+
+	snd_ctl_event_alloca(&event);
+	while ((err = snd_ctl_read(card->ctl, event)) > 0) {
+		if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+			continue;
+		numid = snd_ctl_event_elem_get_numid(event);
+		mask = snd_ctl_event_elem_get_mask(event);
+		e = card_elem(card, numid);
+		if (e == NULL)
+			return -ENOMEM;
+		if (e->id == NULL && snd_ctl_elem_id_malloc(&e->id) < 0)
+			return -ENOMEM;
+		snd_ctl_event_elem_get_id(event, e->id);
+		now = now_nsec();
+		e->tstamp = now;
+		e->events++;
+		if (mask == SND_CTL_EVENT_MASK_REMOVE ||
+		    (mask & (SND_CTL_EVENT_MASK_INFO|SND_CTL_EVENT_MASK_ADD)))
+			e->type = 0;
+		if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+			/* the pending value is not readable anymore */
+			e->mask = mask;
+		} else {
+			e->mask |= mask;
 		}
-		show_cards = 1;
-	} else {
-		err = open_ctl(name, &ctls[0]);
-		if (err < 0)
-			goto error;
-		ncards++;
-		show_cards = 0;
+		if (mon->window == 0 || mask == SND_CTL_EVENT_MASK_REMOVE ||
+		    (mask & ~SND_CTL_EVENT_MASK_VALUE) != 0) {
+			/* only the value changes are coalesced */
+			emit(mon, card, e);
+			continue;
+		}
+		if (e->deadline)
+			continue;
+		e->deadline = now + mon->window;
+		armed = mon->pending != NULL;
+		if (mon->pending_last)
+			mon->pending_last->next = e;
+		else
+			mon->pending = e;
+		mon->pending_last = e;
+		if (!armed)
+			flush_pending(mon, now);
 	}
+	return err == -EAGAIN ? 0 : err;
+}
 
-	for (;ncards > 0;) {
-		struct pollfd fds[ncards];
+static void card_event(struct monitor *mon, unsigned int slot,
+		       unsigned int k, unsigned int events)
+{
+	struct mon_card *card = mon->cards[slot];
+	struct pollfd *pfd;
+	unsigned short revents;
+	int i;
 
-		for (i = 0; i < ncards; i++)
-			snd_ctl_poll_descriptors(ctls[i], &fds[i], 1);
+	pfd = alloca(sizeof(*pfd) * card->pfds);
+	if (snd_ctl_poll_descriptors(card->ctl, pfd, card->pfds) != card->pfds)
+		return;
+	for (i = 0; i < card->pfds; i++)
+		pfd[i].revents = i == k ? events : 0;
+	if (snd_ctl_poll_descriptors_revents(card->ctl, pfd, card->pfds,
+					     &revents) < 0)
+		revents = POLLERR;
+	if (revents & POLLIN) {
+		if (card_events(mon, card) < 0)
+			revents |= POLLERR;
+	}
+	if (revents & (POLLERR|POLLNVAL|POLLHUP))
+		card_free(mon, &mon->cards[slot]);
+}
 
-		err = poll(fds, ncards, -1);
-		if (err <= 0) {
-			err = 0;
-			break;
+static int format_parse(const char *format)
+{
+	if (format == NULL || strcmp(format, "text") == 0)
+		return FORMAT_TEXT;
+	if (strcmp(format, "json") == 0)
+		return FORMAT_JSON;
+	if (strcmp(format, "binary") == 0)
+		return FORMAT_BINARY;
+	return -EINVAL;
+}
+
+/*
+ * The output is buffered and flushed when no more events are pending,
+ * so the event bursts are written in big chunks.
+ */
+int monitor(const char *name, const char *format, int coalesce)
+{
+	struct monitor mon;
+	struct hotplug hp;
+	struct epoll_event evs[16], ev;
+	uint64_t expirations;
+	unsigned int slot;
+	int i, n, ncards, err = 0;
+
+	memset(&mon, 0, sizeof(mon));
+	mon.epfd = mon.tfd = -1;
+	hp.fd = -1;
+	mon.format = format_parse(format);
+	if (mon.format < 0) {
+		fprintf(stderr, "alsactl: unknown monitor format '%s'\n", format);
+		return -EINVAL;
+	}
+	mon.window = coalesce > 0 ? (uint64_t)coalesce * 1000000 : 0;
+	snd_ctl_elem_info_malloc(&mon.info);
+	snd_ctl_elem_value_malloc(&mon.value);
+	mon.buf = malloc(1024 * sizeof(int64_t));
+	if (mon.info == NULL || mon.value == NULL || mon.buf == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+	setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+	signal(SIGINT, signal_handler_quit);
+	signal(SIGTERM, signal_handler_quit);
+
+	mon.epfd = epoll_create1(EPOLL_CLOEXEC);
+	mon.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (mon.epfd < 0 || mon.tfd < 0) {
+		err = -errno;
+		goto error;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)EP_TIMER << 32;
+	if (epoll_ctl(mon.epfd, EPOLL_CTL_ADD, mon.tfd, &ev) < 0) {
+		err = -errno;
+		goto error;
+	}
+
+	if (!name) {
+		mon.show_cards = 1;
+		/* the watch is added before the scan, no card is missed */
+		if (hotplug_init(&hp) == 0) {
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u64 = (uint64_t)EP_INOTIFY << 32;
+			epoll_ctl(mon.epfd, EPOLL_CTL_ADD, hp.fd, &ev);
 		}
+		err = add_cards(&mon);
+	} else {
+		err = card_add(&mon, name, -1);
+	}
+	if (err < 0)
+		goto error;
 
-		for (i = 0; i < ncards; i++) {
-			unsigned short revents;
-			snd_ctl_poll_descriptors_revents(ctls[i], &fds[i], 1,
-							 &revents);
-			if (revents & POLLIN)
-				print_event(show_cards ? i : -1, ctls[i]);
+	while (!quit) {
+		for (i = ncards = 0; i < mon.count; i++)
+			if (mon.cards[i])
+				ncards++;
+		if (ncards == 0 && hp.fd < 0)
+			break;
+		n = epoll_wait(mon.epfd, evs, ARRAY_SIZE(evs), 0);
+		if (n == 0) {
+			fflush(stdout);
+			n = epoll_wait(mon.epfd, evs, ARRAY_SIZE(evs), -1);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			slot = evs[i].data.u64 >> 32;
+			if (slot == EP_INOTIFY) {
+				if (hotplug_events(&hp))
+					add_cards(&mon);
+			} else if (slot == EP_TIMER) {
+				if (read(mon.tfd, &expirations, sizeof(expirations)) > 0)
+					flush_pending(&mon, now_nsec());
+			} else if (slot < mon.count && mon.cards[slot]) {
+				card_event(&mon, slot,
+					   evs[i].data.u64 & 0xffffffffU,
+					   evs[i].events);
+			}
 		}
 	}
+	/* write the open windows */
+	flush_pending(&mon, UINT64_MAX);
 
  error:
-	for (i = 0; i < ncards; i++)
-		snd_ctl_close(ctls[i]);
+	fflush(stdout);
+	for (i = 0; i < mon.count; i++)
+		card_free(&mon, &mon.cards[i]);
+	free(mon.cards);
+	hotplug_close(&hp);
+	if (mon.tfd >= 0)
+		close(mon.tfd);
+	if (mon.epfd >= 0)
+		close(mon.epfd);
+	if (mon.info)
+		snd_ctl_elem_info_free(mon.info);
+	if (mon.value)
+		snd_ctl_elem_value_free(mon.value);
+	free(mon.buf);
 	return err;
 }
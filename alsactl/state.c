@@ -27,13 +27,15 @@
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <alsa/asoundlib.h>
 #include "alsactl.h"
 
 
 static char *id_str(snd_ctl_elem_id_t *id)
 {
-	static char str[128];
+	static __thread char str[128];
 	assert(id);
 	sprintf(str, "%i,%i,%i,%s,%i", 
 		snd_ctl_elem_id_get_interface(id),
@@ -46,7 +48,7 @@ static char *id_str(snd_ctl_elem_id_t *id)
 
 static char *num_str(long n)
 {
-	static char str[32];
+	static __thread char str[32];
 	sprintf(str, "%ld", n);
 	return str;
 }
@@ -226,7 +228,8 @@ static int add_tlv_comments(snd_ctl_t *handle, snd_ctl_elem_id_t *id,
 	return 0;
 }
 
-static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *top)
+static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *top,
+		       struct state_cache_card *cache)
 {
 	snd_ctl_elem_value_t *ctl;
 	snd_ctl_elem_info_t *info;
@@ -239,23 +242,38 @@ static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *t
 	const char *name;
 	snd_ctl_elem_type_t type;
 	unsigned int count;
+	long long start;
 	snd_ctl_elem_value_alloca(&ctl);
 	snd_ctl_elem_info_alloca(&info);
 	snd_ctl_elem_info_set_id(info, id);
+	start = bench_time();
 	err = snd_ctl_elem_info(handle, info);
 	if (err < 0) {
 		error("Cannot read control info '%s': %s", id_str(id), snd_strerror(err));
 		return err;
 	}
+	type = snd_ctl_elem_info_get_type(info);
+	bench_add(BENCH_INFO, type, start);
 
 	if (!snd_ctl_elem_info_is_readable(info))
 		return 0;
 	snd_ctl_elem_value_set_id(ctl, id);
+	start = bench_time();
 	err = snd_ctl_elem_read(handle, ctl);
 	if (err < 0) {
 		error("Cannot read control '%s': %s", id_str(id), snd_strerror(err));
 		return err;
 	}
+	bench_add(BENCH_READ, type, start);
+	start = bench_time();
+	if (cache && snd_ctl_elem_info_is_writable(info) &&
+	    !snd_ctl_elem_info_is_inactive(info)) {
+		err = state_cache_card_add(cache, info, ctl);
+		if (err < 0) {
+			error("Cannot cache control '%s': %s", id_str(id), snd_strerror(err));
+			return err;
+		}
+	}
 
 	err = snd_config_compound_add(top, num_str(snd_ctl_elem_info_get_numid(info)), 0, &control);
 	if (err < 0) {
@@ -288,7 +306,6 @@ static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *t
 		return err;
 	}
 
-	type = snd_ctl_elem_info_get_type(info);
 	device = snd_ctl_elem_info_get_device(info);
 	subdevice = snd_ctl_elem_info_get_subdevice(info);
 	index = snd_ctl_elem_info_get_index(info);
@@ -542,10 +559,12 @@ finish:
 		error("snd_config_add: %s", snd_strerror(err));
 		return err;
 	}
+	bench_add(BENCH_SERIALIZE, type, start);
 	return 0;
 }
 	
-static int get_controls(int cardno, snd_config_t *top)
+int get_controls(int cardno, snd_config_t *top,
+		 struct state_cache_card **cache)
 {
 	snd_ctl_t *handle;
 	snd_ctl_card_info_t *info;
@@ -554,15 +573,14 @@ static int get_controls(int cardno, snd_config_t *top)
 	snd_ctl_elem_id_t *elem_id;
 	unsigned int idx;
 	int err;
-	char name[32];
 	unsigned int count;
 	const char *id;
+	long long start;
 	snd_ctl_card_info_alloca(&info);
 	snd_ctl_elem_list_alloca(&list);
 	snd_ctl_elem_id_alloca(&elem_id);
 
-	sprintf(name, "hw:%d", cardno);
-	err = snd_ctl_open(&handle, name, SND_CTL_READONLY);
+	err = card_ctl_open(&handle, cardno, SND_CTL_READONLY);
 	if (err < 0) {
 		error("snd_ctl_open error: %s", snd_strerror(err));
 		return err;
@@ -609,6 +627,7 @@ static int get_controls(int cardno, snd_config_t *top)
 			goto _close;
 		}
 	}
+	start = bench_time();
 	err = snd_ctl_elem_list(handle, list);
 	if (err < 0) {
 		error("Cannot determine controls: %s", snd_strerror(err));
@@ -622,6 +641,11 @@ static int get_controls(int cardno, snd_config_t *top)
 	}
 	if (count == 0) {
 		err = 0;
+		if (cache) {
+			*cache = state_cache_card_new(id, state_cache_fingerprint(list));
+			if (*cache == NULL)
+				err = -ENOMEM;
+		}
 		goto _close;
 	}
 	snd_ctl_elem_list_set_offset(list, 0);
@@ -633,9 +657,19 @@ static int get_controls(int cardno, snd_config_t *top)
 		error("Cannot determine controls (2): %s", snd_strerror(err));
 		goto _free;
 	}
+	bench_add(BENCH_ENUMERATE, SND_CTL_ELEM_TYPE_NONE, start);
+	if (cache) {
+		*cache = state_cache_card_new(id, state_cache_fingerprint(list));
+		if (*cache == NULL) {
+			error("No enough memory...");
+			err = -ENOMEM;
+			goto _free;
+		}
+	}
 	for (idx = 0; idx < count; ++idx) {
 		snd_ctl_elem_list_get_id(list, idx, elem_id);
-		err = get_control(handle, elem_id, control);
+		err = get_control(handle, elem_id, control,
+				  cache ? *cache : NULL);
 		if (err < 0)
 			goto _free;
 	}		
@@ -1193,10 +1227,15 @@ static int restore_config_value2(snd_ctl_t *handle, snd_ctl_elem_info_t *info,
 	return 0;
 }
 
+struct set_stats {
+	int written;
+	int skipped;
+};
+
 static int set_control(snd_ctl_t *handle, snd_config_t *control,
-		       int *maxnumid, int doit)
+		       int *maxnumid, int doit, struct set_stats *stats)
 {
-	snd_ctl_elem_value_t *ctl;
+	snd_ctl_elem_value_t *ctl, *old;
 	snd_ctl_elem_info_t *info;
 	snd_config_iterator_t i, next;
 	unsigned int numid1;
@@ -1219,8 +1258,10 @@ static int set_control(snd_ctl_t *handle, snd_config_t *control,
 	int err;
 	char *set;
 	const char *id;
+	long long start;
 	snd_ctl_elem_value_alloca(&ctl);
 	snd_ctl_elem_info_alloca(&info);
+	start = bench_time();
 	if (snd_config_get_type(control) != SND_CONFIG_TYPE_COMPOUND) {
 		cerror(doit, "control is not a compound");
 		return -EINVAL;
@@ -1456,28 +1497,45 @@ static int set_control(snd_ctl_t *handle, snd_config_t *control,
 	}
 
  _ok:
-	err = doit ? snd_ctl_elem_write(handle, ctl) : 0;
+	bench_add(BENCH_MATCH, type, start);
+	if (!doit)
+		return 0;
+	start = bench_time();
+	/* the unchanged value is not written (no driver I/O and events) */
+	if (skip_unchanged) {
+		snd_ctl_elem_value_alloca(&old);
+		snd_ctl_elem_value_set_numid(old, numid1);
+		if (snd_ctl_elem_read(handle, old) >= 0 &&
+		    ctl_value_equal(type, count, ctl, old)) {
+			bench_add(BENCH_WRITE, type, start);
+			stats->skipped++;
+			return 0;
+		}
+	}
+	err = snd_ctl_elem_write(handle, ctl);
 	if (err < 0) {
 		error("Cannot write control '%d:%ld:%ld:%s:%ld' : %s", (int)iface, device, subdevice, name, index, snd_strerror(err));
 		return err;
 	}
+	bench_add(BENCH_WRITE, type, start);
+	stats->written++;
 	return 0;
 }
 
-static int set_controls(int card, snd_config_t *top, int doit)
+int set_controls(int card, snd_config_t *top, int doit)
 {
 	snd_ctl_t *handle;
 	snd_ctl_card_info_t *info;
 	snd_config_t *control;
 	snd_config_iterator_t i, next;
 	int err, maxnumid = -1;
-	char name[32], tmpid[16];
+	char tmpid[16];
 	const char *id;
+	struct set_stats stats = { 0, 0 };
 	snd_ctl_card_info_alloca(&info);
 
-	sprintf(name, "hw:%d", card);
-	dbg("device='%s', doit=%i", name, doit);
-	err = snd_ctl_open(&handle, name, 0);
+	dbg("card=%i, doit=%i", card, doit);
+	err = card_ctl_open(&handle, card, 0);
 	if (err < 0) {
 		error("snd_ctl_open error: %s", snd_strerror(err));
 		return err;
@@ -1509,12 +1567,15 @@ static int set_controls(int card, snd_config_t *top, int doit)
 	}
 	snd_config_for_each(i, next, control) {
 		snd_config_t *n = snd_config_iterator_entry(i);
-		err = set_control(handle, n, &maxnumid, doit);
+		err = set_control(handle, n, &maxnumid, doit, &stats);
 		if (err < 0 && (!force_restore || !doit))
 			goto _close;
 	}
 
 	dbg("maxnumid=%i", maxnumid);
+	if (doit)
+		dbg("card %i: %i controls written, %i unchanged", card,
+		    stats.written, stats.skipped);
 	/* check if we have additional controls in driver */
 	/* in this case we should go through init procedure */
 	if (!doit && maxnumid >= 0) {
@@ -1536,15 +1597,421 @@ static int set_controls(int card, snd_config_t *top, int doit)
 	return err;
 }
 
+/*
+ * The cards are saved and restored in parallel (one thread per card),
+ * so the slow cards do not delay the others.
+ */
+
+struct card_job {
+	pthread_t thread;
+	int started;
+	int card;
+	int err;
+	int finalerr;
+	snd_config_t *config;
+	struct state_cache_card *cache;
+	struct state_cache_file *cache_file;
+	int cached;			/* restored from the cache */
+	const char *initfile;
+	int do_init;
+};
+
+/* serializes the init parser (not reentrant) and the runstate file */
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long elapsed_usec(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L +
+	       (now.tv_nsec - start->tv_nsec) / 1000L;
+}
+
+static void job_failed(int card, const char *reason, int exitcode)
+{
+	pthread_mutex_lock(&job_mutex);
+	initfailed(card, reason, exitcode);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+static int card_jobs(const char *cardname, struct card_job **jobs)
+{
+	struct card_job *n;
+	int card, count = 0;
+
+	*jobs = NULL;
+	if (cardname) {
+		card = snd_card_get_index(cardname);
+		if (card < 0) {
+			error("Cannot find soundcard '%s'...", cardname);
+			return -ENODEV;
+		}
+		goto single;
+	}
+	card = -1;
+	/* find each installed soundcards */
+	while (1) {
+		if (snd_card_next(&card) < 0 || card < 0)
+			break;
+single:
+		n = realloc(*jobs, sizeof(*n) * (count + 1));
+		if (n == NULL) {
+			error("No enough memory...");
+			free(*jobs);
+			*jobs = NULL;
+			return -ENOMEM;
+		}
+		memset(&n[count], 0, sizeof(*n));
+		n[count].card = card;
+		*jobs = n;
+		count++;
+		if (cardname)
+			break;
+	}
+	return count;
+}
+
+static void run_jobs(struct card_job *jobs, int count, void *(*fcn)(void *))
+{
+	int i;
+
+	if (count == 1) {
+		fcn(&jobs[0]);
+		return;
+	}
+	/* load the global configuration here, the threads only check it */
+	snd_config_update();
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&jobs[i].thread, NULL, fcn, &jobs[i]) == 0)
+			jobs[i].started = 1;
+		else
+			fcn(&jobs[i]);
+	}
+	for (i = 0; i < count; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+	}
+}
+
+static void *save_card(void *arg)
+{
+	struct card_job *job = arg;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* private tree, merged later in the card order */
+	job->err = snd_config_top(&job->config);
+	if (job->err < 0)
+		error("snd_config_top error: %s", snd_strerror(job->err));
+	else
+		job->err = get_controls(job->card, job->config, &job->cache);
+	dbg("card %i: saved in %li us (result %i)", job->card,
+	    elapsed_usec(&start), job->err);
+	return NULL;
+}
+
+static void *restore_card(void *arg)
+{
+	struct card_job *job = arg;
+	struct timespec start;
+	char cardname[16];
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* do a check if controls matches state file */
+	if (job->do_init && set_controls(job->card, job->config, 0)) {
+		sprintf(cardname, "%i", job->card);
+		pthread_mutex_lock(&job_mutex);
+		err = init(job->initfile, cardname);
+		if (err < 0)
+			initfailed(job->card, "init", err);
+		pthread_mutex_unlock(&job_mutex);
+		if (err < 0)
+			job->finalerr = err;
+	}
+	if ((err = set_controls(job->card, job->config, 1))) {
+		if (!force_restore)
+			job->finalerr = err;
+		job_failed(job->card, "restore", err);
+	}
+	job->err = err;
+	dbg("card %i: restored in %li us (result %i)", job->card,
+	    elapsed_usec(&start), err);
+	return NULL;
+}
+
+static void *restore_card_cache(void *arg)
+{
+	struct card_job *job = arg;
+
+	job->cached = state_cache_restore(job->cache_file, job->card) == 0;
+	return NULL;
+}
+
+/*
+ * Restore the cards from the cache of the state file. The cards which
+ * were not restored (no cache, the control list was changed or a write
+ * failed) are moved to the beginning of jobs, the count of them is
+ * returned. Returns -ENOENT when the cache cannot be used.
+ */
+static int restore_cache(const char *file, const char *cardname,
+			 struct card_job **jobs)
+{
+	struct state_cache_file *cache;
+	int i, j, count;
+
+	cache = state_cache_open(file);
+	if (cache == NULL)
+		return -ENOENT;
+	count = card_jobs(cardname, jobs);
+	if (count <= 0) {
+		state_cache_close(cache);
+		return count;
+	}
+	for (i = 0; i < count; i++)
+		(*jobs)[i].cache_file = cache;
+	run_jobs(*jobs, count, restore_card_cache);
+	state_cache_close(cache);
+	for (i = j = 0; i < count; i++) {
+		if ((*jobs)[i].cached)
+			continue;
+		(*jobs)[j] = (*jobs)[i];
+		(*jobs)[j].started = 0;
+		(*jobs)[j].cache_file = NULL;
+		j++;
+	}
+	dbg("%i cards restored from the cache, %i from the state file",
+	    count - j, j);
+	return j;
+}
+
+/* move the card state saved by save_card() to the main tree */
+static int merge_card(snd_config_t *top, snd_config_t *src)
+{
+	snd_config_t *state, *card, *scard, *control;
+	snd_config_iterator_t i;
+	const char *id;
+	int err;
+
+	err = snd_config_search(src, "state", &scard);
+	if (err < 0)
+		return 0;
+	i = snd_config_iterator_first(scard);
+	if (i == snd_config_iterator_end(scard))
+		return 0;
+	scard = snd_config_iterator_entry(i);
+	snd_config_get_id(scard, &id);
+	err = snd_config_search(top, "state", &state);
+	if (err == 0 &&
+	    snd_config_get_type(state) != SND_CONFIG_TYPE_COMPOUND) {
+		error("config state node is not a compound");
+		return -EINVAL;
+	}
+	if (err < 0) {
+		err = snd_config_compound_add(top, "state", 1, &state);
+		if (err < 0) {
+			error("snd_config_compound_add: %s", snd_strerror(err));
+			return err;
+		}
+	}
+	err = snd_config_search(state, id, &card);
+	if (err < 0) {
+		snd_config_remove(scard);
+		err = snd_config_add(state, scard);
+		if (err < 0) {
+			snd_config_delete(scard);
+			goto _err;
+		}
+		return 0;
+	}
+	if (snd_config_get_type(card) != SND_CONFIG_TYPE_COMPOUND) {
+		error("config state.%s node is not a compound", id);
+		return -EINVAL;
+	}
+	if (snd_config_search(card, "control", &control) == 0) {
+		err = snd_config_delete(control);
+		if (err < 0) {
+			error("snd_config_delete: %s", snd_strerror(err));
+			return err;
+		}
+	}
+	if (snd_config_search(scard, "control", &control) < 0)
+		return 0;
+	snd_config_remove(control);
+	err = snd_config_add(card, control);
+	if (err < 0) {
+		snd_config_delete(control);
+		goto _err;
+	}
+	return 0;
+
+ _err:
+	error("snd_config_add: %s", snd_strerror(err));
+	return err;
+}
+
+/*
+ * The binary cache contains all cards, so it can be written only
+ * when all cards were saved. Otherwise, the old cache is removed.
+ */
+static void save_cache(const char *file, const char *cardname,
+		       struct card_job *jobs, int count)
+{
+	struct state_cache_card **cards;
+	int i;
+
+	if (cardname)
+		goto _remove;
+	cards = alloca(sizeof(*cards) * count);
+	for (i = 0; i < count; i++) {
+		if (jobs[i].cache == NULL)
+			goto _remove;
+		cards[i] = jobs[i].cache;
+	}
+	if (state_cache_save(file, cards, count) == 0)
+		return;
+ _remove:
+	state_cache_remove(file);
+}
+
+static int same_content(const char *file, const char *buf, size_t size)
+{
+	char *old;
+	size_t old_size;
+	int res;
+
+	if (file_map(file, &old, &old_size) != 0)
+		return 0;
+	res = old_size == size && memcmp(old, buf, size) == 0;
+	file_unmap(old, old_size);
+	return res;
+}
+
+static int write_file(const char *nfile, const char *buf, size_t size)
+{
+	ssize_t n;
+	int fd, err = 0;
+
+	fd = open(nfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -errno;
+	while (size > 0) {
+		n = write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		buf += n;
+		size -= n;
+	}
+	if (err == 0 && fsync(fd) < 0)
+		err = -errno;
+	if (close(fd) < 0 && err == 0)
+		err = -errno;
+	if (err < 0)
+		unlink(nfile);
+	return err;
+}
+
+/* make the rename durable */
+static void sync_dir(const char *file)
+{
+	char *dir, *p;
+	int fd;
+
+	dir = strdup(file);
+	if (dir == NULL)
+		return;
+	p = strrchr(dir, '/');
+	if (p == NULL)
+		strcpy(dir, ".");
+	else if (p == dir)
+		p[1] = '\0';
+	else
+		*p = '\0';
+	fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd >= 0) {
+		if (fsync(fd) < 0)
+			dbg("fsync %s: %s", dir, strerror(errno));
+		close(fd);
+	}
+	free(dir);
+}
+
+/*
+ * The state file is rewritten only when the content changed, so the
+ * periodic stores do not wear the flash storage. The new file is synced
+ * before the rename and the directory after the rename.
+ */
+static int write_config(const char *file, const char *nfile,
+			snd_config_t *config, int *written)
+{
+	snd_output_t *out;
+	char *buf;
+	size_t size;
+	int err;
+
+	if (written)
+		*written = 0;
+	if (nfile == NULL) {
+		err = snd_output_stdio_attach(&out, stdout, 0);
+		if (err < 0) {
+			error("Cannot open %s for writing: %s", file, snd_strerror(err));
+			return err;
+		}
+		err = snd_config_save(config, out);
+		snd_output_close(out);
+		if (err < 0)
+			error("snd_config_save: %s", snd_strerror(err));
+		return err;
+	}
+	err = snd_output_buffer_open(&out);
+	if (err < 0) {
+		error("Cannot open the output buffer: %s", snd_strerror(err));
+		return err;
+	}
+	err = snd_config_save(config, out);
+	if (err < 0) {
+		error("snd_config_save: %s", snd_strerror(err));
+		goto out;
+	}
+	size = snd_output_buffer_string(out, &buf);
+	if (same_content(file, buf, size)) {
+		dbg("%s is unchanged", file);
+		goto out;
+	}
+	err = write_file(nfile, buf, size);
+	if (err < 0) {
+		error("Cannot write %s: %s", nfile, strerror(-err));
+		goto out;
+	}
+	if (rename(nfile, file) < 0) {
+		err = -errno;
+		error("rename failed: %s (%s)", strerror(-err), file);
+		unlink(nfile);
+		goto out;
+	}
+	sync_dir(file);
+	if (written)
+		*written = 1;
+ out:
+	snd_output_close(out);
+	return err;
+}
+
 int save_state(const char *file, const char *cardname)
 {
 	int err;
 	snd_config_t *config;
 	snd_input_t *in;
-	snd_output_t *out;
 	int stdio;
 	char *nfile = NULL;
 	int lock_fd = -EINVAL;
+	struct card_job *jobs = NULL;
+	int i, count = 0, written;
 
 	err = snd_config_top(&config);
 	if (err < 0) {
@@ -1578,70 +2045,156 @@ int save_state(const char *file, const char *cardname)
 #endif
 	}
 
-	if (!cardname) {
-		int card, first = 1;
-
-		card = -1;
-		/* find each installed soundcards */
-		while (1) {
-			if (snd_card_next(&card) < 0)
-				break;
-			if (card < 0) {
-				if (first) {
-					if (ignore_nocards) {
-						err = 0;
-						goto out;
-					} else {
-						error("No soundcards found...");
-						err = -ENODEV;
-						goto out;
-					}
-				}
-				break;
-			}
-			first = 0;
-			if ((err = get_controls(card, config)))
-				goto out;
-		}
-	} else {
-		int cardno;
-
-		cardno = snd_card_get_index(cardname);
-		if (cardno < 0) {
-			error("Cannot find soundcard '%s'...", cardname);
-			err = cardno;
-			goto out;
+	count = card_jobs(cardname, &jobs);
+	if (count <= 0) {
+		err = count;
+		if (count == 0 && !ignore_nocards) {
+			error("No soundcards found...");
+			err = -ENODEV;
 		}
-		if ((err = get_controls(cardno, config))) {
+		goto out;
+	}
+	run_jobs(jobs, count, save_card);
+	/* merge in the card order, the output does not depend on timing */
+	for (i = 0; i < count; i++) {
+		err = jobs[i].err;
+		if (err == 0)
+			err = merge_card(config, jobs[i].config);
+		if (err)
 			goto out;
+	}
+
+	err = write_config(file, nfile, config, &written);
+	/* the unchanged file keeps the cache valid */
+	if (err == 0 && !stdio && (written || !state_cache_current(file)))
+		save_cache(file, cardname, jobs, count);
+out:
+	if (!stdio && lock_fd >= 0)
+		state_unlock(lock_fd, file);
+	for (i = 0; i < count; i++) {
+		if (jobs[i].config)
+			snd_config_delete(jobs[i].config);
+		state_cache_card_free(jobs[i].cache);
+	}
+	free(jobs);
+	free(nfile);
+	snd_config_delete(config);
+	snd_config_update_free_global();
+	return err;
+}
+
+/*
+ * The state mirror is used by the daemon: the configuration tree is kept
+ * in memory and only the changed controls are read again from the driver.
+ */
+
+int state_mirror_load(const char *file, snd_config_t **config)
+{
+	snd_input_t *in;
+	int err, lock_fd;
+
+	err = snd_config_top(config);
+	if (err < 0) {
+		error("snd_config_top error: %s", snd_strerror(err));
+		return err;
+	}
+	if (!strcmp(file, "-"))
+		return 0;
+	lock_fd = state_lock(file, 10);
+	if (lock_fd < 0)
+		return 0;
+	if (snd_input_stdio_open(&in, file, "r") >= 0) {
+		err = snd_config_load(*config, in);
+		snd_input_close(in);
+		if (err < 0) {
+			/* start with an empty tree like save_state() */
+			snd_config_delete(*config);
+			err = snd_config_top(config);
 		}
 	}
-	
-	if (stdio) {
-		err = snd_output_stdio_attach(&out, stdout, 0);
-	} else {
-		err = snd_output_stdio_open(&out, nfile, "w");
+	state_unlock(lock_fd, file);
+	return err;
+}
+
+int state_mirror_card(snd_config_t *config, int cardno)
+{
+	return get_controls(cardno, config, NULL);
+}
+
+int state_mirror_control(snd_config_t *config, snd_ctl_t *handle,
+			 const char *cardid, snd_ctl_elem_id_t *id)
+{
+	snd_ctl_elem_info_t *info;
+	snd_config_t *control, *tmp, *n, *old;
+	char key[32];
+	int err;
+	snd_ctl_elem_info_alloca(&info);
+
+	err = snd_config_searchv(config, &control, "state", cardid, "control", 0);
+	if (err < 0)
+		return err;
+	snd_ctl_elem_info_set_id(info, id);
+	err = snd_ctl_elem_info(handle, info);
+	if (err == -ENOENT) {
+		sprintf(key, "%u", snd_ctl_elem_id_get_numid(id));
+		if (snd_config_search(control, key, &old) == 0)
+			snd_config_delete(old);
+		return 0;
 	}
 	if (err < 0) {
-		error("Cannot open %s for writing: %s", file, snd_strerror(err));
-		err = -errno;
-		goto out;
+		error("Cannot read control info '%s': %s", id_str(id), snd_strerror(err));
+		return err;
 	}
-	err = snd_config_save(config, out);
-	snd_output_close(out);
+	sprintf(key, "%u", snd_ctl_elem_info_get_numid(info));
+	err = snd_config_top(&tmp);
 	if (err < 0) {
-		error("snd_config_save: %s", snd_strerror(err));
-	} else if (nfile) {
-		err = rename(nfile, file);
-		if (err < 0)
-			error("rename failed: %s (%s)", strerror(-err), file);
+		error("snd_config_top error: %s", snd_strerror(err));
+		return err;
 	}
-out:
-	if (!stdio && lock_fd >= 0)
+	err = get_control(handle, id, tmp, NULL);
+	if (err < 0)
+		goto _free;
+	/* not readable */
+	if (snd_config_search(tmp, key, &n) < 0)
+		goto _free;
+	snd_config_remove(n);
+	/* keep the position of the control in the file */
+	if (snd_config_search(control, key, &old) == 0)
+		err = snd_config_substitute(old, n);
+	else
+		err = snd_config_add(control, n);
+	if (err < 0) {
+		error("snd_config_add: %s", snd_strerror(err));
+		snd_config_delete(n);
+	}
+ _free:
+	snd_config_delete(tmp);
+	return err;
+}
+
+int state_mirror_save(const char *file, snd_config_t *config)
+{
+	char *nfile = NULL;
+	int err, lock_fd = -EINVAL;
+
+	if (strcmp(file, "-")) {
+		nfile = malloc(strlen(file) + 5);
+		if (nfile == NULL) {
+			error("No enough memory...");
+			return -ENOMEM;
+		}
+		strcpy(nfile, file);
+		strcat(nfile, ".new");
+		lock_fd = state_lock(file, 10);
+		if (lock_fd < 0) {
+			free(nfile);
+			return lock_fd;
+		}
+	}
+	err = write_config(file, nfile, config, NULL);
+	if (lock_fd >= 0)
 		state_unlock(lock_fd, file);
 	free(nfile);
-	snd_config_delete(config);
-	snd_config_update_free_global();
 	return err;
 }
 
@@ -1652,6 +2205,8 @@ int load_state(const char *file, const char *initfile, const char *cardname,
 	snd_config_t *config;
 	snd_input_t *in;
 	int stdio, lock_fd = -EINVAL;
+	struct card_job *jobs = NULL;
+	int i, count = -ENOENT;
 
 	err = snd_config_top(&config);
 	if (err < 0) {
@@ -1663,6 +2218,14 @@ int load_state(const char *file, const char *initfile, const char *cardname,
 		err = snd_input_stdio_attach(&in, stdin, 0);
 	} else {
 		lock_fd = state_lock(file, 10);
+		/* the text state is parsed only for the cards not cached */
+		if (lock_fd >= 0)
+			count = restore_cache(file, cardname, &jobs);
+		if (count == 0 && jobs) {
+			state_unlock(lock_fd, file);
+			err = 0;
+			goto out;
+		}
 		err = lock_fd >= 0 ? snd_input_stdio_open(&in, file, "r") : lock_fd;
 	}
 	if (err >= 0) {
@@ -1717,69 +2280,35 @@ single:
 		goto out;
 	}
 
-	if (!cardname) {
-		int card, first = 1;
-		char cardname1[16];
-
-		card = -1;
-		/* find each installed soundcards */
-		while (1) {
-			if (snd_card_next(&card) < 0)
-				break;
-			if (card < 0) {
-				if (first) {
-					if (ignore_nocards) {
-						err = 0;
-						goto out;
-					} else {
-						error("No soundcards found...");
-						err = -ENODEV;
-						goto out;
-					}
-				}
-				break;
-			}
-			first = 0;
-			/* do a check if controls matches state file */
- 			if (do_init && set_controls(card, config, 0)) {
-				sprintf(cardname1, "%i", card);
-				err = init(initfile, cardname1);
-				if (err < 0) {
-					initfailed(card, "init", err);
-					finalerr = err;
-				}
-			}
-			if ((err = set_controls(card, config, 1))) {
-				if (!force_restore)
-					finalerr = err;
-				initfailed(card, "restore", err);
-			}
-		}
-	} else {
-		int cardno;
-
-		cardno = snd_card_get_index(cardname);
-		if (cardno < 0) {
-			error("Cannot find soundcard '%s'...", cardname);
+	/* the cards are already listed when the cache was used */
+	if (count == -ENOENT)
+		count = card_jobs(cardname, &jobs);
+	if (count <= 0) {
+		err = count;
+		if (count == 0 && !ignore_nocards) {
+			error("No soundcards found...");
 			err = -ENODEV;
-			goto out;
-		}
-		/* do a check if controls matches state file */
-		if (do_init && set_controls(cardno, config, 0)) {
-			err = init(initfile, cardname);
-			if (err < 0) {
-				initfailed(cardno, "init", err);
-				finalerr = err;
-			}
-		}
-		if ((err = set_controls(cardno, config, 1))) {
-			initfailed(cardno, "restore", err);
-			if (!force_restore)
-				goto out;
 		}
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		jobs[i].config = config;
+		jobs[i].initfile = initfile;
+		jobs[i].do_init = do_init;
+	}
+	run_jobs(jobs, count, restore_card);
+	for (i = 0; i < count; i++) {
+		if (jobs[i].finalerr)
+			finalerr = jobs[i].finalerr;
+	}
+	/* the single card restore fails on the first error */
+	if (cardname && jobs[0].err && !force_restore) {
+		err = jobs[0].err;
+		goto out;
 	}
 	err = finalerr;
 out:
+	free(jobs);
 	snd_config_delete(config);
 	snd_config_update_free_global();
 	return err;
@@ -30,6 +30,7 @@
 #include <syslog.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/inotify.h>
 
 #include <alsa/asoundlib.h>
 #include "alsactl.h"
@@ -80,6 +81,133 @@ size_t line_width(const char *buf, size_t bufsize, size_t pos)
 	return count - pos;
 }
 
+int ctl_value_equal(snd_ctl_elem_type_t type, unsigned int count,
+		    snd_ctl_elem_value_t *val1, snd_ctl_elem_value_t *val2)
+{
+	unsigned int idx;
+
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		for (idx = 0; idx < count; idx++)
+			if (snd_ctl_elem_value_get_boolean(val1, idx) !=
+			    snd_ctl_elem_value_get_boolean(val2, idx))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		for (idx = 0; idx < count; idx++)
+			if (snd_ctl_elem_value_get_integer(val1, idx) !=
+			    snd_ctl_elem_value_get_integer(val2, idx))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		for (idx = 0; idx < count; idx++)
+			if (snd_ctl_elem_value_get_integer64(val1, idx) !=
+			    snd_ctl_elem_value_get_integer64(val2, idx))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		for (idx = 0; idx < count; idx++)
+			if (snd_ctl_elem_value_get_enumerated(val1, idx) !=
+			    snd_ctl_elem_value_get_enumerated(val2, idx))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_IEC958:
+		count = sizeof(snd_aes_iec958_t);
+		/* fall through */
+	case SND_CTL_ELEM_TYPE_BYTES:
+		return memcmp(snd_ctl_elem_value_get_bytes(val1),
+			      snd_ctl_elem_value_get_bytes(val2), count) == 0;
+	default:
+		return 0;
+	}
+}
+
+/* open the control device of the card (MOCK_CARD is the bench device) */
+int card_ctl_open(snd_ctl_t **handle, int card, int mode)
+{
+	char name[32];
+
+	if (card == MOCK_CARD)
+		return mock_ctl_open(handle, mode);
+	sprintf(name, "hw:%d", card);
+	return snd_ctl_open(handle, name, mode);
+}
+
+/*
+ * The new cards are detected using inotify: the control device creation
+ * in DEV_SND_DIR is watched (or the DEV_SND_DIR creation in DEV_DIR when
+ * no card is present yet).
+ */
+int hotplug_init(struct hotplug *hp)
+{
+	int err;
+
+	hp->dev_wd = hp->snd_wd = -1;
+	hp->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (hp->fd < 0)
+		return -errno;
+	hp->snd_wd = inotify_add_watch(hp->fd, DEV_SND_DIR, IN_CREATE|IN_MOVED_TO);
+	if (hp->snd_wd < 0) {
+		/* no cards yet, wait for the directory */
+		hp->dev_wd = inotify_add_watch(hp->fd, DEV_DIR, IN_CREATE);
+		if (hp->dev_wd < 0) {
+			err = -errno;
+			close(hp->fd);
+			hp->fd = -1;
+			return err;
+		}
+	}
+	return 0;
+}
+
+/* read the pending events, returns 1 when the cards should be rescanned */
+int hotplug_events(struct hotplug *hp)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int rescan = 0;
+
+	while ((len = read(hp->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				rescan = 1;
+				continue;
+			}
+			if ((ev->mask & IN_IGNORED) && ev->wd == hp->snd_wd) {
+				/* the directory was removed, wait for it again */
+				hp->snd_wd = -1;
+				hp->dev_wd = inotify_add_watch(hp->fd, DEV_DIR, IN_CREATE);
+				continue;
+			}
+			if (ev->len == 0)
+				continue;
+			if (ev->wd == hp->dev_wd && strcmp(ev->name, "snd") == 0) {
+				hp->snd_wd = inotify_add_watch(hp->fd, DEV_SND_DIR,
+							IN_CREATE|IN_MOVED_TO);
+				if (hp->snd_wd >= 0) {
+					inotify_rm_watch(hp->fd, hp->dev_wd);
+					hp->dev_wd = -1;
+				}
+				rescan = 1;
+			} else if (ev->wd == hp->snd_wd &&
+				   strncmp(ev->name, "controlC", 8) == 0) {
+				rescan = 1;
+			}
+		}
+	}
+	return rescan;
+}
+
+void hotplug_close(struct hotplug *hp)
+{
+	if (hp->fd >= 0)
+		close(hp->fd);
+	hp->fd = -1;
+}
+
 void initfailed(int cardnumber, const char *reason, int exitcode)
 {
 	int fp;
@@ -32,15 +32,45 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "alsaloop.h"
 
+#define THREAD_UNIQUE	10000000	/* -T -1 thread numbers */
+#define RELOAD_THREADS	32		/* threads created by reload */
+
+struct loopback_thread;
+
+/* loops initialized and started by one startup thread */
+struct startup_job {
+	struct loopback_thread *thread;
+	pthread_t id;
+	struct loopback **loopbacks;
+	int loopbacks_count;
+};
+
 struct loopback_thread {
 	int threaded;
 	pthread_t thread;
 	int exitcode;
+	int finished;			/* my_exit() was called */
+	int start_pending;		/* the slot is started by reload() */
 	struct loopback **loopbacks;
 	int loopbacks_count;
 	snd_output_t *output;
+	/* parallel startup */
+	struct startup_job *jobs;
+	int jobs_count;
+	int pending;			/* loops not started yet */
+	int started;			/* the first startup is finished */
+	int wakeup[2];			/* a loop is ready or reload request */
+	int id;				/* thread number from the config */
+	/* configuration reload, queued by the main thread */
+	pthread_mutex_t lock;
+	struct loopback **add;
+	int add_count;
+	struct loopback **remove;
+	int remove_count;
 };
 
 int quit = 0;
@@ -50,22 +80,38 @@ int daemonize = 0;
 int use_syslog = 0;
 struct loopback **loopbacks = NULL;
 int loopbacks_count = 0;
+struct loopback_share *shares = NULL;
 char **my_argv = NULL;
 int my_argc = 0;
 struct loopback_thread *threads;
 int threads_count = 0;
+int threads_alloc = 0;
+int threads_running = 0;
+int threads_failed = 0;		/* exit code of the reused thread slots */
 pthread_t main_job;
 int arg_default_xrun = 0;
 int arg_default_wake = 0;
+double arg_default_pll = 0;
+double startup_time;
+char *config_file = NULL;
+static volatile sig_atomic_t reload_pending = 0;
+static sigset_t main_sigmask;
+
+static void startup_join(struct loopback_thread *thread);
 
 static void my_exit(struct loopback_thread *thread, int exitcode)
 {
 	int i;
 
+	startup_join(thread);
 	for (i = 0; i < thread->loopbacks_count; i++)
 		pcmjob_done(thread->loopbacks[i]);
 	if (thread->threaded) {
 		thread->exitcode = exitcode;
+		__atomic_store_n(&thread->finished, 1, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&threads_running, 1, __ATOMIC_RELEASE);
+		/* wake up the main thread waiting for the reload requests */
+		pthread_kill(main_job, SIGUSR2);
 		pthread_exit(0);
 	}
 	exit(exitcode);
@@ -134,6 +180,117 @@ static int create_loopback(struct loopback **_handle,
 	return 0;
 }
 
+static void free_loopback_handle(struct loopback_handle *handle)
+{
+	free(handle->device);
+	free(handle->ctldev);
+	free(handle->id);
+	free(handle);
+}
+
+static void free_mixer_control(struct loopback_control *control)
+{
+	if (control->id)
+		snd_ctl_elem_id_free(control->id);
+	if (control->info)
+		snd_ctl_elem_info_free(control->info);
+	if (control->value)
+		snd_ctl_elem_value_free(control->value);
+}
+
+/* pcmjob_done() must be called for the started loops */
+static void free_loopback(struct loopback *loop)
+{
+	struct loopback_mixer *mixer;
+	struct loopback_ossmixer *ossmixer;
+	struct loopback_effect *effect;
+
+	while ((mixer = loop->controls) != NULL) {
+		loop->controls = mixer->next;
+		free_mixer_control(&mixer->src);
+		free_mixer_control(&mixer->dst);
+		free(mixer);
+	}
+	while ((ossmixer = loop->oss_controls) != NULL) {
+		loop->oss_controls = ossmixer->next;
+		free((char *)ossmixer->alsa_id);
+		free((char *)ossmixer->oss_id);
+		free(ossmixer);
+	}
+	while ((effect = loop->effects) != NULL) {
+		loop->effects = effect->next;
+		effect_free(effect);
+	}
+	free_loopback_handle(loop->play);
+	free_loopback_handle(loop->capt);
+	free(loop->config_line);
+	free(loop);
+}
+
+static int add_share(struct loopback_handle *lhandle, const char *name,
+		     int capture)
+{
+	struct loopback_share *share;
+	struct loopback_handle **handles;
+
+	for (share = shares; share; share = share->next)
+		if (share->capture == !!capture && strcmp(share->name, name) == 0)
+			break;
+	if (share == NULL) {
+		share = calloc(1, sizeof(*share));
+		if (share == NULL)
+			return -ENOMEM;
+		share->name = strdup(name);
+		if (share->name == NULL) {
+			free(share);
+			return -ENOMEM;
+		}
+		share->capture = capture ? 1 : 0;
+		share->next = shares;
+		shares = share;
+	}
+	handles = realloc(share->handles, (share->handles_count + 1) *
+						sizeof(struct loopback_handle *));
+	if (handles == NULL)
+		return -ENOMEM;
+	share->handles = handles;
+	share->handles[share->handles_count++] = lhandle;
+	lhandle->share = share;
+	return 0;
+}
+
+static void free_shares(struct loopback_share *share)
+{
+	struct loopback_share *next;
+
+	for (; share; share = next) {
+		next = share->next;
+		free(share->name);
+		free(share->handles);
+		free(share);
+	}
+}
+
+/* all loops using one shared PCM must be serviced by one thread */
+static void fix_share_threads(void)
+{
+	struct loopback_share *share;
+	int i, t, changed;
+
+	do {
+		changed = 0;
+		for (share = shares; share; share = share->next) {
+			t = share->handles[0]->loopback->thread;
+			for (i = 1; i < share->handles_count; i++) {
+				if (share->handles[i]->loopback->thread == t)
+					continue;
+				share->handles[i]->loopback->thread = t;
+				changed = 1;
+			}
+		}
+	} while (changed);
+}
+
 static void set_loop_time(struct loopback *loop, unsigned long loop_time)
 {
 	loop->loop_time = loop_time;
@@ -165,6 +322,7 @@ void help(void)
 "Usage: alsaloop [OPTION]...\n\n"
 "-h,--help      help\n"
 "-g,--config    configuration file (one line = one job specified)\n"
+"                 (SIGHUP reloads the changed jobs)\n"
 "-d,--daemonize daemonize the main process and use syslog for errors\n"
 "-P,--pdevice   playback device\n"
 "-C,--cdevice   capture device\n"
@@ -184,15 +342,29 @@ void help(void)
 "-b,--nblock    non-block mode (very early process wakeup)\n"
 "-S,--sync      sync mode(0=none,1=simple,2=captshift,3=playshift,4=samplerate,\n"
 "                         5=auto)\n"
+"-G,--pll       PI drift compensation loop bandwidth in Hz (0=legacy sync)\n"
+"-H,--pll-damping\n"
+"               PI drift compensation loop damping factor\n"
+"-I,--pll-sim   simulate the drift compensation and exit, argument is:\n"
+"                 PPM[,JITTER_US[,PERIOD_US[,SECONDS]]]\n"
 "-a,--slave     stream parameters slave mode (0=auto, 1=on, 2=off)\n"
 "-T,--thread    thread number (-1 = create unique)\n"
+"-j,--split     run capture in a separate thread\n"
+"-D,--direct    copy between the mmap areas without a buffer\n"
+"-Q,--simulate  run offline simulation (virtual devices and clock), argument:\n"
+"                 skew=PPM,jitter=US,cperiod=FRAMES,pperiod=FRAMES,\n"
+"                 seconds=SECS,interval=MS,xrun=SECS,stall=MS,seed=N\n"
+"-K,--share     share the capture device with other jobs using NAME\n"
+"-M,--mix       mix to the playback device with other jobs using NAME\n"
 "-m,--mixer	redirect mixer, argument is:\n"
 "		    SRC_SLAVE_ID(PLAYBACK)[@DST_SLAVE_ID(CAPTURE)]\n"
 "-O,--ossmixer	rescan and redirect oss mixer, argument is:\n"
 "		    ALSA_ID@OSS_ID  (for example: \"Master@VOLUME\")\n"
-"-e,--effect    apply an effect (bandpass filter sweep)\n"
+"-e,--effect    apply an effect (can be repeated, applied in order):\n"
+"                 gain:DB, eq:TYPE,FREQ,Q,GAIN_DB, limiter:DB[,RELEASE_MS],\n"
+"                 mix:ROW0;ROW1;... (ROW is COEF0,COEF1,...)\n"
 "-v,--verbose   verbose mode (more -v means more verbose)\n"
-"-w,--workaround use workaround (serialopen)\n"
+"-w,--workaround use workaround (serialopen,notstamp)\n"
 "-U,--xrun      xrun profiling\n"
 "-W,--wake      process wake timeout in ms\n"
 "-z,--syslog    use syslog for errors\n"
@@ -335,6 +507,28 @@ static int add_oss_mixers(struct loopback *loop,
 	return 0;
 }
 
+static int add_effects(struct loopback *loop,
+		       char **effects,
+		       int effects_count)
+{
+	struct loopback_effect *effect, *last = NULL;
+	int err;
+
+	while (effects_count > 0) {
+		err = effect_parse(&effect, *effects);
+		if (err < 0)
+			return err;
+		if (last)
+			last->next = effect;
+		else
+			loop->effects = effect;
+		last = effect;
+		effects++;
+		effects_count--;
+	}
+	return 0;
+}
+
 static void enable_syslog(void)
 {
 	if (!use_syslog) {
@@ -345,6 +539,22 @@ static void enable_syslog(void)
 
 static int parse_config_file(const char *file, snd_output_t *output);
 
+static void pll_sim(const char *arg, double bandwidth, double damping,
+		    unsigned int rate, snd_output_t *output)
+{
+	struct loopback_pll pll;
+	double ppm = 100, jitter = 500, period = 5000, duration = 120;
+
+	sscanf(arg, "%lf,%lf,%lf,%lf", &ppm, &jitter, &period, &duration);
+	if (period < 1)
+		period = 1;
+	memset(&pll, 0, sizeof(pll));
+	pll.bandwidth = bandwidth > 0 ? bandwidth : 0.05;
+	pll.damping = damping;
+	pll_simulate(&pll, output, rate, ppm, jitter / 1000000.0,
+		     period / 1000000.0, duration);
+}
+
 static int parse_config(int argc, char *argv[], snd_output_t *output,
 			int cmdline)
 {
@@ -366,7 +576,7 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		{"period", 1, NULL, 'E'},
 		{"seconds", 1, NULL, 's'},
 		{"nblock", 0, NULL, 'b'},
-		{"effect", 0, NULL, 'e'},
+		{"effect", 1, NULL, 'e'},
 		{"verbose", 0, NULL, 'v'},
 		{"resample", 0, NULL, 'n'},
 		{"samplerate", 1, NULL, 'A'},
@@ -378,6 +588,14 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		{"workaround", 1, NULL, 'w'},
 		{"xrun", 0, NULL, 'U'},
 		{"syslog", 0, NULL, 'z'},
+		{"pll", 1, NULL, 'G'},
+		{"pll-damping", 1, NULL, 'H'},
+		{"pll-sim", 1, NULL, 'I'},
+		{"share", 1, NULL, 'K'},
+		{"mix", 1, NULL, 'M'},
+		{"split", 0, NULL, 'j'},
+		{"direct", 0, NULL, 'D'},
+		{"simulate", 1, NULL, 'Q'},
 		{NULL, 0, NULL, 0},
 	};
 	int err, morehelp;
@@ -386,6 +604,8 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	char *arg_cdevice = NULL;
 	char *arg_pctl = NULL;
 	char *arg_cctl = NULL;
+	char *arg_share = NULL;
+	char *arg_mix = NULL;
 	unsigned int arg_latency_req = 0;
 	unsigned int arg_latency_reqtime = 10000;
 	snd_pcm_format_t arg_format = SND_PCM_FORMAT_S16_LE;
@@ -395,7 +615,6 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	snd_pcm_uframes_t arg_period_size = 0;
 	unsigned long arg_loop_time = ~0UL;
 	int arg_nblock = 0;
-	int arg_effect = 0;
 	int arg_resample = 0;
 #ifdef USE_SAMPLERATE
 	int arg_samplerate = SRC_SINC_FASTEST + 1;
@@ -403,19 +622,25 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	int arg_sync = SYNC_TYPE_AUTO;
 	int arg_slave = SLAVE_TYPE_AUTO;
 	int arg_thread = 0;
+	int arg_split = 0;
+	int arg_direct = 0;
 	struct loopback *loop = NULL;
 	char *arg_mixers[MAX_MIXERS];
 	int arg_mixers_count = 0;
 	char *arg_ossmixers[MAX_MIXERS];
 	int arg_ossmixers_count = 0;
+	char *arg_effects[MAX_EFFECTS];
+	int arg_effects_count = 0;
 	int arg_xrun = arg_default_xrun;
 	int arg_wake = arg_default_wake;
+	double arg_pll = arg_default_pll;
+	double arg_pll_damping = PLL_DEFAULT_DAMPING;
 
 	morehelp = 0;
 	while (1) {
 		int c;
 		if ((c = getopt_long(argc, argv,
-				"hdg:P:C:X:Y:l:t:F:f:c:r:s:benvA:S:a:m:T:O:w:UW:z",
+				"hdg:P:C:X:Y:l:t:F:f:c:r:s:be:nvA:S:a:m:T:O:w:UW:zG:H:I:K:M:jDQ:",
 				long_option, NULL)) < 0)
 			break;
 		switch (c) {
@@ -480,7 +705,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			arg_nblock = 1;
 			break;
 		case 'e':
-			arg_effect = 1;
+			if (arg_effects_count >= MAX_EFFECTS) {
+				logit(LOG_CRIT, "Maximum effects reached (max %i)\n", (int)MAX_EFFECTS);
+				exit(EXIT_FAILURE);
+			}
+			arg_effects[arg_effects_count++] = optarg;
 			break;
 		case 'n':
 			arg_resample = 1;
@@ -537,7 +766,7 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'T':
 			arg_thread = atoi(optarg);
 			if (arg_thread < 0)
-				arg_thread = 10000000 + loopbacks_count;
+				arg_thread = THREAD_UNIQUE + loopbacks_count;
 			break;
 		case 'm':
 			if (arg_mixers_count >= MAX_MIXERS) {
@@ -559,6 +788,8 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'w':
 			if (strcasecmp(optarg, "serialopen") == 0)
 				workarounds |= WORKAROUND_SERIALOPEN;
+			else if (strcasecmp(optarg, "notstamp") == 0)
+				workarounds |= WORKAROUND_NOTSTAMP;
 			break;
 		case 'U':
 			arg_xrun = 1;
@@ -573,6 +804,38 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'z':
 			enable_syslog();
 			break;
+		case 'G':
+			arg_pll = atof(optarg);
+			if (arg_pll < 0 || arg_pll > 100)
+				arg_pll = 0;
+			if (cmdline)
+				arg_default_pll = arg_pll;
+			break;
+		case 'H':
+			arg_pll_damping = atof(optarg);
+			if (arg_pll_damping <= 0 || arg_pll_damping > 10)
+				arg_pll_damping = PLL_DEFAULT_DAMPING;
+			break;
+		case 'I':
+			pll_sim(optarg, arg_pll, arg_pll_damping, arg_rate,
+				output);
+			exit(EXIT_SUCCESS);
+		case 'K':
+			arg_share = optarg;
+			break;
+		case 'M':
+			arg_mix = optarg;
+			break;
+		case 'j':
+			arg_split = 1;
+			break;
+		case 'D':
+			arg_direct = 1;
+			break;
+		case 'Q':
+			if (sim_parse(optarg) < 0)
+				exit(EXIT_FAILURE);
+			break;
 		}
 	}
 
@@ -609,9 +872,13 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		loop->latency_reqtime = arg_latency_reqtime;
 		loop->sync = arg_sync;
 		loop->slave = arg_slave;
-		loop->thread = arg_thread;
+		loop->thread = loop->thread_req = arg_thread;
+		loop->split = arg_split;
+		loop->direct = arg_direct;
 		loop->xrun = arg_xrun;
 		loop->wake = arg_wake;
+		loop->pll.bandwidth = arg_pll;
+		loop->pll.damping = arg_pll_damping;
 		err = add_mixers(loop, arg_mixers, arg_mixers_count);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to add mixer controls.\n");
@@ -622,6 +889,19 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			logit(LOG_CRIT, "Unable to add ossmixer controls.\n");
 			exit(EXIT_FAILURE);
 		}
+		err = add_effects(loop, arg_effects, arg_effects_count);
+		if (err < 0) {
+			logit(LOG_CRIT, "Unable to add effects.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (arg_share && add_share(capt, arg_share, 1) < 0) {
+			logit(LOG_CRIT, "Unable to share capture device.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (arg_mix && add_share(play, arg_mix, 0) < 0) {
+			logit(LOG_CRIT, "Unable to share playback device.\n");
+			exit(EXIT_FAILURE);
+		}
 #ifdef USE_SAMPLERATE
 		loop->src_enable = arg_samplerate > 0;
 		if (loop->src_enable)
@@ -632,15 +912,41 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		return 0;
 	}
 
+	if (cmdline) {
+		/* the daemon changes the working directory */
+		config_file = realpath(arg_config, NULL);
+		if (config_file == NULL)
+			config_file = strdup(arg_config);
+	}
 	return parse_config_file(arg_config, output);
 }
 
+static char *join_args(int argc, char *argv[])
+{
+	size_t len = 1;
+	char *str;
+	int i;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	str = malloc(len);
+	if (str == NULL)
+		return NULL;
+	str[0] = '\0';
+	for (i = 0; i < argc; i++) {
+		if (i > 0)
+			strcat(str, " ");
+		strcat(str, argv[i]);
+	}
+	return str;
+}
+
 static int parse_config_file(const char *file, snd_output_t *output)
 {
 	FILE *fp;
 	char line[2048], word[2048];
-	char *str, *ptr;
-	int argc, c, err = 0;
+	char *str, *ptr, *args;
+	int argc, c, i, count, err = 0;
 	char **argv;
 
 	fp = fopen(file, "r");
@@ -693,7 +999,15 @@ static int parse_config_file(const char *file, snd_output_t *output)
 		optind = opterr = 1;
 		optopt = '?';
 
+		/* the loop identity for the configuration reload */
+		args = join_args(argc - 1, argv + 1);
+		count = loopbacks_count;
 		err = parse_config(argc, argv, output, 0);
+		for (i = count; err >= 0 && i < loopbacks_count; i++) {
+			if (loopbacks[i]->config_line == NULL)
+				loopbacks[i]->config_line = args ? strdup(args) : NULL;
+		}
+		free(args);
 	      __next:
 		if (err < 0)
 			break;
@@ -705,44 +1019,272 @@ static int parse_config_file(const char *file, snd_output_t *output)
 	return err;
 }
 
-static void thread_job1(void *_data)
+static double startup_clock(void)
 {
-	struct loopback_thread *thread = _data;
-	snd_output_t *output = thread->output;
-	struct pollfd *pfds = NULL;
-	int pfds_count = 0;
-	int i, j, err, wake = 1000000;
+	struct timespec ts;
 
-	setscheduler();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
-	for (i = 0; i < thread->loopbacks_count; i++) {
-		err = pcmjob_init(thread->loopbacks[i]);
+static void *startup_job1(void *_data)
+{
+	struct startup_job *job = _data;
+	struct loopback *loop;
+	double t0, t1;
+	int i, err = 0;
+	char c = 0;
+
+	for (i = 0; i < job->loopbacks_count; i++) {
+		loop = job->loopbacks[i];
+		t0 = startup_clock();
+		err = pcmjob_init(loop);
+		t1 = startup_clock();
+		loop->startup_init = t1 - t0;
 		if (err < 0) {
 			logit(LOG_CRIT, "Loopback initialization failure.\n");
-			my_exit(thread, EXIT_FAILURE);
+			break;
+		}
+		err = pcmjob_start(loop);
+		t0 = startup_clock();
+		loop->startup_start = t0 - t1;
+		loop->startup_ready = t0 - startup_time;
+		if (err < 0) {
+			logit(LOG_CRIT, "Loopback start failure.\n");
+			break;
 		}
 	}
+	/* the legs of shared devices are handed over at once */
+	for (i = 0; i < job->loopbacks_count; i++)
+		__atomic_store_n(&job->loopbacks[i]->startup_state,
+				 err < 0 ? err : 1, __ATOMIC_RELEASE);
+	if (write(job->thread->wakeup[1], &c, 1) != 1)
+		logit(LOG_WARNING, "startup wakeup failed\n");
+	return NULL;
+}
+
+/*
+ * Initialize and start the loops in parallel. All loops using
+ * shared devices are started by one job, because they modify
+ * the common share state.
+ */
+static int startup(struct loopback_thread *thread,
+		   struct loopback **loops, int count)
+{
+	struct startup_job *job, *sjob = NULL;
+	struct loopback *loop;
+	sigset_t mask, omask;
+	int i, err;
+
+	thread->jobs = calloc(count, sizeof(*thread->jobs));
+	if (thread->jobs == NULL)
+		return -ENOMEM;
+	for (i = 0; i < count; i++) {
+		loop = loops[i];
+		loop->startup_state = 0;
+		loop->startup_polled = 0;
+		if (loop->play->share || loop->capt->share) {
+			if (sjob == NULL) {
+				sjob = &thread->jobs[thread->jobs_count++];
+				sjob->thread = thread;
+			}
+			job = sjob;
+		} else {
+			job = &thread->jobs[thread->jobs_count++];
+			job->thread = thread;
+		}
+		if (job->loopbacks == NULL) {
+			job->loopbacks = malloc(count * sizeof(struct loopback *));
+			if (job->loopbacks == NULL)
+				return -ENOMEM;
+		}
+		job->loopbacks[job->loopbacks_count++] = loop;
+	}
+	thread->pending += count;
+	/* the signals are handled by the loop threads */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	for (i = 0, err = 0; i < thread->jobs_count; i++) {
+		job = &thread->jobs[i];
+		err = pthread_create(&job->id, NULL, startup_job1, job);
+		if (err) {
+			job->id = 0;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	return -err;
+}
+
+static void startup_join(struct loopback_thread *thread)
+{
+	int i;
+
+	for (i = 0; i < thread->jobs_count; i++) {
+		if (thread->jobs[i].id)
+			pthread_join(thread->jobs[i].id, NULL);
+		free(thread->jobs[i].loopbacks);
+	}
+	free(thread->jobs);
+	thread->jobs = NULL;
+	thread->jobs_count = 0;
+}
+
+/*
+ * Pick up the loops which are ready, the poll set is extended.
+ * Returns the count of newly ready loops.
+ */
+static int startup_check(struct loopback_thread *thread)
+{
+	snd_output_t *output = thread->output;
+	struct loopback *loop;
+	int i, state, ready = 0;
+
 	for (i = 0; i < thread->loopbacks_count; i++) {
-		err = pcmjob_start(thread->loopbacks[i]);
+		loop = thread->loopbacks[i];
+		state = __atomic_load_n(&loop->startup_state, __ATOMIC_ACQUIRE);
+		if (state == 0 || loop->startup_polled)
+			continue;
+		if (state < 0 && !thread->started)
+			my_exit(thread, EXIT_FAILURE);
+		if (state < 0) {
+			/* added by reload, the other loops keep running */
+			logit(LOG_WARNING, "Loop '%s' not started, disabled\n", loop->config_line);
+			pcmjob_done(loop);
+			loop->startup_state = 0;
+			thread->pending--;
+			continue;
+		}
+		loop->startup_polled = 1;
+		thread->pending--;
+		ready++;
+		if (verbose)
+			snd_output_printf(output, "%s: startup: init %.3fms, start %.3fms, ready after %.3fms\n", loop->id, loop->startup_init, loop->startup_start, loop->startup_ready);
+	}
+	if (thread->pending == 0) {
+		startup_join(thread);
+		thread->started = 1;
+	}
+	return ready;
+}
+
+/*
+ * Apply the changes queued by the configuration reload, called
+ * when no startup is in progress. Returns the count of the removed
+ * and added loops.
+ */
+static int reload_check(struct loopback_thread *thread)
+{
+	struct loopback **add, **remove, **loops;
+	int add_count, remove_count, i, j, err;
+
+	pthread_mutex_lock(&thread->lock);
+	add = thread->add;
+	add_count = thread->add_count;
+	remove = thread->remove;
+	remove_count = thread->remove_count;
+	thread->add = thread->remove = NULL;
+	thread->add_count = thread->remove_count = 0;
+	pthread_mutex_unlock(&thread->lock);
+	for (i = 0; i < remove_count; i++) {
+		for (j = 0; j < thread->loopbacks_count; j++)
+			if (thread->loopbacks[j] == remove[i])
+				break;
+		if (j < thread->loopbacks_count) {
+			memmove(&thread->loopbacks[j], &thread->loopbacks[j + 1],
+				(thread->loopbacks_count - j - 1) *
+						sizeof(struct loopback *));
+			thread->loopbacks_count--;
+		}
+		if (verbose)
+			snd_output_printf(thread->output, "Loop '%s' removed\n", remove[i]->config_line);
+		pcmjob_done(remove[i]);
+		free_loopback(remove[i]);
+	}
+	if (add_count > 0) {
+		loops = realloc(thread->loopbacks,
+				(thread->loopbacks_count + add_count) *
+						sizeof(struct loopback *));
+		if (loops == NULL) {
+			logit(LOG_CRIT, "No enough memory\n");
+			my_exit(thread, EXIT_FAILURE);
+		}
+		memcpy(loops + thread->loopbacks_count, add,
+		       add_count * sizeof(struct loopback *));
+		thread->loopbacks = loops;
+		thread->loopbacks_count += add_count;
+		err = startup(thread, add, add_count);
 		if (err < 0) {
-			logit(LOG_CRIT, "Loopback start failure.\n");
+			logit(LOG_CRIT, "Unable to start loopbacks: %s\n", strerror(-err));
 			my_exit(thread, EXIT_FAILURE);
 		}
-		pfds_count += thread->loopbacks[i]->pollfd_count;
-		j = thread->loopbacks[i]->wake;
-		if (j > 0 && j < wake)
-			wake = j;
 	}
-	if (wake >= 1000000)
-		wake = -1;
+	free(add);
+	free(remove);
+	return add_count + remove_count;
+}
+
+static void thread_job1(void *_data)
+{
+	struct loopback_thread *thread = _data;
+	snd_output_t *output = thread->output;
+	struct pollfd *pfds = NULL;
+	int pfds_count = 0;
+	int i, j, err, wake, woken, changed;
+	char buf[32];
+
+	setscheduler();
+
+	err = startup(thread, thread->loopbacks, thread->loopbacks_count);
+	if (err < 0) {
+		logit(LOG_CRIT, "Unable to start loopbacks: %s\n", strerror(-err));
+		my_exit(thread, EXIT_FAILURE);
+	}
+	wake = -1;
+	pfds_count = 1;
 	pfds = calloc(pfds_count, sizeof(struct pollfd));
-	if (pfds == NULL || pfds_count <= 0) {
+	if (pfds == NULL) {
 		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
 		my_exit(thread, EXIT_FAILURE);
 	}
+	woken = 0;
 	while (!quit) {
 		struct timeval tv1, tv2;
+		if (woken) {
+			woken = 0;
+			while (read(thread->wakeup[0], buf, sizeof(buf)) > 0)
+				;
+			changed = 0;
+			if (thread->pending > 0)
+				changed += startup_check(thread);
+			if (thread->pending == 0)
+				changed += reload_check(thread);
+		} else {
+			changed = 0;
+		}
+		if (changed > 0) {
+			pfds_count = 1;		/* the wakeup pipe */
+			wake = 1000000;
+			for (i = 0; i < thread->loopbacks_count; i++) {
+				struct loopback *loop = thread->loopbacks[i];
+				if (!loop->startup_polled)
+					continue;
+				pfds_count += loop->pollfd_count;
+				if (loop->wake > 0 && loop->wake < wake)
+					wake = loop->wake;
+			}
+			if (wake >= 1000000)
+				wake = -1;
+			free(pfds);
+			pfds = calloc(pfds_count, sizeof(struct pollfd));
+			if (pfds == NULL) {
+				logit(LOG_CRIT, "Poll FDs allocation failed.\n");
+				my_exit(thread, EXIT_FAILURE);
+			}
+		}
 		for (i = j = 0; i < thread->loopbacks_count; i++) {
+			if (!thread->loopbacks[i]->startup_polled)
+				continue;
 			err = pcmjob_pollfds_init(thread->loopbacks[i], &pfds[j]);
 			if (err < 0) {
 				logit(LOG_CRIT, "Poll FD initialization failed.\n");
@@ -750,9 +1292,12 @@ static void thread_job1(void *_data)
 			}
 			j += err;
 		}
+		pfds[j].fd = thread->wakeup[0];
+		pfds[j].events = POLLIN;
+		pfds[j].revents = 0;
 		if (verbose > 10)
 			gettimeofday(&tv1, NULL);
-		err = poll(pfds, j, wake);
+		err = poll(pfds, j + 1, wake);
 		if (err < 0)
 			err = -errno;
 		if (verbose > 10) {
@@ -765,9 +1310,13 @@ static void thread_job1(void *_data)
 			logit(LOG_CRIT, "Poll failed: %s\n", strerror(-err));
 			my_exit(thread, EXIT_FAILURE);
 		}
+		if (pfds[j].revents & POLLIN)
+			woken = 1;
 		for (i = j = 0; i < thread->loopbacks_count; i++) {
 			struct loopback *loop = thread->loopbacks[i];
-			if (j < loop->active_pollfd_count) {
+			if (!loop->startup_polled)
+				continue;
+			if (loop->active_pollfd_count > 0) {
 				err = pcmjob_pollfds_handle(loop, &pfds[j]);
 				if (err < 0) {
 					logit(LOG_CRIT, "pcmjob failed.\n");
@@ -798,7 +1347,8 @@ static void send_to_all(int sig)
 
 	for (i = 0; i < threads_count; i++) {
 		thread = &threads[i];
-		if (thread->threaded)
+		if (thread->threaded && !thread->start_pending &&
+		    !__atomic_load_n(&thread->finished, __ATOMIC_ACQUIRE))
 			pthread_kill(thread->thread, sig);
 	}
 }
@@ -807,6 +1357,8 @@ static void signal_handler(int sig)
 {
 	quit = 1;
 	send_to_all(SIGUSR2);
+	if (!pthread_equal(main_job, pthread_self()))
+		pthread_kill(main_job, SIGUSR2);
 }
 
 static void signal_handler_state(int sig)
@@ -821,7 +1373,8 @@ static void signal_handler_state(int sig)
 		thread = &threads[i];
 		if (thread->thread == self) {
 			for (j = 0; j < thread->loopbacks_count; j++)
-				pcmjob_state(thread->loopbacks[j]);
+				if (thread->loopbacks[j]->startup_polled)
+					pcmjob_state(thread->loopbacks[j]);
 		}
 	}
 	signal(sig, signal_handler_state);
@@ -832,6 +1385,280 @@ static void signal_handler_ignore(int sig)
 	signal(sig, signal_handler_ignore);
 }
 
+/* the configuration is reloaded by the main thread */
+static void signal_handler_reload(int sig)
+{
+	reload_pending = 1;
+	if (!pthread_equal(main_job, pthread_self()))
+		pthread_kill(main_job, sig);
+	signal(sig, signal_handler_reload);
+}
+
+static int thread_init(struct loopback_thread *thread, snd_output_t *output,
+		       int id)
+{
+	thread->output = output;
+	thread->id = id;
+	thread->threaded = 1;
+	pthread_mutex_init(&thread->lock, NULL);
+	if (pipe(thread->wakeup) < 0)
+		return -errno;
+	fcntl(thread->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(thread->wakeup[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+static int reload_queue(struct loopback_thread *thread,
+			struct loopback *loop, int add)
+{
+	struct loopback ***list = add ? &thread->add : &thread->remove;
+	int *count = add ? &thread->add_count : &thread->remove_count;
+	struct loopback **loops;
+	char c = 0;
+
+	pthread_mutex_lock(&thread->lock);
+	loops = realloc(*list, (*count + 1) * sizeof(struct loopback *));
+	if (loops == NULL) {
+		pthread_mutex_unlock(&thread->lock);
+		return -ENOMEM;
+	}
+	loops[(*count)++] = loop;
+	*list = loops;
+	pthread_mutex_unlock(&thread->lock);
+	if (write(thread->wakeup[1], &c, 1) != 1)
+		logit(LOG_WARNING, "reload wakeup failed\n");
+	return 0;
+}
+
+static int thread_finished(struct loopback_thread *thread)
+{
+	return __atomic_load_n(&thread->finished, __ATOMIC_ACQUIRE);
+}
+
+/* release the slot of a finished thread, the loops are already done */
+static int thread_reuse(struct loopback_thread *thread, snd_output_t *output,
+			int id)
+{
+	int i;
+
+	pthread_join(thread->thread, NULL);
+	if (thread->exitcode != EXIT_SUCCESS)
+		threads_failed = thread->exitcode;
+	close(thread->wakeup[0]);
+	close(thread->wakeup[1]);
+	pthread_mutex_destroy(&thread->lock);
+	for (i = 0; i < thread->remove_count; i++) {
+		pcmjob_done(thread->remove[i]);
+		free_loopback(thread->remove[i]);
+	}
+	free(thread->remove);
+	free(thread->add);
+	free(thread->loopbacks);
+	memset(thread, 0, sizeof(*thread));
+	thread->start_pending = 1;
+	return thread_init(thread, output, id);
+}
+
+/*
+ * The thread with the same number, an unused thread slot (idle or
+ * finished) or a new thread. The loops already assigned by this
+ * reload are in loops.
+ */
+static struct loopback_thread *reload_thread(struct loopback *loop,
+					     snd_output_t *output,
+					     struct loopback **loops,
+					     int loops_count,
+					     int *new_threads)
+{
+	struct loopback_thread *thread;
+	int i, j;
+
+	if (loop->thread_req < THREAD_UNIQUE) {
+		for (i = 0; i < threads_count + *new_threads; i++)
+			if (threads[i].id == loop->thread_req &&
+			    !thread_finished(&threads[i]))
+				return &threads[i];
+	}
+	for (i = 0; i < threads_count; i++) {
+		thread = &threads[i];
+		if (thread->start_pending)
+			continue;
+		for (j = 0; j < loops_count; j++)
+			if (loops[j]->thread == i)
+				break;
+		if (j < loops_count)
+			continue;
+		if (!thread_finished(thread)) {
+			/* all loops were removed, the thread is idle */
+			thread->id = loop->thread_req;
+			return thread;
+		}
+		if (thread_reuse(thread, output, loop->thread_req) < 0)
+			return NULL;
+		return thread;
+	}
+	if (threads_count + *new_threads >= threads_alloc) {
+		logit(LOG_ERR, "Loop '%s' refused, all %i threads are used\n", loop->config_line, threads_alloc);
+		return NULL;
+	}
+	thread = &threads[threads_count + *new_threads];
+	thread->start_pending = 1;
+	if (thread_init(thread, output, loop->thread_req) < 0)
+		return NULL;
+	(*new_threads)++;
+	return thread;
+}
+
+static int reload_add(struct loopback_thread *thread, struct loopback *loop)
+{
+	struct loopback **loops;
+
+	loop->thread = thread - threads;
+	if (!thread->start_pending)
+		return reload_queue(thread, loop, 1);
+	/* not running yet */
+	loops = realloc(thread->loopbacks, (thread->loopbacks_count + 1) *
+						sizeof(struct loopback *));
+	if (loops == NULL)
+		return -ENOMEM;
+	loops[thread->loopbacks_count++] = loop;
+	thread->loopbacks = loops;
+	return 0;
+}
+
+/*
+ * Re-read the configuration file. The loops are identified by their
+ * configuration line, the unchanged loops keep running, the loops
+ * with a changed line are replaced. The loops with shared devices
+ * are not changed.
+ */
+static void reload(snd_output_t *output)
+{
+	struct loopback **old = loopbacks, **new, **loops;
+	struct loopback_share *old_shares = shares, *new_shares;
+	struct loopback_thread *thread;
+	struct loopback *loop;
+	sigset_t mask;
+	int old_count = loopbacks_count, new_count, count = 0;
+	int kept = 0, removed = 0, added = 0, new_threads = 0;
+	int i, j, err;
+
+	loopbacks = NULL;
+	loopbacks_count = 0;
+	shares = NULL;
+	err = parse_config_file(config_file, output);
+	while (my_argc > 0)
+		free(my_argv[--my_argc]);
+	free(my_argv);
+	my_argv = NULL;
+	new = loopbacks;
+	new_count = loopbacks_count;
+	new_shares = shares;
+	loopbacks = old;
+	loopbacks_count = old_count;
+	shares = old_shares;
+	if (err < 0) {
+		logit(LOG_WARNING, "Unable to reload '%s', the configuration is not changed\n", config_file);
+		goto __free;
+	}
+	loops = malloc((old_count + new_count + 1) * sizeof(struct loopback *));
+	if (loops == NULL) {
+		logit(LOG_WARNING, "No enough memory for reload\n");
+		goto __free;
+	}
+	for (i = 0; i < old_count; i++) {
+		loop = old[i];
+		if (thread_finished(&threads[loop->thread]) &&
+		    !loop->play->share && !loop->capt->share) {
+			/* stopped with its thread, added again when listed */
+			if (verbose)
+				snd_output_printf(output, "Loop '%s' stopped, released\n", loop->config_line);
+			free_loopback(loop);
+			continue;
+		}
+		for (j = 0; j < new_count; j++) {
+			if (new[j] && loop->config_line && new[j]->config_line &&
+			    strcmp(loop->config_line, new[j]->config_line) == 0)
+				break;
+		}
+		if (j < new_count) {
+			free_loopback(new[j]);
+			new[j] = NULL;
+		} else if (loop->play->share || loop->capt->share) {
+			logit(LOG_WARNING, "Loop '%s' uses a shared device, not removed\n", loop->config_line);
+		} else if (reload_queue(&threads[loop->thread], loop, 0) == 0) {
+			removed++;
+			continue;
+		}
+		loops[count++] = loop;
+		kept++;
+	}
+	for (j = 0; j < new_count; j++) {
+		loop = new[j];
+		if (loop == NULL)
+			continue;
+		new[j] = NULL;
+		if (loop->play->share || loop->capt->share) {
+			logit(LOG_WARNING, "Loop '%s' uses a shared device, not added\n", loop->config_line);
+			free_loopback(loop);
+			continue;
+		}
+		thread = reload_thread(loop, output, loops, count, &new_threads);
+		if (thread == NULL || reload_add(thread, loop) < 0) {
+			logit(LOG_WARNING, "Unable to add loop '%s'\n", loop->config_line);
+			free_loopback(loop);
+			continue;
+		}
+		loops[count++] = loop;
+		added++;
+	}
+	free(old);
+	loopbacks = loops;
+	loopbacks_count = count;
+	for (i = 0; i < threads_count + new_threads; i++) {
+		thread = &threads[i];
+		if (!thread->start_pending)
+			continue;
+		__atomic_add_fetch(&threads_running, 1, __ATOMIC_RELEASE);
+		/* the new threads get the signal mask of the initial ones */
+		pthread_sigmask(SIG_SETMASK, &main_sigmask, &mask);
+		thread_job(thread);
+		pthread_sigmask(SIG_SETMASK, &mask, NULL);
+		thread->start_pending = 0;
+		if (quit)
+			pthread_kill(thread->thread, SIGUSR2);
+	}
+	threads_count += new_threads;
+	if (verbose)
+		snd_output_printf(output, "Configuration reloaded: %i kept, %i removed, %i added\n", kept, removed, added);
+      __free:
+	for (j = 0; j < new_count; j++)
+		if (new[j])
+			free_loopback(new[j]);
+	free(new);
+	free_shares(new_shares);
+}
+
+/* wait for the reload requests until all threads are finished */
+static void reload_wait(snd_output_t *output)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &mask, &main_sigmask);
+	while (!quit && __atomic_load_n(&threads_running, __ATOMIC_ACQUIRE) > 0) {
+		if (!reload_pending)
+			sigsuspend(&main_sigmask);
+		if (reload_pending) {
+			reload_pending = 0;
+			reload(output);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &main_sigmask, NULL);
+}
+
 int main(int argc, char *argv[])
 {
 	snd_output_t *output;
@@ -856,6 +1683,11 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (sim_enabled()) {
+		err = sim_run(loopbacks, loopbacks_count, output);
+		exit(err < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
 	if (daemonize) {
 		if (daemon(0, 0) < 0) {
 			logit(LOG_CRIT, "daemon() failed: %s\n", strerror(errno));
@@ -872,6 +1704,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	fix_share_threads();
+
 	/* we must sort thread IDs */
 	j = -1;
 	do {
@@ -893,7 +1727,9 @@ int main(int argc, char *argv[])
 			j = loopbacks[i]->thread;
 	}
 	j += 1;
-	threads = calloc(1, sizeof(struct loopback_thread) * j);
+	/* room for the threads added by the configuration reload */
+	threads_alloc = config_file ? j + RELOAD_THREADS : j;
+	threads = calloc(threads_alloc, sizeof(struct loopback_thread));
 	if (threads == NULL) {
 		logit(LOG_CRIT, "No enough memory\n");
 		exit(EXIT_FAILURE);
@@ -905,30 +1741,43 @@ int main(int argc, char *argv[])
 				l++;
 		threads[k].loopbacks = malloc(l * sizeof(struct loopback *));
 		threads[k].loopbacks_count = l;
-		threads[k].output = output;
-		threads[k].threaded = j > 1;
 		for (i = l = 0; i < loopbacks_count; i++)
 			if (loopbacks[i]->thread == k)
 				threads[k].loopbacks[l++] = loopbacks[i];
+		if (thread_init(&threads[k], output, l > 0 ? threads[k].loopbacks[0]->thread_req : -1) < 0) {
+			logit(LOG_CRIT, "Thread initialization failed\n");
+			exit(EXIT_FAILURE);
+		}
+		/* the main thread waits for the reload requests */
+		threads[k].threaded = j > 1 || config_file;
 	}
 	threads_count = j;
+	threads_running = j;
 	main_job = pthread_self();
+	startup_time = startup_clock();
  
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGABRT, signal_handler);
 	signal(SIGUSR1, signal_handler_state);
 	signal(SIGUSR2, signal_handler_ignore);
+	if (config_file)
+		signal(SIGHUP, signal_handler_reload);
 
 	for (k = 0; k < threads_count; k++)
 		thread_job(&threads[k]);
 
-	if (j > 1) {
-		for (k = 0; k < threads_count; k++)
+	if (config_file)
+		reload_wait(output);
+	if (threads[0].threaded) {
+		for (k = 0; k < threads_count; k++) {
 			pthread_join(threads[k].thread, NULL);
+			if (threads[k].exitcode != EXIT_SUCCESS)
+				threads_failed = threads[k].exitcode;
+		}
 	}
 
 	if (use_syslog)
 		closelog();
-	exit(EXIT_SUCCESS);
+	exit(threads_failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
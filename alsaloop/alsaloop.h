@@ -34,6 +34,10 @@ enum {
 
 #define MAX_ARGS	128
 #define MAX_MIXERS	64
+#define MAX_EFFECTS	16
+#define MAX_PARAMS_CACHE 8
+#define CONTROL_HASH_SIZE 64
+#define CONTROL_COALESCE 10		/* value events window in ms */
 
 #if 0
 #define FILE_PWRITE "/tmp/alsaloop.praw"
@@ -41,6 +45,11 @@ enum {
 #endif
 
 #define WORKAROUND_SERIALOPEN	(1<<0)
+#define WORKAROUND_NOTSTAMP	(1<<1)
+
+#if SND_LIB_VERSION >= 0x01001d
+#define USE_AUDIO_TSTAMP	/* audio timestamp types (alsa-lib 1.0.29) */
+#endif
 
 typedef enum _sync_type {
 	SYNC_TYPE_NONE = 0,
@@ -60,6 +69,66 @@ typedef enum _slave_type {
 	SLAVE_TYPE_LAST = SLAVE_TYPE_OFF
 } slave_type_t;
 
+#define PLL_DEFAULT_DAMPING	0.707
+#define PLL_DEFAULT_LIMIT	0.02	/* max. correction (2%) */
+
+struct loopback_pll {
+	double bandwidth;		/* loop bandwidth in Hz, 0 = disabled */
+	double damping;			/* damping factor */
+	double limit;			/* maximal pitch deviation */
+	double kp, ki;			/* PI coefficients */
+	double tau;			/* measurement pre-filter time constant */
+	double integral;
+	double error;			/* filtered latency error (seconds) */
+	double last_time;		/* time of last measurement (seconds) */
+	double pitch;
+	unsigned int valid:1;
+};
+
+typedef enum _effect_type {
+	EFFECT_GAIN = 0,
+	EFFECT_BIQUAD,
+	EFFECT_LIMITER,
+	EFFECT_MIX
+} effect_type_t;
+
+typedef enum _biquad_type {
+	BIQUAD_LOWPASS = 0,
+	BIQUAD_HIGHPASS,
+	BIQUAD_BANDPASS,
+	BIQUAD_NOTCH,
+	BIQUAD_PEAK,
+	BIQUAD_LOWSHELF,
+	BIQUAD_HIGHSHELF,
+	BIQUAD_LAST
+} biquad_type_t;
+
+struct effect_coefs {
+	float gain;			/* gain or limiter threshold */
+	float release;			/* limiter release coefficient */
+	float b0, b1, b2, a1, a2;	/* biquad */
+};
+
+struct loopback_effect {
+	effect_type_t type;
+	char *spec;
+	/* parameters */
+	biquad_type_t biquad;
+	double gain;			/* in dB */
+	double freq;			/* in Hz */
+	double q;
+	double release;			/* in ms */
+	float *mix_matrix;		/* mix_channels x mix_channels */
+	unsigned int mix_channels;
+	/* runtime */
+	unsigned int rate;
+	unsigned int channels;
+	struct effect_coefs coefs;
+	float *state;			/* per channel state */
+	float env;			/* limiter envelope */
+	struct loopback_effect *next;
+};
+
 struct loopback_control {
 	snd_ctl_elem_id_t *id;
 	snd_ctl_elem_info_t *info;
@@ -68,9 +137,12 @@ struct loopback_control {
 
 struct loopback_mixer {
 	unsigned int skip:1;
+	unsigned int pending:2;		/* 1 = src changed, 2 = dst changed */
 	struct loopback_control src;
 	struct loopback_control dst;
 	struct loopback_mixer *next;
+	struct loopback_mixer *hash_next[2];	/* src, dst id chains */
+	struct loopback_mixer *pending_next;
 };
 
 struct loopback_ossmixer {
@@ -81,8 +153,55 @@ struct loopback_ossmixer {
 	struct loopback_ossmixer *next;
 };
 
+/*
+ * One PCM shared by several loops: a capture PCM feeding several
+ * playback legs (each leg reads the common ring with its own cursor)
+ * or a playback PCM where the legs are mixed (each leg adds its samples
+ * into the common ring at its own cursor).
+ */
+struct loopback_share {
+	char *name;
+	unsigned int capture:1;		/* shared capture (fan-out) */
+	unsigned int configured:1;	/* hw params are set */
+	unsigned int start_pending:1;	/* playback must be started */
+	struct loopback_handle **handles;
+	int handles_count;
+	int opened;			/* open count */
+	int running;			/* count of running legs */
+	struct loopback_handle *owner;	/* leg doing the PCM I/O */
+	snd_pcm_t *handle;
+	int card_number;
+	/* ring buffer */
+	char *buf;
+	snd_pcm_uframes_t buf_pos;	/* capture: write, playback: read */
+	snd_pcm_uframes_t buf_size;
+	struct loopback_share *next;
+};
+
+/* negotiated hw/sw parameters for one stream configuration */
+struct loopback_params {
+	/* key */
+	snd_pcm_access_t access;
+	snd_pcm_format_t format;
+	unsigned int rate_req;
+	unsigned int channels;
+	snd_pcm_uframes_t bufsize;
+	/* result */
+	snd_pcm_hw_params_t *hw_params;
+	snd_pcm_sw_params_t *sw_params;
+	unsigned int rate;
+	unsigned int buffer_size;
+	unsigned int period_size;
+	snd_pcm_uframes_t avail_min;
+	unsigned long hits;
+};
+
 struct loopback_handle {
 	struct loopback *loopback;
+	struct loopback_share *share;	/* PCM shared with other loops */
+	unsigned int share_running:1;
+	unsigned int share_skipped:1;	/* playback: not mixed, stalled */
+	snd_pcm_uframes_t share_pending;	/* capture: frames not yet processed */
 	char *device;
 	char *ctldev;
 	char *id;
@@ -109,11 +228,23 @@ struct loopback_handle {
 	snd_pcm_uframes_t buf_count;	/* filled samples */
 	snd_pcm_uframes_t buf_size;	/* buffer size in frames */
 	snd_pcm_uframes_t buf_over;	/* capture buffer overflow */
+	char *pool;			/* buf storage, kept over restarts */
+	size_t pool_size;		/* in bytes */
+	/* parameters seen so far */
+	struct loopback_params params_cache[MAX_PARAMS_CACHE];
+	int params_count;
+	int params_next;		/* next entry to replace */
+	unsigned int params_cached:1;	/* last setup used the cache */
 	/* statistics */
 	snd_pcm_uframes_t max;
 	unsigned long long counter;
 	unsigned long sync_point;	/* in samples */
 	snd_pcm_sframes_t last_delay;
+	/* status timestamps */
+	unsigned int audio_tstamp:1;	/* link audio timestamps reported */
+	double tstamp_last;		/* system time of last pair (seconds) */
+	double atstamp_last;		/* audio time of last pair (seconds) */
+	double tstamp_ratio;		/* audio / system clock ratio */
 	double pitch;
 	snd_pcm_uframes_t total_queued;
 	/* control */
@@ -144,10 +275,15 @@ struct loopback {
 	unsigned int reinit:1;
 	unsigned int running:1;
 	unsigned int stop_pending:1;
+	unsigned int split:1;		/* capture runs on own thread */
+	unsigned int direct:1;		/* mmap copy without buffer */
+	double direct_drift;		/* frames to drop (>0) or repeat (<0) */
 	snd_pcm_uframes_t stop_count;
 	sync_type_t sync;		/* type of sync */
 	slave_type_t slave;
 	int thread;			/* thread number */
+	int thread_req;			/* thread number from the config */
+	char *config_line;		/* arguments, identifies the loop on reload */
 	unsigned int wake;
 	/* statistics */
 	double pitch;
@@ -156,8 +292,25 @@ struct loopback {
 	snd_pcm_sframes_t pitch_diff_min;
 	snd_pcm_sframes_t pitch_diff_max;
 	unsigned int total_queued_count;
+	double queued_skew;		/* max. status instant spread (us) */
+	unsigned long queued_fallbacks;	/* measured without timestamps */
+	struct loopback_pll pll;	/* PI drift compensation */
+	struct loopback_ring *ring;	/* capture -> playback (split mode) */
 	snd_timestamp_t tstamp_start;
 	snd_timestamp_t tstamp_end;
+	/* startup */
+	int startup_state;		/* 0 = pending, 1 = ready, <0 = error */
+	int startup_polled;		/* serviced by the poll thread */
+	int released;			/* pcmjob_done() was called */
+	double startup_init;		/* pcmjob_init() time (ms) */
+	double startup_start;		/* pcmjob_start() time (ms) */
+	double startup_ready;		/* since the process start (ms) */
+	/* restart to first frame timing */
+	unsigned int restart_pending:1;
+	double restart_time;		/* restart request (seconds) */
+	long restart_last;		/* in us */
+	long restart_max;		/* in us */
+	unsigned int restarts;
 	/* xrun profiling */
 	unsigned int xrun:1;		/* xrun profiling */
 	snd_timestamp_t xrun_last_update;
@@ -174,13 +327,24 @@ struct loopback {
 	double xrun_max_missing;
 	/* control mixer */
 	struct loopback_mixer *controls;
+	struct loopback_mixer *controls_hash[2][CONTROL_HASH_SIZE];
+	struct loopback_mixer *controls_pending;
+	double controls_pending_time;	/* first pending event (seconds) */
+	unsigned long control_events;	/* value events received */
+	unsigned long control_writes;	/* values written */
 	struct loopback_ossmixer *oss_controls;
+	/* effect chain */
+	struct loopback_effect *effects;
+	float *effect_buf;
 	/* sample rate */
 	unsigned int use_samplerate:1;
 #ifdef USE_SAMPLERATE
 	unsigned int src_enable:1;
 	int src_converter_type;
 	SRC_STATE *src_state;
+	unsigned int src_channels;	/* src_state is created for */
+	size_t src_in_size;		/* data_in allocation in bytes */
+	size_t src_out_size;		/* data_out allocation in bytes */
 	SRC_DATA src_data;
 	unsigned int src_out_frames;
 #endif
@@ -211,8 +375,34 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds);
 int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds);
 void pcmjob_state(struct loopback *loop);
 
+void pll_init(struct loopback_pll *pll);
+void pll_reset(struct loopback_pll *pll);
+double pll_update(struct loopback_pll *pll, double error, double now);
+double pll_simulate(struct loopback_pll *cfg, snd_output_t *output,
+		    unsigned int rate, double ppm, double jitter,
+		    double period, double duration);
+
+int sim_parse(const char *arg);
+int sim_enabled(void);
+int sim_time(double *now);
+int sim_rate_shift(struct loopback_handle *lhandle, double pitch);
+int sim_open(snd_pcm_t **pcm, struct loopback_handle *lhandle,
+	     snd_pcm_stream_t stream);
+int sim_run(struct loopback **loops, int count, snd_output_t *output);
+
+int effect_parse(struct loopback_effect **effect, const char *spec);
+int effect_init(struct loopback_effect *effect, unsigned int rate,
+		unsigned int channels);
+void effect_done(struct loopback_effect *effect);
+void effect_free(struct loopback_effect *effect);
+int effects_init(struct loopback *loop);
+void effects_done(struct loopback *loop);
+void effects_apply(struct loopback *loop, snd_pcm_uframes_t pos,
+		   snd_pcm_uframes_t count);
+
 int control_parse_id(const char *str, snd_ctl_elem_id_t *id);
 int control_id_match(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2);
 int control_init(struct loopback *loop);
 int control_done(struct loopback *loop);
 int control_event(struct loopback_handle *lhandle, snd_ctl_event_t *ev);
+int control_flush(struct loopback *loop, int force);
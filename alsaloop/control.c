@@ -23,6 +23,7 @@
 
 #include <ctype.h>
 #include <syslog.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 #include "alsaloop.h"
 
@@ -157,6 +158,41 @@ int control_id_match(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2)
 	return 1;
 }
 
+static unsigned int id_hash(snd_ctl_elem_id_t *id)
+{
+	const unsigned char *name = (const unsigned char *)snd_ctl_elem_id_get_name(id);
+	unsigned int h = 2166136261U;	/* FNV-1a */
+
+	while (*name)
+		h = (h ^ *name++) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_interface(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_device(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_subdevice(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_index(id)) * 16777619U;
+	return h % CONTROL_HASH_SIZE;
+}
+
+static void control_hash_add(struct loopback *loop,
+			     struct loopback_mixer *mix)
+{
+	unsigned int h;
+
+	h = id_hash(mix->src.id);
+	mix->hash_next[0] = loop->controls_hash[0][h];
+	loop->controls_hash[0][h] = mix;
+	h = id_hash(mix->dst.id);
+	mix->hash_next[1] = loop->controls_hash[1][h];
+	loop->controls_hash[1][h] = mix;
+}
+
+static double control_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
 static int control_init1(struct loopback_handle *lhandle,
 			 struct loopback_control *ctl)
 {
@@ -209,6 +245,34 @@ static int copy_value(struct loopback_control *dst,
 	return 0;
 }
 
+static int equal_value(struct loopback_control *dst,
+		       struct loopback_control *src)
+{
+	snd_ctl_elem_type_t type;
+	unsigned int count;
+	int i;
+
+	type = snd_ctl_elem_info_get_type(dst->info);
+	count = snd_ctl_elem_info_get_count(dst->info);
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		for (i = 0; i < count; i++)
+			if (snd_ctl_elem_value_get_boolean(dst->value, i) !=
+			    snd_ctl_elem_value_get_boolean(src->value, i))
+				return 0;
+		break;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		for (i = 0; i < count; i++)
+			if (snd_ctl_elem_value_get_integer(dst->value, i) !=
+			    snd_ctl_elem_value_get_integer(src->value, i))
+				return 0;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
 static int oss_set(struct loopback *loop,
 		   struct loopback_ossmixer *ossmix,
 		   int enable)
@@ -327,6 +391,7 @@ int control_init(struct loopback *loop)
 		err = control_init2(loop, mix);
 		if (err < 0)
 			return err;
+		control_hash_add(loop, mix);
 	}
 	for (ossmix = loop->oss_controls; ossmix; ossmix = ossmix->next) {
 		err = oss_set(loop, ossmix, 1);
@@ -344,6 +409,12 @@ int control_done(struct loopback *loop)
 	struct loopback_ossmixer *ossmix;
 	int err;
 
+	loop->controls_pending = NULL;
+	memset(loop->controls_hash, 0, sizeof(loop->controls_hash));
+	for (mix = loop->controls; mix; mix = mix->next)
+		mix->pending = 0;
+	if (verbose > 1 && loop->controls)
+		snd_output_printf(loop->output, "%s: control events %lu, writes %lu\n", loop->id, loop->control_events, loop->control_writes);
 	if (loop->capt->ctl == NULL)
 		return 0;
 	for (ossmix = loop->oss_controls; ossmix; ossmix = ossmix->next) {
@@ -361,18 +432,13 @@ int control_done(struct loopback *loop)
 	return 0;
 }
 
-static int control_event1(struct loopback *loop,
-			  struct loopback_mixer *mix,
-			  snd_ctl_event_t *ev,
-			  int capture)
+/* propagate the current value, the unchanged values are not written */
+static int control_sync(struct loopback *loop,
+			struct loopback_mixer *mix,
+			int capture)
 {
-	unsigned int mask = snd_ctl_event_elem_get_mask(ev);
 	int err;
 
-	if (mask == SND_CTL_EVENT_MASK_REMOVE)
-		return 0;
-	if ((mask & SND_CTL_EVENT_MASK_VALUE) == 0)
-		return 0;
 	if (!capture) {
 		snd_ctl_elem_value_set_id(mix->src.value, mix->src.id);
 		err = snd_ctl_elem_read(loop->play->ctl, mix->src.value);
@@ -380,7 +446,10 @@ static int control_event1(struct loopback *loop,
 			logit(LOG_CRIT, "Unable to read control value (event1) '%s': %s\n", id_str(mix->src.id), snd_strerror(err));
 			return err;
 		}
+		if (equal_value(&mix->dst, &mix->src))
+			return 0;
 		copy_value(&mix->dst, &mix->src);
+		loop->control_writes++;
 		err = snd_ctl_elem_write(loop->capt->ctl, mix->dst.value);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to write control value (event1) '%s': %s\n", id_str(mix->dst.id), snd_strerror(err));
@@ -392,7 +461,10 @@ static int control_event1(struct loopback *loop,
 			logit(LOG_CRIT, "Unable to read control value (event2) '%s': %s\n", id_str(mix->dst.id), snd_strerror(err));
 			return err;
 		}
+		if (equal_value(&mix->src, &mix->dst))
+			return 0;
 		copy_value(&mix->src, &mix->dst);
+		loop->control_writes++;
 		err = snd_ctl_elem_write(loop->play->ctl, mix->src.value);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to write control value (event2) '%s': %s\n", id_str(mix->src.id), snd_strerror(err));
@@ -402,23 +474,60 @@ static int control_event1(struct loopback *loop,
 	return 0;
 }
 
+/*
+ * The value events are only recorded here. The values are read and
+ * written in control_flush(), so a burst of events for one control
+ * (a dragged slider) results in one write of the latest value.
+ */
 int control_event(struct loopback_handle *lhandle, snd_ctl_event_t *ev)
 {
+	struct loopback *loop = lhandle->loopback;
+	unsigned int mask = snd_ctl_event_elem_get_mask(ev);
 	snd_ctl_elem_id_t *id2;
 	struct loopback_mixer *mix;
-	int capt = lhandle == lhandle->loopback->capt;
-	int err;
+	int capt = lhandle == loop->capt;
 
+	if (mask == SND_CTL_EVENT_MASK_REMOVE)
+		return 0;
+	if ((mask & SND_CTL_EVENT_MASK_VALUE) == 0)
+		return 0;
 	snd_ctl_elem_id_alloca(&id2);
 	snd_ctl_event_elem_get_id(ev, id2);
-	for (mix = lhandle->loopback->controls; mix; mix = mix->next) {
-		if (mix->skip)
+	for (mix = loop->controls_hash[capt][id_hash(id2)]; mix;
+	     mix = mix->hash_next[capt]) {
+		if (!control_id_match(id2, capt ? mix->dst.id : mix->src.id))
 			continue;
-		if (control_id_match(id2, capt ? mix->dst.id : mix->src.id)) {
-			err = control_event1(lhandle->loopback, mix, ev, capt);
-			if (err < 0)
-				return err;
+		loop->control_events++;
+		if (!mix->pending) {
+			if (loop->controls_pending == NULL)
+				loop->controls_pending_time = control_time();
+			mix->pending_next = loop->controls_pending;
+			loop->controls_pending = mix;
 		}
+		mix->pending = capt ? 2 : 1;
 	}
 	return 0;
 }
+
+/* write the pending values when the window expired or when forced */
+int control_flush(struct loopback *loop, int force)
+{
+	struct loopback_mixer *mix;
+	int err, res = 0;
+
+	if (loop->controls_pending == NULL)
+		return 0;
+	if (!force &&
+	    control_time() - loop->controls_pending_time < CONTROL_COALESCE / 1000.0)
+		return 0;
+	while ((mix = loop->controls_pending) != NULL) {
+		loop->controls_pending = mix->pending_next;
+		err = control_sync(loop, mix, mix->pending == 2);
+		mix->pending = 0;
+		if (err < 0)
+			res = err;
+	}
+	if (verbose > 6)
+		snd_output_printf(loop->output, "%s: control events %lu, writes %lu\n", loop->id, loop->control_events, loop->control_writes);
+	return res;
+}
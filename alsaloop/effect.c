@@ -0,0 +1,496 @@
+/*
+ *  A simple PCM loopback utility
+ *
+ *  In-loop effect chain (gain, biquad EQ, limiter, channel mixer)
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define EFFECT_BLOCK	256	/* frames processed at once */
+
+static const char *biquad_types[] = {
+	[BIQUAD_LOWPASS] = "lowpass",
+	[BIQUAD_HIGHPASS] = "highpass",
+	[BIQUAD_BANDPASS] = "bandpass",
+	[BIQUAD_NOTCH] = "notch",
+	[BIQUAD_PEAK] = "peak",
+	[BIQUAD_LOWSHELF] = "lowshelf",
+	[BIQUAD_HIGHSHELF] = "highshelf",
+};
+
+static inline float db_to_gain(double db)
+{
+	return pow(10.0, db / 20.0);
+}
+
+/*
+ * Parse one effect specification:
+ *
+ *   gain:DB
+ *   eq:TYPE,FREQ,Q,GAIN_DB
+ *   limiter:THRESHOLD_DB[,RELEASE_MS]
+ *   mix:ROW0;ROW1;...	where ROW is COEF0,COEF1,... (one row per channel)
+ */
+int effect_parse(struct loopback_effect **_effect, const char *spec)
+{
+	struct loopback_effect *effect;
+	const char *arg;
+	char type[16];
+	unsigned int i;
+	int err = -EINVAL;
+
+	arg = strchr(spec, ':');
+	if (arg == NULL || arg - spec >= (int)sizeof(type))
+		goto __error;
+	memcpy(type, spec, arg - spec);
+	type[arg - spec] = '\0';
+	arg++;
+	effect = calloc(1, sizeof(*effect));
+	if (effect == NULL)
+		return -ENOMEM;
+	if (strcasecmp(type, "gain") == 0) {
+		effect->type = EFFECT_GAIN;
+		if (sscanf(arg, "%lf", &effect->gain) != 1)
+			goto __error_free;
+	} else if (strcasecmp(type, "eq") == 0) {
+		char btype[16];
+		effect->type = EFFECT_BIQUAD;
+		effect->q = M_SQRT1_2;
+		if (sscanf(arg, "%15[^,],%lf,%lf,%lf", btype, &effect->freq,
+			   &effect->q, &effect->gain) < 2)
+			goto __error_free;
+		for (i = 0; i < BIQUAD_LAST; i++)
+			if (strcasecmp(btype, biquad_types[i]) == 0)
+				break;
+		if (i >= BIQUAD_LAST || effect->freq <= 0 || effect->q <= 0)
+			goto __error_free;
+		effect->biquad = i;
+	} else if (strcasecmp(type, "limiter") == 0) {
+		effect->type = EFFECT_LIMITER;
+		effect->release = 50;
+		if (sscanf(arg, "%lf,%lf", &effect->gain, &effect->release) < 1)
+			goto __error_free;
+		if (effect->gain > 0 || effect->release <= 0)
+			goto __error_free;
+	} else if (strcasecmp(type, "mix") == 0) {
+		const char *s;
+		unsigned int rows = 1, cols = 0, count = 0;
+		char *end;
+		effect->type = EFFECT_MIX;
+		for (s = arg; *s; s++)
+			if (*s == ';')
+				rows++;
+		effect->mix_matrix = calloc(rows * rows, sizeof(float));
+		if (effect->mix_matrix == NULL) {
+			err = -ENOMEM;
+			goto __error_free;
+		}
+		effect->mix_channels = rows;
+		for (s = arg, i = 0; *s; ) {
+			double v = strtod(s, &end);
+			if (end == s || cols >= rows)
+				goto __error_free;
+			effect->mix_matrix[i * rows + cols++] = v;
+			count++;
+			s = end;
+			if (*s == ',') {
+				s++;
+			} else if (*s == ';') {
+				s++;
+				i++;
+				cols = 0;
+			} else if (*s) {
+				goto __error_free;
+			}
+		}
+		if (count != rows * rows)
+			goto __error_free;
+	} else {
+		goto __error_free;
+	}
+	effect->spec = strdup(spec);
+	if (effect->spec == NULL) {
+		err = -ENOMEM;
+		goto __error_free;
+	}
+	*_effect = effect;
+	return 0;
+      __error_free:
+	free(effect->mix_matrix);
+	free(effect);
+      __error:
+	if (err == -EINVAL)
+		logit(LOG_CRIT, "Wrong effect syntax '%s'\n", spec);
+	return err;
+}
+
+/*
+ * Biquad coefficients, see "Cookbook formulae for audio EQ biquad
+ * filter coefficients" by Robert Bristow-Johnson.
+ */
+static void biquad_coefs(struct loopback_effect *effect,
+			 struct effect_coefs *c)
+{
+	double A = pow(10.0, effect->gain / 40.0);
+	double w0 = 2.0 * M_PI * effect->freq / effect->rate;
+	double cw = cos(w0), sw = sin(w0);
+	double alpha = sw / (2.0 * effect->q);
+	double sa = 2.0 * sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+
+	switch (effect->biquad) {
+	case BIQUAD_LOWPASS:
+		b0 = (1 - cw) / 2; b1 = 1 - cw; b2 = (1 - cw) / 2;
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_HIGHPASS:
+		b0 = (1 + cw) / 2; b1 = -(1 + cw); b2 = (1 + cw) / 2;
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_BANDPASS:
+		b0 = alpha; b1 = 0; b2 = -alpha;
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_NOTCH:
+		b0 = 1; b1 = -2 * cw; b2 = 1;
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_PEAK:
+		b0 = 1 + alpha * A; b1 = -2 * cw; b2 = 1 - alpha * A;
+		a0 = 1 + alpha / A; a1 = -2 * cw; a2 = 1 - alpha / A;
+		break;
+	case BIQUAD_LOWSHELF:
+		b0 = A * ((A + 1) - (A - 1) * cw + sa);
+		b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+		b2 = A * ((A + 1) - (A - 1) * cw - sa);
+		a0 = (A + 1) + (A - 1) * cw + sa;
+		a1 = -2 * ((A - 1) + (A + 1) * cw);
+		a2 = (A + 1) + (A - 1) * cw - sa;
+		break;
+	case BIQUAD_HIGHSHELF:
+	default:
+		b0 = A * ((A + 1) + (A - 1) * cw + sa);
+		b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+		b2 = A * ((A + 1) + (A - 1) * cw - sa);
+		a0 = (A + 1) - (A - 1) * cw + sa;
+		a1 = 2 * ((A - 1) - (A + 1) * cw);
+		a2 = (A + 1) - (A - 1) * cw - sa;
+		break;
+	}
+	c->b0 = b0 / a0;
+	c->b1 = b1 / a0;
+	c->b2 = b2 / a0;
+	c->a1 = a1 / a0;
+	c->a2 = a2 / a0;
+}
+
+/* the coefficients are computed once, when the stream is set up */
+static void effect_coefs(struct loopback_effect *effect)
+{
+	struct effect_coefs *c = &effect->coefs;
+
+	switch (effect->type) {
+	case EFFECT_GAIN:
+		c->gain = db_to_gain(effect->gain);
+		break;
+	case EFFECT_BIQUAD:
+		biquad_coefs(effect, c);
+		break;
+	case EFFECT_LIMITER:
+		c->gain = db_to_gain(effect->gain);
+		c->release = exp(-1.0 / (effect->release / 1000.0 * effect->rate));
+		break;
+	case EFFECT_MIX:
+		break;
+	}
+}
+
+int effect_init(struct loopback_effect *effect, unsigned int rate,
+		unsigned int channels)
+{
+	effect->rate = rate;
+	effect->channels = channels;
+	free(effect->state);
+	effect->state = NULL;
+	switch (effect->type) {
+	case EFFECT_BIQUAD:
+		if (effect->freq >= rate / 2) {
+			logit(LOG_CRIT, "Effect '%s': frequency above Nyquist (%u)\n", effect->spec, rate / 2);
+			return -EINVAL;
+		}
+		effect->state = calloc(2 * channels, sizeof(float));
+		if (effect->state == NULL)
+			return -ENOMEM;
+		break;
+	case EFFECT_LIMITER:
+		effect->env = 1.0;
+		break;
+	case EFFECT_MIX:
+		if (effect->mix_channels != channels) {
+			logit(LOG_CRIT, "Effect '%s': matrix size does not match channels (%u)\n", effect->spec, channels);
+			return -EINVAL;
+		}
+		effect->state = calloc(channels, sizeof(float));
+		if (effect->state == NULL)
+			return -ENOMEM;
+		break;
+	default:
+		break;
+	}
+	effect_coefs(effect);
+	return 0;
+}
+
+void effect_done(struct loopback_effect *effect)
+{
+	free(effect->state);
+	effect->state = NULL;
+}
+
+void effect_free(struct loopback_effect *effect)
+{
+	effect_done(effect);
+	free(effect->mix_matrix);
+	free(effect->spec);
+	free(effect);
+}
+
+/*
+ * Kernels - the inner loops run over channels with independent state,
+ * so the compiler can vectorize them.
+ */
+static void effect_gain(struct effect_coefs *c, float *buf,
+			unsigned int samples)
+{
+	float g = c->gain;
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		buf[i] *= g;
+}
+
+static void effect_biquad(struct effect_coefs *c, float *restrict state,
+			  float *restrict buf, unsigned int frames,
+			  unsigned int channels)
+{
+	float *restrict z1 = state, *restrict z2 = state + channels;
+	float b0 = c->b0, b1 = c->b1, b2 = c->b2, a1 = c->a1, a2 = c->a2;
+	unsigned int i, ch;
+
+	for (i = 0; i < frames; i++, buf += channels) {
+		for (ch = 0; ch < channels; ch++) {
+			float x = buf[ch];
+			float y = b0 * x + z1[ch];
+			z1[ch] = b1 * x - a1 * y + z2[ch];
+			z2[ch] = b2 * x - a2 * y;
+			buf[ch] = y;
+		}
+	}
+}
+
+static void effect_limiter(struct loopback_effect *effect,
+			   struct effect_coefs *c, float *buf,
+			   unsigned int frames, unsigned int channels)
+{
+	float threshold = c->gain, release = c->release;
+	float env = effect->env;
+	unsigned int i, ch;
+
+	for (i = 0; i < frames; i++, buf += channels) {
+		float peak = 0, g;
+		for (ch = 0; ch < channels; ch++) {
+			float a = fabsf(buf[ch]);
+			peak = a > peak ? a : peak;
+		}
+		/* instant attack, exponential release */
+		g = peak > threshold ? threshold / peak : 1.0f;
+		if (g < env)
+			env = g;
+		else
+			env = g + (env - g) * release;
+		for (ch = 0; ch < channels; ch++)
+			buf[ch] *= env;
+	}
+	effect->env = env;
+}
+
+static void effect_mix(struct loopback_effect *effect, float *restrict buf,
+		       unsigned int frames, unsigned int channels)
+{
+	const float *restrict m = effect->mix_matrix;
+	float *restrict tmp = effect->state;
+	unsigned int i, ch, k;
+
+	for (i = 0; i < frames; i++, buf += channels) {
+		for (ch = 0; ch < channels; ch++) {
+			float sum = 0;
+			for (k = 0; k < channels; k++)
+				sum += m[ch * channels + k] * buf[k];
+			tmp[ch] = sum;
+		}
+		memcpy(buf, tmp, channels * sizeof(float));
+	}
+}
+
+static void effect_apply(struct loopback_effect *effect, float *buf,
+			 unsigned int frames)
+{
+	struct effect_coefs *c = &effect->coefs;
+
+	switch (effect->type) {
+	case EFFECT_GAIN:
+		effect_gain(c, buf, frames * effect->channels);
+		break;
+	case EFFECT_BIQUAD:
+		effect_biquad(c, effect->state, buf, frames, effect->channels);
+		break;
+	case EFFECT_LIMITER:
+		effect_limiter(effect, c, buf, frames, effect->channels);
+		break;
+	case EFFECT_MIX:
+		effect_mix(effect, buf, frames, effect->channels);
+		break;
+	}
+}
+
+int effects_init(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_effect *effect;
+	int err;
+
+	if (loop->effects == NULL)
+		return 0;
+	if (play->share) {
+		/* the ring holds the sum of all mixed loops */
+		logit(LOG_CRIT, "%s: effects cannot be used with a mixed playback\n", loop->id);
+		return -EINVAL;
+	}
+	if (play->format != SND_PCM_FORMAT_S16 &&
+	    play->format != SND_PCM_FORMAT_S32 &&
+	    play->format != SND_PCM_FORMAT_FLOAT) {
+		logit(LOG_CRIT, "%s: effects support only %s, %s or %s formats\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT));
+		return -EINVAL;
+	}
+	for (effect = loop->effects; effect; effect = effect->next) {
+		err = effect_init(effect, play->rate, play->channels);
+		if (err < 0)
+			return err;
+	}
+	free(loop->effect_buf);
+	loop->effect_buf = malloc(EFFECT_BLOCK * play->channels * sizeof(float));
+	if (loop->effect_buf == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void effects_done(struct loopback *loop)
+{
+	struct loopback_effect *effect;
+
+	for (effect = loop->effects; effect; effect = effect->next)
+		effect_done(effect);
+	free(loop->effect_buf);
+	loop->effect_buf = NULL;
+}
+
+static void to_float(snd_pcm_format_t format, const void *src, float *dst,
+		     unsigned int samples)
+{
+	unsigned int i;
+
+	if (format == SND_PCM_FORMAT_S16) {
+		const int16_t *s = src;
+		for (i = 0; i < samples; i++)
+			dst[i] = s[i] * (1.0f / 32768.0f);
+	} else if (format == SND_PCM_FORMAT_S32) {
+		const int32_t *s = src;
+		for (i = 0; i < samples; i++)
+			dst[i] = s[i] * (1.0f / 2147483648.0f);
+	} else {
+		memcpy(dst, src, samples * sizeof(float));
+	}
+}
+
+static void from_float(snd_pcm_format_t format, const float *src, void *dst,
+		       unsigned int samples)
+{
+	unsigned int i;
+
+	if (format == SND_PCM_FORMAT_S16) {
+		int16_t *d = dst;
+		for (i = 0; i < samples; i++) {
+			float v = src[i] * 32768.0f;
+			v = v > 32767.0f ? 32767.0f : v;
+			v = v < -32768.0f ? -32768.0f : v;
+			d[i] = lrintf(v);
+		}
+	} else if (format == SND_PCM_FORMAT_S32) {
+		int32_t *d = dst;
+		for (i = 0; i < samples; i++) {
+			double v = src[i] * 2147483648.0;
+			v = v > 2147483647.0 ? 2147483647.0 : v;
+			v = v < -2147483648.0 ? -2147483648.0 : v;
+			d[i] = lrint(v);
+		}
+	} else {
+		memcpy(dst, src, samples * sizeof(float));
+	}
+}
+
+/*
+ * Run the effect chain in place over 'count' frames of the playback
+ * ring buffer starting at 'pos'.
+ */
+void effects_apply(struct loopback *loop, snd_pcm_uframes_t pos,
+		   snd_pcm_uframes_t count)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_effect *effect;
+	snd_pcm_uframes_t count1;
+	char *ptr;
+
+	if (loop->effect_buf == NULL)
+		return;
+	pos %= play->buf_size;
+	while (count > 0) {
+		count1 = count;
+		if (count1 > EFFECT_BLOCK)
+			count1 = EFFECT_BLOCK;
+		if (pos + count1 > play->buf_size)
+			count1 = play->buf_size - pos;
+		ptr = play->buf + pos * play->frame_size;
+		to_float(play->format, ptr, loop->effect_buf,
+			 count1 * play->channels);
+		for (effect = loop->effects; effect; effect = effect->next)
+			effect_apply(effect, loop->effect_buf, count1);
+		from_float(play->format, loop->effect_buf, ptr,
+			   count1 * play->channels);
+		count -= count1;
+		pos = (pos + count1) % play->buf_size;
+	}
+}
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sched.h>
 #include <errno.h>
 #include <getopt.h>
@@ -31,6 +32,8 @@
 #include <sys/time.h>
 #include <math.h>
 #include <syslog.h>
+#include <signal.h>
+#include <unistd.h>
 #include <pthread.h>
 #include "alsaloop.h"
 
@@ -62,30 +65,72 @@ static const char *src_types[] = {
 };
 #endif
 
+#define MAX_CARDS	32
+
+/*
+ * The serial open workaround is applied per card, the opens for
+ * different cards run in parallel. An open for an unknown card
+ * is exclusive.
+ */
 static pthread_once_t pcm_open_mutex_once = PTHREAD_ONCE_INIT;
-static pthread_mutex_t pcm_open_mutex;
+static pthread_rwlock_t pcm_open_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t pcm_open_mutex[MAX_CARDS];
 
 static void pcm_open_init_mutex(void)
 {
-	pthread_mutexattr_t attr;
+	int i;
 
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&pcm_open_mutex, &attr);
-	pthread_mutexattr_destroy(&attr);
+	for (i = 0; i < MAX_CARDS; i++)
+		pthread_mutex_init(&pcm_open_mutex[i], NULL);
 }
 
-static inline void pcm_open_lock(void)
+static inline void pcm_open_lock(int card)
 {
+	if (!(workarounds & WORKAROUND_SERIALOPEN))
+		return;
 	pthread_once(&pcm_open_mutex_once, pcm_open_init_mutex);
-	if (workarounds & WORKAROUND_SERIALOPEN)
-	        pthread_mutex_lock(&pcm_open_mutex);
+	if (card < 0 || card >= MAX_CARDS) {
+		pthread_rwlock_wrlock(&pcm_open_rwlock);
+		return;
+	}
+	pthread_rwlock_rdlock(&pcm_open_rwlock);
+	pthread_mutex_lock(&pcm_open_mutex[card]);
+}
+
+static inline void pcm_open_unlock(int card)
+{
+	if (!(workarounds & WORKAROUND_SERIALOPEN))
+		return;
+	if (card >= 0 && card < MAX_CARDS)
+		pthread_mutex_unlock(&pcm_open_mutex[card]);
+	pthread_rwlock_unlock(&pcm_open_rwlock);
 }
- 
-static inline void pcm_open_unlock(void)
+
+/* card index from the device name like hw:1,0 or dmix:CARD=Intel */
+static int device_card(const char *device)
 {
-	if (workarounds & WORKAROUND_SERIALOPEN)
-	        pthread_mutex_unlock(&pcm_open_mutex);
+	char card[32];
+	const char *s;
+	size_t len;
+
+	if (strncmp(device, "hw:", 3) == 0)
+		s = device + 3;
+	else if (strncmp(device, "plughw:", 7) == 0)
+		s = device + 7;
+	else if ((s = strstr(device, "CARD=")) != NULL)
+		s += 5;
+	else
+		return -1;
+	if (strncmp(s, "CARD=", 5) == 0)
+		s += 5;
+	len = strcspn(s, ",");
+	if (len == 0 || len >= sizeof(card))
+		return -1;
+	memcpy(card, s, len);
+	card[len] = '\0';
+	if (card[0] == '"' || card[0] == '\'')
+		return -1;
+	return snd_card_get_index(card);
 }
 
 static inline snd_pcm_uframes_t get_whole_latency(struct loopback *loop)
@@ -106,6 +151,43 @@ static inline snd_pcm_uframes_t time_to_frames(unsigned int rate,
 	return (time * rate) / 1000000ULL;
 }
 
+static inline int is_shared(struct loopback_handle *lhandle)
+{
+	return lhandle->share != NULL;
+}
+
+/* the handle does the PCM I/O (always true for not shared handles) */
+static inline int share_owner(struct loopback_handle *lhandle)
+{
+	return lhandle->share == NULL || lhandle->share->owner == lhandle;
+}
+
+/* the shared PCM is already configured by another running loop */
+static inline int share_configured(struct loopback_handle *lhandle)
+{
+	return lhandle->share != NULL &&
+	       lhandle->share->configured &&
+	       lhandle->share->running > 0;
+}
+
+static int setparams_shared(struct loopback_handle *lhandle)
+{
+	struct loopback_handle *owner = lhandle->share->owner;
+
+	if (owner->format != lhandle->format ||
+	    owner->channels != lhandle->channels ||
+	    owner->rate_req != lhandle->rate_req) {
+		logit(LOG_CRIT, "Stream parameters for %s do not match the shared PCM '%s' (%s, %uHz, %u channels)\n", lhandle->id, lhandle->share->name, snd_pcm_format_name(owner->format), owner->rate_req, owner->channels);
+		return -EINVAL;
+	}
+	lhandle->rate = owner->rate;
+	lhandle->buffer_size = owner->buffer_size;
+	lhandle->period_size = owner->period_size;
+	lhandle->avail_min = owner->avail_min;
+	lhandle->pitch = (double)lhandle->rate_req / (double)lhandle->rate;
+	return 0;
+}
+
 static int setparams_stream(struct loopback_handle *lhandle,
 			    snd_pcm_hw_params_t *params)
 {
@@ -274,6 +356,20 @@ static int setparams_set(struct loopback_handle *lhandle,
 		return err;
 	}
 	snd_pcm_sw_params_get_avail_min(swparams, &lhandle->avail_min);
+	if (lhandle->loopback->pll.bandwidth > 0 ||
+	    !(workarounds & WORKAROUND_NOTSTAMP)) {
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+		if (err < 0) {
+			logit(LOG_CRIT, "Unable to set timestamp mode for %s: %s\n", lhandle->id, snd_strerror(err));
+			return err;
+		}
+#ifdef USE_AUDIO_TSTAMP
+		/* the status timestamps are compared between devices */
+		err = snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+		if (err < 0 && verbose > 1)
+			snd_output_printf(lhandle->loopback->output, "%s: monotonic timestamps not available: %s\n", lhandle->id, snd_strerror(err));
+#endif
+	}
 	err = snd_pcm_sw_params(handle, swparams);
 	if (err < 0) {
 		logit(LOG_CRIT, "Unable to set sw params for %s: %s\n", lhandle->id, snd_strerror(err));
@@ -282,9 +378,110 @@ static int setparams_set(struct loopback_handle *lhandle,
 	return 0;
 }
 
-static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
+static struct loopback_params *params_find(struct loopback_handle *lhandle,
+					   snd_pcm_uframes_t bufsize)
 {
+	struct loopback_params *p;
+	int i;
+
+	for (i = 0; i < lhandle->params_count; i++) {
+		p = &lhandle->params_cache[i];
+		if (p->access == lhandle->access &&
+		    p->format == lhandle->format &&
+		    p->rate_req == lhandle->rate_req &&
+		    p->channels == lhandle->channels &&
+		    p->bufsize == bufsize)
+			return p;
+	}
+	return NULL;
+}
+
+/*
+ * Apply the parameters negotiated for this configuration before.
+ * Returns 1 when applied, 0 when the full negotiation is required.
+ */
+static int setparams_cached(struct loopback_handle *lhandle,
+			    snd_pcm_uframes_t bufsize)
+{
+	struct loopback_params *p = params_find(lhandle, bufsize);
 	int err;
+
+	if (p == NULL)
+		return 0;
+	err = snd_pcm_hw_params(lhandle->handle, p->hw_params);
+	if (err >= 0)
+		err = snd_pcm_sw_params(lhandle->handle, p->sw_params);
+	if (err < 0) {
+		if (verbose)
+			snd_output_printf(lhandle->loopback->output, "%s: cached params rejected: %s\n", lhandle->id, snd_strerror(err));
+		/* never hit this entry again */
+		p->channels = 0;
+		return 0;
+	}
+	lhandle->rate = p->rate;
+	lhandle->buffer_size = p->buffer_size;
+	lhandle->period_size = p->period_size;
+	lhandle->avail_min = p->avail_min;
+	lhandle->pitch = (double)lhandle->rate_req / (double)lhandle->rate;
+	p->hits++;
+	return 1;
+}
+
+static void setparams_store(struct loopback_handle *lhandle,
+			    snd_pcm_uframes_t bufsize,
+			    snd_pcm_hw_params_t *params,
+			    snd_pcm_sw_params_t *swparams)
+{
+	struct loopback_params *p;
+
+	if (lhandle->params_count < MAX_PARAMS_CACHE) {
+		p = &lhandle->params_cache[lhandle->params_count];
+		if (p->hw_params == NULL &&
+		    snd_pcm_hw_params_malloc(&p->hw_params) < 0)
+			return;
+		if (p->sw_params == NULL &&
+		    snd_pcm_sw_params_malloc(&p->sw_params) < 0)
+			return;
+		lhandle->params_count++;
+	} else {
+		p = &lhandle->params_cache[lhandle->params_next];
+		lhandle->params_next = (lhandle->params_next + 1) % MAX_PARAMS_CACHE;
+	}
+	p->access = lhandle->access;
+	p->format = lhandle->format;
+	p->rate_req = lhandle->rate_req;
+	p->channels = lhandle->channels;
+	p->bufsize = bufsize;
+	snd_pcm_hw_params_copy(p->hw_params, params);
+	snd_pcm_sw_params_copy(p->sw_params, swparams);
+	p->rate = lhandle->rate;
+	p->buffer_size = lhandle->buffer_size;
+	p->period_size = lhandle->period_size;
+	p->avail_min = lhandle->avail_min;
+	p->hits = 0;
+}
+
+static void params_free(struct loopback_handle *lhandle)
+{
+	struct loopback_params *p;
+	int i;
+
+	for (i = 0; i < MAX_PARAMS_CACHE; i++) {
+		p = &lhandle->params_cache[i];
+		if (p->hw_params)
+			snd_pcm_hw_params_free(p->hw_params);
+		if (p->sw_params)
+			snd_pcm_sw_params_free(p->sw_params);
+		p->hw_params = NULL;
+		p->sw_params = NULL;
+	}
+	lhandle->params_count = 0;
+	lhandle->params_next = 0;
+}
+
+static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
+{
+	int err, pshared, cshared, pnego, cnego;
 	snd_pcm_hw_params_t *pt_params, *ct_params;	/* templates with rate, format and channels */
 	snd_pcm_hw_params_t *p_params, *c_params;
 	snd_pcm_sw_params_t *p_swparams, *c_swparams;
@@ -295,43 +492,69 @@ static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
 	snd_pcm_hw_params_alloca(&ct_params);
 	snd_pcm_sw_params_alloca(&p_swparams);
 	snd_pcm_sw_params_alloca(&c_swparams);
-	if ((err = setparams_stream(loop->play, pt_params)) < 0) {
+	pshared = share_configured(loop->play);
+	cshared = share_configured(loop->capt);
+	/* a configuration seen before is set in one step */
+	loop->play->params_cached = !pshared &&
+				    setparams_cached(loop->play, bufsize);
+	loop->capt->params_cached = !cshared &&
+				    setparams_cached(loop->capt, bufsize);
+	pnego = !pshared && !loop->play->params_cached;
+	cnego = !cshared && !loop->capt->params_cached;
+	if (pshared) {
+		if ((err = setparams_shared(loop->play)) < 0)
+			return err;
+	} else if (pnego &&
+		   (err = setparams_stream(loop->play, pt_params)) < 0) {
 		logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = setparams_stream(loop->capt, ct_params)) < 0) {
+	if (cshared) {
+		if ((err = setparams_shared(loop->capt)) < 0)
+			return err;
+	} else if (cnego &&
+		   (err = setparams_stream(loop->capt, ct_params)) < 0) {
 		logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
 
-	if ((err = setparams_bufsize(loop->play, p_params, pt_params, bufsize / loop->play->pitch)) < 0) {
+	if (pnego &&
+	    (err = setparams_bufsize(loop->play, p_params, pt_params, bufsize / loop->play->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set buffer parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = setparams_bufsize(loop->capt, c_params, ct_params, bufsize / loop->capt->pitch)) < 0) {
+	if (cnego &&
+	    (err = setparams_bufsize(loop->capt, c_params, ct_params, bufsize / loop->capt->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set buffer parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
 
-	if ((err = setparams_set(loop->play, p_params, p_swparams, bufsize / loop->play->pitch)) < 0) {
+	if (pnego &&
+	    (err = setparams_set(loop->play, p_params, p_swparams, bufsize / loop->play->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set sw parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = setparams_set(loop->capt, c_params, c_swparams, bufsize / loop->capt->pitch)) < 0) {
+	if (cnego &&
+	    (err = setparams_set(loop->capt, c_params, c_swparams, bufsize / loop->capt->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set sw parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
+	if (pnego)
+		setparams_store(loop->play, bufsize, p_params, p_swparams);
+	if (cnego)
+		setparams_store(loop->capt, bufsize, c_params, c_swparams);
 
 #if 0
 	if (!loop->linked)
 		if (snd_pcm_link(loop->capt->handle, loop->play->handle) >= 0)
 			loop->linked = 1;
 #endif
-	if ((err = snd_pcm_prepare(loop->play->handle)) < 0) {
+	if (!pshared && (err = snd_pcm_prepare(loop->play->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if (!loop->linked && (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
+	if (!loop->linked && !cshared &&
+	    (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
@@ -374,6 +597,15 @@ static int getcurtimestamp(snd_timestamp_t *ts)
 	return 0;
 }
 
+/* monotonic time in seconds */
+static double clock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
 static void xrun_profile0(struct loopback *loop)
 {
 	snd_pcm_sframes_t pdelay, cdelay;
@@ -465,7 +697,28 @@ static void buf_remove(struct loopback *loop, snd_pcm_uframes_t count)
 	}
 }
 
-#if 0
+static void mix_samples(snd_pcm_format_t format, void *dst, const void *src,
+			unsigned int samples)
+{
+	unsigned int i;
+
+	if (format == SND_PCM_FORMAT_S16) {
+		int16_t *d = dst;
+		const int16_t *s = src;
+		for (i = 0; i < samples; i++) {
+			int v = d[i] + s[i];
+			d[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+		}
+	} else {
+		int32_t *d = dst;
+		const int32_t *s = src;
+		for (i = 0; i < samples; i++) {
+			int64_t v = (int64_t)d[i] + s[i];
+			d[i] = v > INT32_MAX ? INT32_MAX : (v < INT32_MIN ? INT32_MIN : v);
+		}
+	}
+}
+
 static void buf_add_copy(struct loopback *loop)
 {
 	struct loopback_handle *capt = loop->capt;
@@ -487,9 +740,15 @@ static void buf_add_copy(struct loopback *loop)
 			count1 = play->buf_size - ppos;
 		if (count1 == 0)
 			break;
-		memcpy(play->buf + ppos * play->frame_size,
-		       capt->buf + cpos * capt->frame_size,
-		       count1 * capt->frame_size);
+		if (is_shared(play))
+			mix_samples(play->format,
+				    play->buf + ppos * play->frame_size,
+				    capt->buf + cpos * capt->frame_size,
+				    count1 * play->channels);
+		else
+			memcpy(play->buf + ppos * play->frame_size,
+			       capt->buf + cpos * capt->frame_size,
+			       count1 * capt->frame_size);
 		play->buf_count += count1;
 		capt->buf_count -= count1;
 		ppos += count1;
@@ -499,9 +758,28 @@ static void buf_add_copy(struct loopback *loop)
 		count -= count1;
 	}
 }
-#endif
 
 #ifdef USE_SAMPLERATE
+static void mix_float_samples(snd_pcm_format_t format, void *dst,
+			      const float *src, unsigned int samples)
+{
+	unsigned int i;
+
+	if (format == SND_PCM_FORMAT_S16) {
+		int16_t *d = dst;
+		for (i = 0; i < samples; i++) {
+			long v = d[i] + lrintf(src[i] * 32768.0f);
+			d[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+		}
+	} else {
+		int32_t *d = dst;
+		for (i = 0; i < samples; i++) {
+			double v = (double)d[i] + src[i] * 2147483648.0;
+			d[i] = v > INT32_MAX ? INT32_MAX : (v < INT32_MIN ? INT32_MIN : lrint(v));
+		}
+	}
+}
+
 static void buf_add_src(struct loopback *loop)
 {
 	struct loopback_handle *capt = loop->capt;
@@ -555,7 +833,13 @@ static void buf_add_src(struct loopback *loop)
 			count1 = buf_avail(play);
 		if (count1 == 0)
 			break;
-		if (capt->format == SND_PCM_FORMAT_S32)
+		if (is_shared(play))
+			mix_float_samples(play->format,
+					  play->buf + pos1 * play->frame_size,
+					  loop->src_data.data_out +
+					    pos * play->channels,
+					  count1 * play->channels);
+		else if (capt->format == SND_PCM_FORMAT_S32)
 			src_float_to_int_array(loop->src_data.data_out +
 					   pos * play->channels,
 					 (int *)(play->buf +
@@ -594,14 +878,36 @@ static void buf_add_src(struct loopback *loop)
 
 static void buf_add(struct loopback *loop, snd_pcm_uframes_t count)
 {
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t old_count = play->buf_count;
+
 	/* copy samples from capture to playback buffer */
 	if (count <= 0)
 		return;
-	if (loop->play->buf == loop->capt->buf) {
-		loop->play->buf_count += count;
+	if (play->buf == loop->capt->buf) {
+		play->buf_count += count;
+	} else if (!loop->use_samplerate &&
+		   (is_shared(play) || is_shared(loop->capt))) {
+		buf_add_copy(loop);
 	} else {
 		buf_add_src(loop);
 	}
+	/* process the new samples in place */
+	if (loop->effects && play->buf_count > old_count)
+		effects_apply(loop, play->buf_pos + old_count,
+			      play->buf_count - old_count);
+}
+
+/* all legs of the shared PCM must resync */
+static void share_xrun(struct loopback_share *share)
+{
+	int i;
+
+	for (i = 0; i < share->handles_count; i++)
+		if (share->handles[i]->share_running)
+			share->handles[i]->xrun_pending = 1;
+	if (!share->capture)
+		share->start_pending = 1;
 }
 
 static int xrun(struct loopback_handle *lhandle)
@@ -621,6 +927,8 @@ static int xrun(struct loopback_handle *lhandle)
 			return err;
 		lhandle->xrun_pending = 1;
 	}
+	if (lhandle->share)
+		share_xrun(lhandle->share);
 	return 0;
 }
 
@@ -635,12 +943,95 @@ static int suspend(struct loopback_handle *lhandle)
 	return 0;
 }
 
+static void share_capture_advance(struct loopback_share *share,
+				  snd_pcm_uframes_t count)
+{
+	struct loopback_handle *h;
+	int i;
+
+	share->buf_pos = (share->buf_pos + count) % share->buf_size;
+	for (i = 0; i < share->handles_count; i++) {
+		h = share->handles[i];
+		if (!h->share_running)
+			continue;
+		h->buf_pos = share->buf_pos;
+		h->buf_count += count;
+		h->counter += count;
+		if (h->buf_count > h->buf_size) {
+			/* slow leg, the oldest samples were overwritten */
+			h->buf_over += h->buf_count - h->buf_size;
+			h->buf_count = h->buf_size;
+		}
+		if (h != share->owner)
+			h->share_pending += count;
+	}
+}
+
+/*
+ * The owner reads the shared capture PCM to the common ring, the other
+ * legs only pick up the count of the new samples (their cursors were
+ * already moved by share_capture_advance()).
+ */
+static int readit_shared(struct loopback_handle *lhandle)
+{
+	struct loopback_share *share = lhandle->share;
+	snd_pcm_sframes_t r, res = 0;
+	snd_pcm_sframes_t avail;
+	int err;
+
+	if (share->owner != lhandle) {
+		res = lhandle->share_pending;
+		lhandle->share_pending = 0;
+		return res;
+	}
+	avail = snd_pcm_avail_update(lhandle->handle);
+	if (avail == -EPIPE) {
+		return xrun(lhandle);
+	} else if (avail == -ESTRPIPE) {
+		if ((err = suspend(lhandle)) < 0)
+			return err;
+	}
+	if (avail > (snd_pcm_sframes_t)share->buf_size)
+		avail = share->buf_size;
+	while (avail > 0) {
+		r = avail;
+		if (r + share->buf_pos > share->buf_size)
+			r = share->buf_size - share->buf_pos;
+		r = snd_pcm_readi(lhandle->handle,
+				  share->buf +
+				  share->buf_pos *
+				  lhandle->frame_size, r);
+		if (r == 0)
+			return res;
+		if (r < 0) {
+			if (r == -EPIPE) {
+				err = xrun(lhandle);
+				return res > 0 ? res : err;
+			} else if (r == -ESTRPIPE) {
+				if ((err = suspend(lhandle)) < 0)
+					return res > 0 ? res : err;
+				r = 0;
+			} else {
+				return res > 0 ? res : r;
+			}
+		}
+		res += r;
+		if (lhandle->max < res)
+			lhandle->max = res;
+		share_capture_advance(share, r);
+		avail -= r;
+	}
+	return res;
+}
+
 static int readit(struct loopback_handle *lhandle)
 {
 	snd_pcm_sframes_t r, res = 0;
 	snd_pcm_sframes_t avail;
 	int err;
 
+	if (lhandle->share)
+		return readit_shared(lhandle);
 	avail = snd_pcm_avail_update(lhandle->handle);
 	if (avail == -EPIPE) {
 		return xrun(lhandle);
@@ -695,67 +1086,813 @@ static int readit(struct loopback_handle *lhandle)
 		lhandle->buf_pos %= lhandle->buf_size;
 		avail -= r;
 	}
-	return res;
+	return res;
+}
+
+/* returns 1 when the stop was finished (reinit is required) */
+static int check_stop_pending(struct loopback *loop, snd_pcm_uframes_t count)
+{
+	if (!loop->stop_pending)
+		return 0;
+	loop->stop_count += count;
+	if (loop->stop_count * loop->play->pitch > loop->latency * 3) {
+		loop->stop_pending = 0;
+		loop->reinit = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The frames mixed by all running legs. A leg which is restarted and
+ * did not mix any frame yet, or which recovers from a capture overrun,
+ * does not hold the other legs, its cursor is moved by
+ * share_play_advance().
+ */
+static snd_pcm_uframes_t share_play_count(struct loopback_share *share)
+{
+	snd_pcm_uframes_t count = share->buf_size;
+	struct loopback_handle *h;
+	struct loopback *loop;
+	int i, legs = 0;
+
+	for (i = 0; i < share->handles_count; i++) {
+		h = share->handles[i];
+		if (!h->share_running)
+			continue;
+		loop = h->loopback;
+		if (!loop->running ||
+		    (loop->restart_pending && h->buf_count == 0) ||
+		    loop->capt->xrun_pending) {
+			if (!h->share_skipped)
+				logit(LOG_WARNING, "%s: not running, skipped in the mix of '%s'\n", loop->id, share->name);
+			h->share_skipped = 1;
+			continue;
+		}
+		h->share_skipped = 0;
+		if (h->buf_count < count)
+			count = h->buf_count;
+		legs++;
+	}
+	return legs > 0 ? count : 0;
+}
+
+static void share_play_advance(struct loopback_handle *owner,
+			       snd_pcm_uframes_t count)
+{
+	struct loopback_share *share = owner->share;
+	snd_pcm_uframes_t pos = share->buf_pos, count1, c = count;
+	struct loopback_handle *h;
+	int i;
+
+	/* clear the played area for the next mixing round */
+	while (c > 0) {
+		count1 = c;
+		if (pos + count1 > share->buf_size)
+			count1 = share->buf_size - pos;
+		snd_pcm_format_set_silence(owner->format,
+					   share->buf + pos * owner->frame_size,
+					   count1 * owner->channels);
+		pos = (pos + count1) % share->buf_size;
+		c -= count1;
+	}
+	share->buf_pos = pos;
+	for (i = 0; i < share->handles_count; i++) {
+		h = share->handles[i];
+		if (!h->share_running)
+			continue;
+		h->buf_pos = pos;
+		h->buf_count = h->buf_count > count ? h->buf_count - count : 0;
+		h->counter += count;
+		check_stop_pending(h->loopback, count);
+	}
+}
+
+/*
+ * The owner plays the part of the common ring which was mixed by all
+ * running legs, the other legs only move their cursors in buf_add().
+ */
+static int writeit_shared(struct loopback_handle *lhandle)
+{
+	struct loopback_share *share = lhandle->share;
+	snd_pcm_sframes_t avail;
+	snd_pcm_sframes_t r, res = 0;
+	snd_pcm_uframes_t count;
+	int err;
+
+	if (share->owner != lhandle)
+		return 0;
+      __again:
+	avail = snd_pcm_avail_update(lhandle->handle);
+	if (avail == -EPIPE) {
+		if ((err = xrun(lhandle)) < 0)
+			return err;
+		return res;
+	} else if (avail == -ESTRPIPE) {
+		if ((err = suspend(lhandle)) < 0)
+			return err;
+		goto __again;
+	}
+	count = share_play_count(share);
+	while (avail > 0 && count > 0) {
+		r = count;
+		if (r + share->buf_pos > share->buf_size)
+			r = share->buf_size - share->buf_pos;
+		if (r > avail)
+			r = avail;
+		r = snd_pcm_writei(lhandle->handle,
+				   share->buf +
+				   share->buf_pos *
+				   lhandle->frame_size, r);
+		if (r <= 0) {
+			if (r == -EPIPE) {
+				if ((err = xrun(lhandle)) < 0)
+					return err;
+				return res;
+			}
+			return res > 0 ? res : r;
+		}
+		res += r;
+		share_play_advance(lhandle, r);
+		xrun_profile(lhandle->loopback);
+		count -= r;
+		avail -= r;
+	}
+	if (share->start_pending && res > 0) {
+		share->start_pending = 0;
+		if ((err = snd_pcm_start(lhandle->handle)) < 0) {
+			logit(LOG_CRIT, "%s start failed: %s\n", lhandle->id, snd_strerror(err));
+			return err;
+		}
+	}
+	return res;
+}
+
+static int writeit(struct loopback_handle *lhandle)
+{
+	snd_pcm_sframes_t avail;
+	snd_pcm_sframes_t r, res = 0;
+	int err;
+
+	if (lhandle->share)
+		return writeit_shared(lhandle);
+      __again:
+	avail = snd_pcm_avail_update(lhandle->handle);
+	if (avail == -EPIPE) {
+		if ((err = xrun(lhandle)) < 0)
+			return err;
+		return res;
+	} else if (avail == -ESTRPIPE) {
+		if ((err = suspend(lhandle)) < 0)
+			return err;
+		goto __again;
+	}
+	while (avail > 0 && lhandle->buf_count > 0) {
+		r = lhandle->buf_count;
+		if (r + lhandle->buf_pos > lhandle->buf_size)
+			r = lhandle->buf_size - lhandle->buf_pos;
+		if (r > avail)
+			r = avail;
+		r = snd_pcm_writei(lhandle->handle,
+				   lhandle->buf +
+				   lhandle->buf_pos *
+				   lhandle->frame_size, r);
+		if (r <= 0) {
+			if (r == -EPIPE) {
+				if ((err = xrun(lhandle)) < 0)
+					return err;
+				return res;
+			} else if (r == -ESTRPIPE) {
+			}
+			return res > 0 ? res : r;
+		}
+#ifdef FILE_PWRITE
+		if (lhandle->loopback->pfile)
+			fwrite(lhandle->buf + lhandle->buf_pos * lhandle->frame_size,
+			       r, lhandle->frame_size, lhandle->loopback->pfile);
+#endif
+		res += r;
+		lhandle->counter += r;
+		lhandle->buf_count -= r;
+		lhandle->buf_pos += r;
+		lhandle->buf_pos %= lhandle->buf_size;
+		xrun_profile(lhandle->loopback);
+		if (check_stop_pending(lhandle->loopback, r))
+			break;
+	}
+	return res;
+}
+
+/*
+ * Split mode: the capture half runs on its own thread and both halves
+ * exchange samples through a lock-free single producer / single consumer
+ * ring living in the common (shared) buffer. The indexes are free running
+ * frame counters, each one is written only by one thread, and they are
+ * kept on separate cache lines to avoid false sharing.
+ */
+
+#define CACHELINE_SIZE	64
+
+struct loopback_ring {
+	/* written by the capture thread */
+	snd_pcm_uframes_t head __attribute__((aligned(CACHELINE_SIZE)));
+	snd_pcm_sframes_t capt_delay;	/* last capture PCM delay */
+	int error;			/* capture thread failed */
+	/* written by the playback thread */
+	snd_pcm_uframes_t tail __attribute__((aligned(CACHELINE_SIZE)));
+	int quit;
+	/* constant while running */
+	char *buf __attribute__((aligned(CACHELINE_SIZE)));
+	snd_pcm_uframes_t size;
+	char *silence;			/* one playback period */
+	int wakeup[2];			/* stop request pipe */
+	unsigned int thread_running:1;
+	pthread_t thread;
+};
+
+static inline snd_pcm_uframes_t ring_fill(struct loopback_ring *ring)
+{
+	snd_pcm_uframes_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+static inline snd_pcm_sframes_t ring_capt_delay(struct loopback_ring *ring)
+{
+	return __atomic_load_n(&ring->capt_delay, __ATOMIC_RELAXED);
+}
+
+static int split_capture_xrun(struct loopback_handle *capt, int err)
+{
+	logit(LOG_DEBUG, "overrun for %s\n", capt->id);
+	if (err == -ESTRPIPE) {
+		while ((err = snd_pcm_resume(capt->handle)) == -EAGAIN)
+			usleep(1);
+		if (err >= 0)
+			return 0;
+	}
+	if ((err = snd_pcm_prepare(capt->handle)) < 0)
+		return err;
+	return snd_pcm_start(capt->handle);
+}
+
+/* capture thread: PCM -> ring */
+static int split_readit(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_ring *ring = loop->ring;
+	snd_pcm_uframes_t head, space, pos;
+	snd_pcm_sframes_t avail, r, res = 0, delay;
+
+	avail = snd_pcm_avail_update(capt->handle);
+	if (avail == -EPIPE || avail == -ESTRPIPE)
+		return split_capture_xrun(capt, avail);
+	head = ring->head;
+	space = ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+	if (avail > (snd_pcm_sframes_t)space) {
+		/* playback is stalled, leave the rest in the driver */
+		capt->buf_over += avail - space;
+		avail = space;
+	}
+	while (avail > 0) {
+		pos = head % ring->size;
+		r = avail;
+		if (pos + r > ring->size)
+			r = ring->size - pos;
+		r = snd_pcm_readi(capt->handle,
+				  ring->buf + pos * capt->frame_size, r);
+		if (r == 0)
+			break;
+		if (r < 0) {
+			if (r == -EPIPE || r == -ESTRPIPE)
+				return split_capture_xrun(capt, r);
+			return r;
+		}
+		effects_apply(loop, pos, r);
+		head += r;
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		capt->counter += r;
+		res += r;
+		avail -= r;
+	}
+	if (snd_pcm_delay(capt->handle, &delay) >= 0)
+		__atomic_store_n(&ring->capt_delay, delay, __ATOMIC_RELAXED);
+	return res;
+}
+
+static void *split_capture_thread(void *arg)
+{
+	struct loopback *loop = arg;
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_ring *ring = loop->ring;
+	struct pollfd *pfds;
+	unsigned short revents;
+	sigset_t mask;
+	int err, count = capt->pollfd_count + 1;
+
+	/* signals are handled by the job threads */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	pfds = calloc(count, sizeof(struct pollfd));
+	if (pfds == NULL) {
+		err = -ENOMEM;
+		goto __error;
+	}
+	while (!__atomic_load_n(&ring->quit, __ATOMIC_ACQUIRE)) {
+		pfds[0].fd = ring->wakeup[0];
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		err = snd_pcm_poll_descriptors(capt->handle, pfds + 1,
+					       capt->pollfd_count);
+		if (err < 0)
+			goto __error;
+		if (poll(pfds, count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			goto __error;
+		}
+		if (pfds[0].revents)
+			break;
+		err = snd_pcm_poll_descriptors_revents(capt->handle, pfds + 1,
+						       capt->pollfd_count,
+						       &revents);
+		if (err < 0)
+			goto __error;
+		if (revents == 0)
+			continue;
+		if ((err = split_readit(loop)) < 0)
+			goto __error;
+	}
+	free(pfds);
+	return NULL;
+      __error:
+	logit(LOG_CRIT, "%s: capture thread failed: %s\n", capt->id, snd_strerror(err));
+	free(pfds);
+	__atomic_store_n(&ring->error, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int split_playback_xrun(struct loopback *loop, int err)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_ring *ring = loop->ring;
+	snd_pcm_sframes_t fill, lat, diff, r;
+
+	if (err == -ESTRPIPE)
+		err = suspend(play);
+	else
+		err = xrun(play);
+	if (err < 0)
+		return err;
+	if (!play->xrun_pending)
+		return 0;
+	/* rebuild the latency with silence, the ring keeps the samples */
+	fill = ring_fill(ring) + ring_capt_delay(ring);
+	lat = get_whole_latency(loop) / play->pitch;
+	diff = lat > fill ? lat - fill : 0;
+	if (diff > (snd_pcm_sframes_t)play->buffer_size)
+		diff = play->buffer_size;
+	while (diff > 0) {
+		r = diff;
+		if (r > (snd_pcm_sframes_t)play->period_size)
+			r = play->period_size;
+		r = snd_pcm_writei(play->handle, ring->silence, r);
+		if (r < 0)
+			return r;
+		diff -= r;
+	}
+	return 0;
+}
+
+/* playback thread: ring -> PCM */
+static int split_writeit(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_ring *ring = loop->ring;
+	snd_pcm_uframes_t tail, pos;
+	snd_pcm_sframes_t avail, count, r, res = 0;
+	int err;
+
+      __again:
+	avail = snd_pcm_avail_update(play->handle);
+	if (avail == -EPIPE || avail == -ESTRPIPE) {
+		if ((err = split_playback_xrun(loop, avail)) < 0)
+			return err;
+		goto __again;
+	}
+	tail = ring->tail;
+	count = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	if (avail > count)
+		avail = count;
+	while (avail > 0) {
+		pos = tail % ring->size;
+		r = avail;
+		if (pos + r > ring->size)
+			r = ring->size - pos;
+		r = snd_pcm_writei(play->handle,
+				   ring->buf + pos * play->frame_size, r);
+		if (r <= 0) {
+			if (r == -EPIPE || r == -ESTRPIPE) {
+				if ((err = split_playback_xrun(loop, r)) < 0)
+					return err;
+				goto __again;
+			}
+			if (r < 0 && res == 0)
+				return r;
+			break;
+		}
+		tail += r;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		play->counter += r;
+		res += r;
+		avail -= r;
+		if (check_stop_pending(loop, r))
+			break;
+	}
+	if (play->xrun_pending) {
+		play->xrun_pending = 0;
+		if ((err = snd_pcm_start(play->handle)) < 0) {
+			logit(LOG_CRIT, "%s start failed: %s\n", play->id, snd_strerror(err));
+			return err;
+		}
+	}
+	return res;
+}
+
+static int split_init(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_ring *ring;
+	void *ptr;
+
+	if (play->buf != loop->capt->buf) {
+		logit(LOG_CRIT, "%s: split threads require same access, format, rate and channels for both streams\n", loop->id);
+		return -EINVAL;
+	}
+	if (posix_memalign(&ptr, CACHELINE_SIZE, sizeof(*ring)))
+		return -ENOMEM;
+	ring = ptr;
+	memset(ring, 0, sizeof(*ring));
+	ring->wakeup[0] = ring->wakeup[1] = -1;
+	ring->buf = play->buf;
+	ring->size = play->buf_size;
+	ring->silence = malloc(play->period_size * play->frame_size);
+	if (ring->silence == NULL) {
+		free(ring);
+		return -ENOMEM;
+	}
+	snd_pcm_format_set_silence(play->format, ring->silence,
+				   play->period_size * play->channels);
+	if (pipe(ring->wakeup) < 0) {
+		free(ring->silence);
+		free(ring);
+		return -errno;
+	}
+	loop->ring = ring;
+	return 0;
+}
+
+static int split_start(struct loopback *loop)
+{
+	struct loopback_ring *ring = loop->ring;
+	int err;
+
+	err = pthread_create(&ring->thread, NULL, split_capture_thread, loop);
+	if (err) {
+		logit(LOG_CRIT, "%s: unable to create capture thread: %s\n", loop->id, strerror(err));
+		return -err;
+	}
+	ring->thread_running = 1;
+	return 0;
+}
+
+static void split_stop(struct loopback *loop)
+{
+	struct loopback_ring *ring = loop->ring;
+	char c = 0;
+
+	if (ring == NULL || !ring->thread_running)
+		return;
+	__atomic_store_n(&ring->quit, 1, __ATOMIC_RELEASE);
+	if (write(ring->wakeup[1], &c, 1) != 1)
+		logit(LOG_WARNING, "%s: capture thread wakeup failed\n", loop->id);
+	pthread_join(ring->thread, NULL);
+	ring->thread_running = 0;
+}
+
+static void split_done(struct loopback *loop)
+{
+	struct loopback_ring *ring = loop->ring;
+
+	if (ring == NULL)
+		return;
+	split_stop(loop);
+	if (ring->wakeup[0] >= 0)
+		close(ring->wakeup[0]);
+	if (ring->wakeup[1] >= 0)
+		close(ring->wakeup[1]);
+	free(ring->silence);
+	free(ring);
+	loop->ring = NULL;
+}
+
+/*
+ * Direct mode: both PCMs use the mmap access and the samples are copied
+ * from the capture DMA area to the playback DMA area in one pass, there
+ * is no intermediate buffer. The simple sync drift correction is done
+ * in the copy by dropping or repeating single frames.
+ */
+
+static int direct_xrun(struct loopback_handle *lhandle, int err)
+{
+	struct loopback *loop = lhandle->loopback;
+
+	if (err != -EPIPE && err != -ESTRPIPE)
+		return err;
+	logit(LOG_DEBUG, "%s for %s\n", lhandle == loop->play ? "underrun" : "overrun", lhandle->id);
+	xrun_stats(loop);
+	/* nothing is buffered here, restart both streams */
+	loop->reinit = 1;
+	return 0;
+}
+
+/* queue the initial latency as silence */
+static int direct_fill(struct loopback *loop, snd_pcm_uframes_t count)
+{
+	struct loopback_handle *play = loop->play;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t r, res = 0;
+	int err;
+
+	play->buf_count = 0;
+	if (count > play->buffer_size)
+		count = play->buffer_size;
+	if ((r = snd_pcm_avail_update(play->handle)) < 0)
+		return r;
+	while (count > 0) {
+		frames = count;
+		err = snd_pcm_mmap_begin(play->handle, &areas, &offset, &frames);
+		if (err < 0)
+			return err;
+		if (frames == 0)
+			break;
+		snd_pcm_areas_silence(areas, offset, play->channels,
+				      frames, play->format);
+		r = snd_pcm_mmap_commit(play->handle, offset, frames);
+		if (r < 0)
+			return r;
+		res += r;
+		count -= r;
+		if ((snd_pcm_uframes_t)r != frames)
+			break;
+	}
+	return res;
+}
+
+static int direct_copy(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	const snd_pcm_channel_area_t *careas, *pareas;
+	snd_pcm_uframes_t coff, poff, cframes, pframes, n, ccount, pcount;
+	snd_pcm_sframes_t cavail, pavail, r, res = 0;
+	int err;
+
+	cavail = snd_pcm_avail_update(capt->handle);
+	if (cavail < 0)
+		return direct_xrun(capt, cavail);
+	pavail = snd_pcm_avail_update(play->handle);
+	if (pavail < 0)
+		return direct_xrun(play, pavail);
+	if (cavail == 0 &&
+	    snd_pcm_state(capt->handle) == SND_PCM_STATE_DRAINING) {
+		loop->reinit = 1;
+		return 0;
+	}
+	/* when the playback is full, the rest stays in the capture buffer */
+	while (cavail > 0 && pavail > 0) {
+		cframes = cavail;
+		err = snd_pcm_mmap_begin(capt->handle, &careas, &coff, &cframes);
+		if (err < 0)
+			return direct_xrun(capt, err);
+		pframes = pavail;
+		err = snd_pcm_mmap_begin(play->handle, &pareas, &poff, &pframes);
+		if (err < 0)
+			return direct_xrun(play, err);
+		n = cframes < pframes ? cframes : pframes;
+		if (n == 0)
+			break;
+		ccount = pcount = n;
+		if (loop->direct_drift >= 1.0) {
+			/* drop one frame */
+			if (cframes > n)
+				ccount++;
+			else if (n > 1)
+				pcount--;
+		} else if (loop->direct_drift <= -1.0) {
+			/* repeat one frame */
+			if (pframes > n)
+				pcount++;
+			else if (n > 1)
+				ccount--;
+		}
+		n = ccount < pcount ? ccount : pcount;
+		snd_pcm_areas_copy(pareas, poff, careas, coff,
+				   play->channels, n, play->format);
+		if (pcount > ccount)
+			snd_pcm_areas_copy(pareas, poff + n, careas, coff + n - 1,
+					   play->channels, 1, play->format);
+		loop->direct_drift -= (double)ccount - (double)pcount;
+		r = snd_pcm_mmap_commit(capt->handle, coff, ccount);
+		if (r < 0 || (snd_pcm_uframes_t)r != ccount)
+			return direct_xrun(capt, r < 0 ? r : -EPIPE);
+		r = snd_pcm_mmap_commit(play->handle, poff, pcount);
+		if (r < 0 || (snd_pcm_uframes_t)r != pcount)
+			return direct_xrun(play, r < 0 ? r : -EPIPE);
+		if (loop->sync == SYNC_TYPE_SIMPLE) {
+			loop->direct_drift += (loop->pitch - 1.0) * ccount;
+			/* do not accumulate corrections which were not possible */
+			if (loop->direct_drift > 2.0)
+				loop->direct_drift = 2.0;
+			else if (loop->direct_drift < -2.0)
+				loop->direct_drift = -2.0;
+		}
+		if (capt->max < ccount)
+			capt->max = ccount;
+		capt->counter += ccount;
+		play->counter += pcount;
+		cavail -= ccount;
+		pavail -= pcount;
+		res += pcount;
+		xrun_profile(loop);
+		if (check_stop_pending(loop, pcount))
+			break;
+	}
+	return res;
+}
+
+#ifdef USE_AUDIO_TSTAMP
+/*
+ * The link audio timestamp runs on the device clock. Two audio/system
+ * timestamp pairs give the device to system clock ratio, which is used
+ * when the delay is moved in time.
+ */
+static void update_tstamp_ratio(struct loopback_handle *lhandle,
+				snd_pcm_status_t *status, double tstamp)
+{
+	snd_pcm_audio_tstamp_report_t report;
+	snd_htimestamp_t ts;
+	double atstamp, dt, ratio;
+
+	snd_pcm_status_get_audio_htstamp_report(status, &report);
+	if (!report.valid ||
+	    report.actual_type != SND_PCM_AUDIO_TSTAMP_TYPE_LINK)
+		return;
+	lhandle->audio_tstamp = 1;
+	snd_pcm_status_get_audio_htstamp(status, &ts);
+	atstamp = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	dt = tstamp - lhandle->tstamp_last;
+	if (lhandle->tstamp_last > 0 && dt < 1.0)
+		return;
+	if (lhandle->tstamp_last > 0 && dt < 10.0) {
+		ratio = (atstamp - lhandle->atstamp_last) / dt;
+		/* the audio timestamp restarts with the stream */
+		if (fabs(ratio - 1.0) < PLL_DEFAULT_LIMIT)
+			lhandle->tstamp_ratio += (ratio - lhandle->tstamp_ratio) / 8;
+	}
+	lhandle->tstamp_last = tstamp;
+	lhandle->atstamp_last = atstamp;
+}
+#endif
+
+/*
+ * Read the delay together with the system time of the hardware
+ * pointer update. The time is zero when the stream does not move
+ * or the timestamps are not used.
+ */
+static int get_status(struct loopback_handle *lhandle,
+		      snd_pcm_status_t *status,
+		      snd_pcm_sframes_t *delay,
+		      double *tstamp)
+{
+	snd_htimestamp_t ts;
+	int err;
+
+	/* the simulated devices run on the virtual clock */
+	if (sim_time(tstamp) == 0 || (workarounds & WORKAROUND_NOTSTAMP)) {
+		if ((err = snd_pcm_delay(lhandle->handle, delay)) < 0)
+			return err;
+		if (!sim_enabled())
+			*tstamp = 0;
+		lhandle->last_delay = *delay;
+		return 0;
+	}
+#ifdef USE_AUDIO_TSTAMP
+	{
+		snd_pcm_audio_tstamp_config_t config;
+
+		memset(&config, 0, sizeof(config));
+		config.type_requested = SND_PCM_AUDIO_TSTAMP_TYPE_LINK;
+		snd_pcm_status_set_audio_htstamp_config(status, &config);
+	}
+#endif
+	if ((err = snd_pcm_status(lhandle->handle, status)) < 0)
+		return err;
+	*tstamp = 0;
+	switch (snd_pcm_status_get_state(status)) {
+	case SND_PCM_STATE_XRUN:
+		return -EPIPE;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	case SND_PCM_STATE_RUNNING:
+	case SND_PCM_STATE_DRAINING:
+		snd_pcm_status_get_htstamp(status, &ts);
+		*tstamp = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#ifdef USE_AUDIO_TSTAMP
+		if (*tstamp > 0)
+			update_tstamp_ratio(lhandle, status, *tstamp);
+#endif
+		break;
+	default:
+		break;
+	}
+	*delay = snd_pcm_status_get_delay(status);
+	lhandle->last_delay = *delay;
+	return 0;
 }
 
-static int writeit(struct loopback_handle *lhandle)
+/*
+ * Move both delays to the later status instant, the playback delay
+ * shrinks and the capture delay grows meanwhile. Returns the common
+ * instant or zero when the delays cannot be aligned.
+ */
+static double align_delays(struct loopback *loop,
+			   snd_pcm_sframes_t *pdelay, double ptstamp,
+			   snd_pcm_sframes_t *cdelay, double ctstamp)
 {
-	snd_pcm_sframes_t avail;
-	snd_pcm_sframes_t r, res = 0;
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	double now, skew;
+
+	if (ptstamp <= 0 || ctstamp <= 0)
+		goto __fallback;
+	now = ptstamp > ctstamp ? ptstamp : ctstamp;
+	skew = fabs(ptstamp - ctstamp);
+	/* stale timestamp, do not trust it */
+	if (skew * play->rate > play->buffer_size ||
+	    skew * capt->rate > capt->buffer_size)
+		goto __fallback;
+	*pdelay -= lrint((now - ptstamp) * play->rate * play->tstamp_ratio);
+	*cdelay += lrint((now - ctstamp) * capt->rate * capt->tstamp_ratio);
+	if (loop->queued_skew < skew * 1000000)
+		loop->queued_skew = skew * 1000000;
+	return now;
+
+      __fallback:
+	if (!sim_enabled())
+		loop->queued_fallbacks++;
+	return 0;
+}
+
+/*
+ * The whole queue (device delays and buffered samples) for both
+ * directions at one instant.
+ */
+static int get_queued_samples(struct loopback *loop,
+			      snd_pcm_sframes_t *pqueued,
+			      snd_pcm_sframes_t *cqueued,
+			      double *now)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_status_t *status;
+	double ptstamp, ctstamp;
 	int err;
 
-      __again:
-	avail = snd_pcm_avail_update(lhandle->handle);
-	if (avail == -EPIPE) {
-		if ((err = xrun(lhandle)) < 0)
-			return err;
-		return res;
-	} else if (avail == -ESTRPIPE) {
-		if ((err = suspend(lhandle)) < 0)
+	snd_pcm_status_alloca(&status);
+	if ((err = get_status(play, status, pqueued, &ptstamp)) < 0)
+		return err;
+	if (loop->ring) {
+		/* consistent snapshot of the ring, capture delay is published */
+		*pqueued += ring_fill(loop->ring);
+		*cqueued = ring_capt_delay(loop->ring);
+		ctstamp = ptstamp;
+	} else {
+		if ((err = get_status(capt, status, cqueued, &ctstamp)) < 0)
 			return err;
-		goto __again;
+		*pqueued += play->buf_count;
+		if (play->buf != capt->buf)
+			*cqueued += capt->buf_count;
 	}
-	while (avail > 0 && lhandle->buf_count > 0) {
-		r = lhandle->buf_count;
-		if (r + lhandle->buf_pos > lhandle->buf_size)
-			r = lhandle->buf_size - lhandle->buf_pos;
-		if (r > avail)
-			r = avail;
-		r = snd_pcm_writei(lhandle->handle,
-				   lhandle->buf +
-				   lhandle->buf_pos *
-				   lhandle->frame_size, r);
-		if (r <= 0) {
-			if (r == -EPIPE) {
-				if ((err = xrun(lhandle)) < 0)
-					return err;
-				return res;
-			} else if (r == -ESTRPIPE) {
-			}
-			return res > 0 ? res : r;
-		}
-#ifdef FILE_PWRITE
-		if (lhandle->loopback->pfile)
-			fwrite(lhandle->buf + lhandle->buf_pos * lhandle->frame_size,
-			       r, lhandle->frame_size, lhandle->loopback->pfile);
+#ifdef USE_SAMPLERATE
+	*pqueued += loop->src_out_frames;
 #endif
-		res += r;
-		lhandle->counter += r;
-		lhandle->buf_count -= r;
-		lhandle->buf_pos += r;
-		lhandle->buf_pos %= lhandle->buf_size;
-		xrun_profile(lhandle->loopback);
-		if (lhandle->loopback->stop_pending) {
-			lhandle->loopback->stop_count += r;
-			if (lhandle->loopback->stop_count * lhandle->pitch >
-			    lhandle->loopback->latency * 3) {
-				lhandle->loopback->stop_pending = 0;
-				lhandle->loopback->reinit = 1;
-				break;
-			}
-		}
-	}
-	return res;
+	*now = align_delays(loop, pqueued, ptstamp, cqueued, ctstamp);
+	if (*now <= 0 && sim_time(now) < 0)
+		*now = clock_now();
+	return 0;
 }
 
 static snd_pcm_sframes_t remove_samples(struct loopback *loop,
@@ -765,6 +1902,9 @@ static snd_pcm_sframes_t remove_samples(struct loopback *loop,
 	struct loopback_handle *play = loop->play;
 	struct loopback_handle *capt = loop->capt;
 
+	/* mixed samples cannot be taken back */
+	if (is_shared(play))
+		capture_preferred = 1;
 	if (loop->play->buf == loop->capt->buf) {
 		if (count > loop->play->buf_count)
 			count = loop->play->buf_count;
@@ -794,14 +1934,19 @@ static int xrun_sync(struct loopback *loop)
 	struct loopback_handle *capt = loop->capt;
 	snd_pcm_uframes_t fill = get_whole_latency(loop);
 	snd_pcm_sframes_t pdelay, cdelay, delay1, pdelay1, cdelay1, diff;
+	snd_pcm_status_t *status;
+	double ptstamp, ctstamp;
 	int err;
 
+	snd_pcm_status_alloca(&status);
       __again:
 	if (verbose > 5)
 		snd_output_printf(loop->output, "%s: xrun sync %i %i\n", loop->id, capt->xrun_pending, play->xrun_pending);
 	if (capt->xrun_pending) {
 	      __pagain:
 		capt->xrun_pending = 0;
+		if (!share_owner(capt))
+			goto __cdelay;
 		if ((err = snd_pcm_prepare(capt->handle)) < 0) {
 			logit(LOG_CRIT, "%s prepare failed: %s\n", capt->id, snd_strerror(err));
 			return err;
@@ -816,8 +1961,9 @@ static int xrun_sync(struct loopback *loop)
 		if (capt->xrun_pending)
 			goto __pagain;
 	}
+      __cdelay:
 	/* skip additional playback samples */
-	if ((err = snd_pcm_delay(capt->handle, &cdelay)) < 0) {
+	if ((err = get_status(capt, status, &cdelay, &ctstamp)) < 0) {
 		if (err == -EPIPE) {
 			capt->xrun_pending = 1;
 			goto __again;
@@ -831,9 +1977,10 @@ static int xrun_sync(struct loopback *loop)
 		logit(LOG_CRIT, "%s capture delay failed: %s\n", capt->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0) {
+	if ((err = get_status(play, status, &pdelay, &ptstamp)) < 0) {
 		if (err == -EPIPE) {
 			pdelay = 0;
+			ptstamp = 0;
 			play->xrun_pending = 1;
 		} else if (err == -ESTRPIPE) {
 			err = suspend(play);
@@ -847,6 +1994,7 @@ static int xrun_sync(struct loopback *loop)
 	}
 	capt->counter = cdelay;
 	play->counter = pdelay;
+	align_delays(loop, &pdelay, ptstamp, &cdelay, ctstamp);
 	if (play->buf != capt->buf)
 		cdelay += capt->buf_count;
 	pdelay += play->buf_count;
@@ -877,7 +2025,7 @@ static int xrun_sync(struct loopback *loop)
 			"sync: cbufcount=%li, pbufcount=%li\n",
 			(long)capt->buf_count, (long)play->buf_count);
 	}
-	if (delay1 > fill && capt->counter > 0) {
+	if (delay1 > fill && capt->counter > 0 && !is_shared(capt)) {
 		if ((err = snd_pcm_drop(capt->handle)) < 0)
 			return err;
 		if ((err = snd_pcm_prepare(capt->handle)) < 0)
@@ -920,7 +2068,22 @@ static int xrun_sync(struct loopback *loop)
 			snd_output_printf(loop->output,
 				"sync: removed %li captured samples, delay1=%li\n", (long)diff, (long)delay1);
 	}
-	if (play->xrun_pending) {
+	if (play->xrun_pending && is_shared(play)) {
+		play->xrun_pending = 0;
+		if (share_owner(play) &&
+		    (err = snd_pcm_prepare(play->handle)) < 0) {
+			logit(LOG_CRIT, "%s prepare failed: %s\n", play->id, snd_strerror(err));
+			return err;
+		}
+		/* silence for this leg means just moving the cursor */
+		if (fill > delay1) {
+			diff = (fill - delay1) / play->pitch;
+			play->buf_count += diff;
+			if (play->buf_count > play->buf_size)
+				play->buf_count = play->buf_size;
+		}
+		writeit(play);
+	} else if (play->xrun_pending) {
 		play->xrun_pending = 0;
 		diff = (fill - delay1) / play->pitch;
 		if (verbose > 6)
@@ -956,6 +2119,12 @@ static int xrun_sync(struct loopback *loop)
 			logit(LOG_CRIT, "%s start failed: %s\n", play->id, snd_strerror(err));
 			return err;
 		}
+	} else if (delay1 < fill && is_shared(play)) {
+		diff = (fill - delay1) / play->pitch;
+		play->buf_count += diff;
+		if (play->buf_count > play->buf_size)
+			play->buf_count = play->buf_size;
+		writeit(play);
 	} else if (delay1 < fill) {
 		diff = (fill - delay1) / play->pitch;
 		while (diff > 0) {
@@ -994,6 +2163,8 @@ static int xrun_sync(struct loopback *loop)
 		}
 	}
 	loop->xrun_max_proctime = 0;
+	/* the queue was refilled, do not integrate over the gap */
+	loop->pll.valid = 0;
 	return 0;
 }
 
@@ -1022,7 +2193,7 @@ static int set_rate_shift(struct loopback_handle *lhandle, double pitch)
 	int err;
 
 	if (lhandle->ctl_rate_shift == NULL)
-		return 0;
+		return sim_enabled() ? sim_rate_shift(lhandle, pitch) : 0;
 	snd_ctl_elem_value_set_integer(lhandle->ctl_rate_shift, 0, pitch * 100000);
 	err = snd_ctl_elem_write(lhandle->ctl, lhandle->ctl_rate_shift);
 	if (err < 0) {
@@ -1068,7 +2239,7 @@ void update_pitch(struct loopback *loop)
 		}
 #endif
 	}
-	if (verbose)
+	if (verbose > (loop->pll.bandwidth > 0 ? 3 : 0))
 		snd_output_printf(loop->output, "New pitch for %s: %.8f (min/max samples = %li/%li)\n", loop->id, pitch, loop->pitch_diff_min, loop->pitch_diff_max);
 }
 
@@ -1197,13 +2368,29 @@ static int openit(struct loopback_handle *lhandle)
 				SND_PCM_STREAM_PLAYBACK :
 				SND_PCM_STREAM_CAPTURE;
 	int err, card, device, subdevice;
-	pcm_open_lock();
-	err = snd_pcm_open(&lhandle->handle, lhandle->device, stream, SND_PCM_NONBLOCK);
-	pcm_open_unlock();
+
+	if (lhandle->share && lhandle->share->opened > 0) {
+		lhandle->share->opened++;
+		lhandle->handle = lhandle->share->handle;
+		lhandle->card_number = lhandle->share->card_number;
+		lhandle->ctl = NULL;
+		return 0;
+	}
+	card = device_card(lhandle->device);
+	pcm_open_lock(card);
+	if (sim_enabled())
+		err = sim_open(&lhandle->handle, lhandle, stream);
+	else
+		err = snd_pcm_open(&lhandle->handle, lhandle->device, stream, SND_PCM_NONBLOCK);
+	pcm_open_unlock(card);
 	if (err < 0) {
 		logit(LOG_CRIT, "%s open error: %s\n", lhandle->id, snd_strerror(err));
 		return err;
 	}
+	if (lhandle->share) {
+		lhandle->share->opened = 1;
+		lhandle->share->handle = lhandle->handle;
+	}
 	if ((err = snd_pcm_info_malloc(&info)) < 0)
 		return err;
 	if ((err = snd_pcm_info(lhandle->handle, info)) < 0) {
@@ -1216,15 +2403,22 @@ static int openit(struct loopback_handle *lhandle)
 	snd_pcm_info_free(info);
 	lhandle->card_number = card;
 	lhandle->ctl = NULL;
+	if (lhandle->share) {
+		/* no per-leg rate shift or slave mode on shared PCMs */
+		lhandle->share->card_number = card;
+		return 0;
+	}
 	if (card >= 0 || lhandle->ctldev) {
 		char name[16], *dev = lhandle->ctldev;
 		if (dev == NULL) {
 			sprintf(name, "hw:%i", card);
 			dev = name;
 		}
-		pcm_open_lock();
+		if (lhandle->ctldev)
+			card = device_card(dev);
+		pcm_open_lock(card);
 		err = snd_ctl_open(&lhandle->ctl, dev, SND_CTL_NONBLOCK);
-		pcm_open_unlock();
+		pcm_open_unlock(card);
 		if (err < 0) {
 			logit(LOG_CRIT, "%s [%s] ctl open error: %s\n", lhandle->id, dev, snd_strerror(err));
 			lhandle->ctl = NULL;
@@ -1237,43 +2431,119 @@ static int openit(struct loopback_handle *lhandle)
 
 static int freeit(struct loopback_handle *lhandle)
 {
-	free(lhandle->buf);
+	/* the shared ring is released in share_stop(), the pool is
+	   kept for the next start and released in pcmjob_done() */
 	lhandle->buf = NULL;
 	return 0;
 }
 
+static void freepool(struct loopback_handle *lhandle)
+{
+	free(lhandle->pool);
+	lhandle->pool = NULL;
+	lhandle->pool_size = 0;
+}
+
+static void ctl_elem_free(snd_ctl_elem_value_t **elem)
+{
+	if (*elem)
+		snd_ctl_elem_value_free(*elem);
+	*elem = NULL;
+}
+
 static int closeit(struct loopback_handle *lhandle)
 {
 	int err = 0;
 
 	set_rate_shift(lhandle, 1);
-	if (lhandle->ctl_rate_shift)
-		snd_ctl_elem_value_free(lhandle->ctl_rate_shift);
-	lhandle->ctl_rate_shift = NULL;
+	ctl_elem_free(&lhandle->ctl_rate_shift);
+	ctl_elem_free(&lhandle->ctl_notify);
+	ctl_elem_free(&lhandle->ctl_active);
+	ctl_elem_free(&lhandle->ctl_format);
+	ctl_elem_free(&lhandle->ctl_rate);
+	ctl_elem_free(&lhandle->ctl_channels);
 	if (lhandle->ctl)
 		err = snd_ctl_close(lhandle->ctl);
 	lhandle->ctl = NULL;
+	if (lhandle->share && lhandle->handle) {
+		if (--lhandle->share->opened > 0) {
+			lhandle->handle = NULL;
+			return 0;
+		}
+		lhandle->share->handle = NULL;
+	}
 	if (lhandle->handle)
 		err = snd_pcm_close(lhandle->handle);
 	lhandle->handle = NULL;
 	return err;
 }
 
+/* the common ring must hold the biggest latency of all legs */
+static int init_handle_shared(struct loopback_handle *lhandle)
+{
+	struct loopback_share *share = lhandle->share;
+	struct loopback *loop;
+	snd_pcm_uframes_t lat, lat1;
+	int i;
+
+	if (share->buf == NULL) {
+		lat = lhandle->buffer_size;
+		for (i = 0; i < share->handles_count; i++) {
+			loop = share->handles[i]->loopback;
+			if (loop->latency_req)
+				lat1 = loop->latency_req;
+			else
+				lat1 = time_to_frames(lhandle->rate,
+						      loop->latency_reqtime);
+			lat1 = lat1 / lhandle->pitch + lhandle->buffer_size;
+			if (lat1 > lat)
+				lat = lat1;
+		}
+		share->buf_size = lat * 2;
+		share->buf_pos = 0;
+		share->buf = malloc(share->buf_size * lhandle->frame_size);
+		if (share->buf == NULL)
+			return -ENOMEM;
+		snd_pcm_format_set_silence(lhandle->format, share->buf,
+					   share->buf_size * lhandle->channels);
+	}
+	lhandle->buf = share->buf;
+	lhandle->buf_size = share->buf_size;
+	return 0;
+}
+
+/* the pool grows only, a restart with a smaller buffer reuses it */
+static int alloc_buf(struct loopback_handle *lhandle)
+{
+	size_t size = lhandle->buf_size * lhandle->frame_size;
+	char *nbuf;
+
+	if (lhandle->pool_size < size) {
+		nbuf = malloc(size);
+		if (nbuf == NULL)
+			return -ENOMEM;
+		free(lhandle->pool);
+		lhandle->pool = nbuf;
+		lhandle->pool_size = size;
+	}
+	lhandle->buf = lhandle->pool;
+	return 0;
+}
+
 static int init_handle(struct loopback_handle *lhandle, int alloc)
 {
 	snd_pcm_uframes_t lat;
 	lhandle->frame_size = (snd_pcm_format_physical_width(lhandle->format) 
 						/ 8) * lhandle->channels;
 	lhandle->sync_point = lhandle->rate * 15;	/* every 15 seconds */
+	if (lhandle->share)
+		return init_handle_shared(lhandle);
 	lat = lhandle->loopback->latency;
 	if (lhandle->buffer_size > lat)
 		lat = lhandle->buffer_size;
 	lhandle->buf_size = lat * 2;
-	if (alloc) {
-		lhandle->buf = calloc(1, lhandle->buf_size * lhandle->frame_size);
-		if (lhandle->buf == NULL)
-			return -ENOMEM;
-	}
+	if (alloc)
+		return alloc_buf(lhandle);
 	return 0;
 }
 
@@ -1282,6 +2552,7 @@ int pcmjob_init(struct loopback *loop)
 	int err;
 	char id[128];
 
+	loop->released = 0;
 #ifdef FILE_CWRITE
 	loop->cfile = fopen(FILE_CWRITE, "w+");
 #endif
@@ -1300,11 +2571,37 @@ int pcmjob_init(struct loopback *loop)
 	if (loop->sync == SYNC_TYPE_AUTO && loop->play->ctl_rate_shift)
 		loop->sync = SYNC_TYPE_PLAYRATESHIFT;
 #ifdef USE_SAMPLERATE
-	if (loop->sync == SYNC_TYPE_AUTO && loop->src_enable)
+	if (loop->sync == SYNC_TYPE_AUTO && loop->src_enable &&
+	    !loop->split && !loop->direct)
 		loop->sync = SYNC_TYPE_SAMPLERATE;
 #endif
 	if (loop->sync == SYNC_TYPE_AUTO)
-		loop->sync = SYNC_TYPE_SIMPLE;
+		loop->sync = loop->split ? SYNC_TYPE_NONE : SYNC_TYPE_SIMPLE;
+	if (loop->split) {
+		/* both would modify the ring from the playback side */
+		if (loop->sync == SYNC_TYPE_SIMPLE ||
+		    loop->sync == SYNC_TYPE_SAMPLERATE) {
+			logit(LOG_CRIT, "%s: %s sync cannot be used with split threads\n", loop->id, sync_types[loop->sync]);
+			err = -EINVAL;
+			goto __error;
+		}
+		if (is_shared(loop->play) || is_shared(loop->capt)) {
+			logit(LOG_CRIT, "%s: shared devices cannot be used with split threads\n", loop->id);
+			err = -EINVAL;
+			goto __error;
+		}
+	}
+	if (loop->direct) {
+		if (loop->sync == SYNC_TYPE_SAMPLERATE || loop->split ||
+		    is_shared(loop->play) || is_shared(loop->capt) ||
+		    loop->effects) {
+			logit(LOG_CRIT, "%s: direct mode cannot be used with samplerate sync, split threads, shared devices or effects\n", loop->id);
+			err = -EINVAL;
+			goto __error;
+		}
+		loop->play->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+		loop->capt->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	}
 	if (loop->slave == SLAVE_TYPE_AUTO &&
 	    loop->capt->ctl_notify &&
 	    loop->capt->ctl_active &&
@@ -1334,29 +2631,44 @@ int pcmjob_init(struct loopback *loop)
 
 static void freeloop(struct loopback *loop)
 {
-#ifdef USE_SAMPLERATE
-	if (loop->use_samplerate) {
-		if (loop->src_state)
-			src_delete(loop->src_state);
-		loop->src_state = NULL;
-		free(loop->src_data.data_in);
-		loop->src_data.data_in = NULL;
-		free(loop->src_data.data_out);
-		loop->src_data.data_out = NULL;
-	}
-#endif
-	if (loop->play->buf == loop->capt->buf)
-		loop->play->buf = NULL;
+	effects_done(loop);
+	split_done(loop);
 	freeit(loop->play);
 	freeit(loop->capt);
 }
 
+/* release the resources kept over restarts */
+static void freepools(struct loopback *loop)
+{
+#ifdef USE_SAMPLERATE
+	if (loop->src_state)
+		src_delete(loop->src_state);
+	loop->src_state = NULL;
+	free(loop->src_data.data_in);
+	loop->src_data.data_in = NULL;
+	loop->src_in_size = 0;
+	free(loop->src_data.data_out);
+	loop->src_data.data_out = NULL;
+	loop->src_out_size = 0;
+#endif
+	freepool(loop->play);
+	freepool(loop->capt);
+	params_free(loop->play);
+	params_free(loop->capt);
+}
+
 int pcmjob_done(struct loopback *loop)
 {
+	/* a loop disabled at startup is released again at exit or removal */
+	if (loop->released)
+		return 0;
+	loop->released = 1;
+	split_stop(loop);
 	control_done(loop);
 	closeit(loop->play);
 	closeit(loop->capt);
 	freeloop(loop);
+	freepools(loop);
 	free(loop->id);
 	loop->id = NULL;
 #ifdef FILE_PWRITE
@@ -1376,11 +2688,79 @@ int pcmjob_done(struct loopback *loop)
 
 static void lhandle_start(struct loopback_handle *lhandle)
 {
-	lhandle->buf_pos = 0;
+	lhandle->buf_pos = lhandle->share ? lhandle->share->buf_pos : 0;
 	lhandle->buf_count = 0;
 	lhandle->counter = 0;
 	lhandle->total_queued = 0;
+	lhandle->audio_tstamp = 0;
+	lhandle->tstamp_last = 0;
+	lhandle->atstamp_last = 0;
+	lhandle->tstamp_ratio = 1.0;
+}
+
+static void share_start(struct loopback_handle *lhandle)
+{
+	struct loopback_share *share = lhandle->share;
+
+	if (share == NULL || lhandle->share_running)
+		return;
+	if (share->running == 0) {
+		share->owner = lhandle;
+		share->configured = 1;
+		share->start_pending = 0;
+	}
+	share->running++;
+	lhandle->share_running = 1;
+	lhandle->share_pending = 0;
+}
+
+static void share_stop(struct loopback_handle *lhandle)
+{
+	struct loopback_share *share = lhandle->share;
+	int i, err;
+
+	if (share == NULL || !lhandle->share_running)
+		return;
+	lhandle->share_running = 0;
+	if (--share->running > 0) {
+		/* hand the PCM I/O over to another running leg */
+		if (share->owner == lhandle) {
+			for (i = 0; i < share->handles_count; i++) {
+				if (share->handles[i]->share_running) {
+					share->owner = share->handles[i];
+					break;
+				}
+			}
+		}
+		return;
+	}
+	share->owner = NULL;
+	share->configured = 0;
+	if ((err = snd_pcm_drop(lhandle->handle)) < 0)
+		logit(LOG_WARNING, "pcm drop %s error: %s\n", lhandle->id, snd_strerror(err));
+	if ((err = snd_pcm_hw_free(lhandle->handle)) < 0)
+		logit(LOG_WARNING, "pcm hw_free %s error: %s\n", lhandle->id, snd_strerror(err));
+	free(share->buf);
+	share->buf = NULL;
+	share->buf_pos = 0;
+}
+
+#ifdef USE_SAMPLERATE
+static int src_buf(float **buf, size_t *alloc, size_t size)
+{
+	float *nbuf;
+
+	if (*alloc >= size)
+		return 0;
+	nbuf = malloc(size);
+	if (nbuf == NULL)
+		return -ENOMEM;
+	free(*buf);
+	*buf = nbuf;
+	*alloc = size;
+	return 0;
 }
+#endif
 
 static void fix_format(struct loopback *loop, int force)
 {
@@ -1402,7 +2782,8 @@ static void fix_format(struct loopback *loop, int force)
 int pcmjob_start(struct loopback *loop)
 {
 	snd_pcm_uframes_t count;
-	int err;
+	snd_pcm_sframes_t delay;
+	int err, pfirst = 1, cfirst = 1;
 
 	loop->pollfd_count = loop->play->ctl_pollfd_count +
 			     loop->capt->ctl_pollfd_count;
@@ -1445,40 +2826,48 @@ __again:
 	loop->latency = time_to_frames(loop->play->rate_req, loop->latency_reqtime);
 	if ((err = setparams(loop, loop->latency/2)) < 0)
 		goto __error;
+	if (is_shared(loop->play) &&
+	    loop->play->format != SND_PCM_FORMAT_S16 &&
+	    loop->play->format != SND_PCM_FORMAT_S32) {
+		logit(LOG_CRIT, "%s: mixing supports only %s or %s formats\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32));
+		err = -EINVAL;
+		goto __error;
+	}
+	pfirst = !share_configured(loop->play);
+	cfirst = !share_configured(loop->capt);
+	share_start(loop->play);
+	share_start(loop->capt);
 	if (verbose)
 		showlatency(loop->output, loop->latency, loop->play->rate_req, "Latency");
-	if (loop->play->access == loop->capt->access &&
-	    loop->play->format == loop->capt->format &&
-	    loop->play->rate == loop->capt->rate &&
-	    loop->play->channels == loop->play->channels &&
-	    loop->sync != SYNC_TYPE_SAMPLERATE) {
+	if (loop->direct) {
+		if (loop->play->format != loop->capt->format ||
+		    loop->play->rate != loop->capt->rate ||
+		    loop->play->channels != loop->capt->channels) {
+			logit(LOG_CRIT, "%s: direct mode requires same format, rate and channels for both streams\n", loop->id);
+			err = -EINVAL;
+			goto __error;
+		}
+		if ((err = init_handle(loop->play, 0)) < 0)
+			goto __error;
+		if ((err = init_handle(loop->capt, 0)) < 0)
+			goto __error;
+	} else if (!is_shared(loop->play) && !is_shared(loop->capt) &&
+		   loop->play->access == loop->capt->access &&
+		   loop->play->format == loop->capt->format &&
+		   loop->play->rate == loop->capt->rate &&
+		   loop->play->channels == loop->play->channels &&
+		   loop->sync != SYNC_TYPE_SAMPLERATE) {
 		if (verbose > 1)
 			snd_output_printf(loop->output, "shared buffer!!!\n");
-		if ((err = init_handle(loop->play, 1)) < 0)
+		if ((err = init_handle(loop->play, 0)) < 0)
 			goto __error;
 		if ((err = init_handle(loop->capt, 0)) < 0)
 			goto __error;
-		if (loop->play->buf_size < loop->capt->buf_size) {
-			char *nbuf = realloc(loop->play->buf,
-					     loop->capt->buf_size *
-					       loop->capt->frame_size);
-			if (nbuf == NULL) {
-				err = -ENOMEM;
-				goto __error;
-			}
-			loop->play->buf = nbuf;
+		if (loop->play->buf_size < loop->capt->buf_size)
 			loop->play->buf_size = loop->capt->buf_size;
-		} else if (loop->capt->buf_size < loop->play->buf_size) {
-			char *nbuf = realloc(loop->capt->buf,
-					     loop->play->buf_size *
-					       loop->play->frame_size);
-			if (nbuf == NULL) {
-				err = -ENOMEM;
-				goto __error;
-			}
-			loop->capt->buf = nbuf;
-			loop->capt->buf_size = loop->play->buf_size;
-		}
+		loop->capt->buf_size = loop->play->buf_size;
+		if ((err = alloc_buf(loop->play)) < 0)
+			goto __error;
 		loop->capt->buf = loop->play->buf;
 	} else {
 		if ((err = init_handle(loop->play, 1)) < 0)
@@ -1518,18 +2907,26 @@ __again:
 			err = -EIO;
 			goto __error;		
 		}
-		loop->src_state = src_new(loop->src_converter_type,
-					  loop->play->channels, &err);
-		loop->src_data.data_in = calloc(1, sizeof(float)*loop->capt->channels*loop->capt->buf_size);
-		if (loop->src_data.data_in == NULL) {
-			err = -ENOMEM;
-			goto __error;
+		if (loop->src_state && loop->src_channels == loop->play->channels) {
+			src_reset(loop->src_state);
+		} else {
+			if (loop->src_state)
+				src_delete(loop->src_state);
+			loop->src_state = src_new(loop->src_converter_type,
+						  loop->play->channels, &err);
+			if (loop->src_state == NULL) {
+				logit(LOG_CRIT, "%s: samplerate init error: %s\n", loop->id, src_strerror(err));
+				err = -EIO;
+				goto __error;
+			}
+			loop->src_channels = loop->play->channels;
 		}
-		loop->src_data.data_out =  calloc(1, sizeof(float)*loop->play->channels*loop->play->buf_size);
-		if (loop->src_data.data_out == NULL) {
-			err = -ENOMEM;
+		if ((err = src_buf(&loop->src_data.data_in, &loop->src_in_size,
+				   sizeof(float)*loop->capt->channels*loop->capt->buf_size)) < 0)
+			goto __error;
+		if ((err = src_buf(&loop->src_data.data_out, &loop->src_out_size,
+				   sizeof(float)*loop->play->channels*loop->play->buf_size)) < 0)
 			goto __error;
-		}
 		loop->src_data.src_ratio = (double)loop->play->rate /
 					   (double)loop->capt->rate;
 		loop->src_data.end_of_input = 0;
@@ -1552,9 +2949,14 @@ __again:
 #endif
 		snd_output_printf(loop->output, "\n");
 	}
+	if ((err = effects_init(loop)) < 0) {
+		logit(LOG_CRIT, "%s: effects initialization failed\n", loop->id);
+		goto __error;
+	}
 	lhandle_start(loop->play);
 	lhandle_start(loop->capt);
-	if ((err = snd_pcm_format_set_silence(loop->play->format,
+	if (!is_shared(loop->play) && !loop->direct &&
+	    (err = snd_pcm_format_set_silence(loop->play->format,
 					      loop->play->buf,
 					      loop->play->buf_size * loop->play->channels)) < 0) {
 		logit(LOG_CRIT, "%s: silence error\n", loop->id);
@@ -1565,13 +2967,39 @@ __again:
 	loop->pitch = 1.0;
 	update_pitch(loop);
 	loop->pitch_delta = 1.0 / ((double)loop->capt->rate * 4);
+	if (loop->pll.bandwidth > 0) {
+		pll_init(&loop->pll);
+		if (verbose)
+			snd_output_printf(loop->output, "%s: pll bandwidth %.4fHz, damping %.3f, kp %.6f, ki %.6f\n", loop->id, loop->pll.bandwidth, loop->pll.damping, loop->pll.kp, loop->pll.ki);
+	}
 	loop->total_queued_count = 0;
 	loop->pitch_diff = 0;
+	loop->queued_skew = 0;
+	loop->queued_fallbacks = 0;
+	if (loop->split && (err = split_init(loop)) < 0)
+		goto __error;
 	count = get_whole_latency(loop) / loop->play->pitch;
+	if (!pfirst) {
+		/* join the mixed stream, the PCM is already running */
+		if (snd_pcm_delay(loop->play->handle, &delay) < 0 || delay < 0)
+			delay = 0;
+		loop->play->buf_count = count > (snd_pcm_uframes_t)delay ?
+						count - delay : 0;
+		goto __started;
+	}
 	loop->play->buf_count = count;
 	if (loop->play->buf == loop->capt->buf)
 		loop->capt->buf_pos = count;
-	err = writeit(loop->play);
+	if (loop->direct) {
+		loop->direct_drift = 0;
+		err = direct_fill(loop, count);
+	} else if (loop->ring) {
+		/* the buffer is silenced, queue it through the ring */
+		loop->ring->head = count;
+		err = split_writeit(loop);
+	} else {
+		err = writeit(loop->play);
+	}
 	if (verbose > 4)
 		snd_output_printf(loop->output, "%s: silence queued %i samples\n", loop->id, err);
 	if (count > loop->play->buffer_size)
@@ -1581,6 +3009,7 @@ __again:
 		err = -EIO;
 		goto __error;
 	}
+      __started:
 	loop->running = 1;
 	loop->stop_pending = 0;
 	if (loop->xrun) {
@@ -1589,54 +3018,107 @@ __again:
 		loop->xrun_last_cdelay = XRUN_PROFILE_UNKNOWN;
 		loop->xrun_max_proctime = 0;
 	}
-	if ((err = snd_pcm_start(loop->capt->handle)) < 0) {
+	if (cfirst && (err = snd_pcm_start(loop->capt->handle)) < 0) {
 		logit(LOG_CRIT, "pcm start %s error: %s\n", loop->capt->id, snd_strerror(err));
 		goto __error;
 	}
-	if (!loop->linked) {
+	if (!loop->linked && pfirst) {
 		if ((err = snd_pcm_start(loop->play->handle)) < 0) {
 			logit(LOG_CRIT, "pcm start %s error: %s\n", loop->play->id, snd_strerror(err));
 			goto __error;
 		}
 	}
+	if (loop->ring && (err = split_start(loop)) < 0)
+		goto __error;
 	return 0;
       __error:
 	pcmjob_stop(loop);
 	return err;
 }
 
-int pcmjob_stop(struct loopback *loop)
+static int stopit(struct loopback *loop, int hw_free)
 {
 	int err;
 
+	split_stop(loop);
 	if (loop->running) {
-		if ((err = snd_pcm_drop(loop->capt->handle)) < 0)
+		if (!is_shared(loop->capt) &&
+		    (err = snd_pcm_drop(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_drop(loop->play->handle)) < 0)
+		if (!is_shared(loop->play) &&
+		    (err = snd_pcm_drop(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->play->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->capt->handle)) < 0)
+		if (hw_free && !is_shared(loop->capt) &&
+		    (err = snd_pcm_hw_free(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->play->handle)) < 0)
+		if (hw_free && !is_shared(loop->play) &&
+		    (err = snd_pcm_hw_free(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->play->id, snd_strerror(err));
 		loop->running = 0;
 	}
+	share_stop(loop->capt);
+	share_stop(loop->play);
 	freeloop(loop);
 	return 0;
 }
 
+int pcmjob_stop(struct loopback *loop)
+{
+	return stopit(loop, 1);
+}
+
+/*
+ * Restart with new parameters. The PCM handles, the buffers and
+ * the samplerate state are kept, snd_pcm_hw_params() replaces the
+ * current setup, so hw_free is not required.
+ */
+static int pcmjob_reconfig(struct loopback *loop)
+{
+	int err;
+
+	loop->restart_time = clock_now();
+	loop->restart_pending = 0;
+	stopit(loop, 0);
+	err = pcmjob_start(loop);
+	if (err < 0)
+		return err;
+	/* the stream may be inactive (slave mode) */
+	loop->restart_pending = loop->running;
+	return 0;
+}
+
+/* called when the first captured frame was queued to playback */
+static void restart_done(struct loopback *loop)
+{
+	long diff;
+
+	loop->restart_pending = 0;
+	diff = (clock_now() - loop->restart_time) * 1000000;
+	loop->restart_last = diff;
+	if (loop->restart_max < diff)
+		loop->restart_max = diff;
+	loop->restarts++;
+	if (verbose)
+		snd_output_printf(loop->output, "%s: restart to first frame %.3fms (%s params)\n", loop->id, (double)diff / 1000, loop->play->params_cached && loop->capt->params_cached ? "cached" : "negotiated");
+}
+
 int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 {
 	int err, idx = 0;
 
 	if (loop->running) {
-		err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
-		if (err < 0)
-			return err;
-		idx += loop->play->pollfd_count;
-		err = snd_pcm_poll_descriptors(loop->capt->handle, fds + idx, loop->capt->pollfd_count);
-		if (err < 0)
-			return err;
-		idx += loop->capt->pollfd_count;
+		if (share_owner(loop->play)) {
+			err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
+			if (err < 0)
+				return err;
+			idx += loop->play->pollfd_count;
+		}
+		if (share_owner(loop->capt) && !loop->ring) {
+			err = snd_pcm_poll_descriptors(loop->capt->handle, fds + idx, loop->capt->pollfd_count);
+			if (err < 0)
+				return err;
+			idx += loop->capt->pollfd_count;
+		}
 	}
 	if (loop->play->ctl_pollfd_count > 0 &&
 	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
@@ -1656,31 +3138,36 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 	return idx;
 }
 
-static snd_pcm_sframes_t get_queued_playback_samples(struct loopback *loop)
-{
-	snd_pcm_sframes_t delay;
-	int err;
-
-	if ((err = snd_pcm_delay(loop->play->handle, &delay)) < 0)
-		return 0;
-	loop->play->last_delay = delay;
-	delay += loop->play->buf_count;
-#ifdef USE_SAMPLERATE
-	delay += loop->src_out_frames;
-#endif
-	return delay;
-}
-
-static snd_pcm_sframes_t get_queued_capture_samples(struct loopback *loop)
+/*
+ * Feed the PI controller with the whole queue (capture + playback)
+ * measured at one instant.
+ */
+static void pll_sync(struct loopback *loop)
 {
-	snd_pcm_sframes_t delay;
-	int err;
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_sframes_t pdelay, cdelay;
+	double now, queued, pitch;
 
-	if ((err = snd_pcm_delay(loop->capt->handle, &delay)) < 0)
-		return 0;
-	loop->capt->last_delay = delay;
-	delay += loop->capt->buf_count;
-	return delay;
+	if (get_queued_samples(loop, &pdelay, &cdelay, &now) < 0)
+		return;
+	queued = (double)pdelay * play->pitch + (double)cdelay * capt->pitch;
+	loop->pitch_diff = queued - get_whole_latency(loop);
+	if (loop->pitch_diff_min > loop->pitch_diff)
+		loop->pitch_diff_min = loop->pitch_diff;
+	if (loop->pitch_diff_max < loop->pitch_diff)
+		loop->pitch_diff_max = loop->pitch_diff;
+	pitch = pll_update(&loop->pll,
+			   (queued - get_whole_latency(loop)) /
+					(double)play->rate_req,
+			   now);
+	if (verbose > 4)
+		snd_output_printf(loop->output, "%s: pll queued %.1f error %.1f pitch %.8f\n", loop->id, queued, loop->pll.error * play->rate_req, pitch);
+	/* do not flood the driver with tiny changes */
+	if (fabs(pitch - loop->pitch) >= loop->pitch_delta) {
+		loop->pitch = pitch;
+		update_pitch(loop);
+	}
 }
 
 static int ctl_event_check(snd_ctl_elem_value_t *val, snd_ctl_event_t *ev)
@@ -1735,6 +3222,8 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 	      __ctl_check:
 		control_event(lhandle, ev);
 	}
+	/* without the PCM wakeups the coalescing window cannot expire */
+	control_flush(loop, !loop->running);
 	err = get_active(lhandle);
 	if (verbose > 7)
 		snd_output_printf(loop->output, "%s: ctl event active %i\n", lhandle->id, err);
@@ -1749,8 +3238,7 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 			restart = 1;
 	}
 	if (restart) {
-		pcmjob_stop(loop);
-		err = pcmjob_start(loop);
+		err = pcmjob_reconfig(loop);
 		if (err < 0)
 			return err;
 	}
@@ -1782,18 +3270,23 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	}
 	idx = 0;
 	if (loop->running) {
-		err = snd_pcm_poll_descriptors_revents(play->handle, fds,
-						       play->pollfd_count,
-						       &prevents);
-		if (err < 0)
-			return err;
-		idx += play->pollfd_count;
-		err = snd_pcm_poll_descriptors_revents(capt->handle, fds + idx,
-						       capt->pollfd_count,
-						       &crevents);
-		if (err < 0)
-			return err;
-		idx += capt->pollfd_count;
+		prevents = crevents = 0;
+		if (share_owner(play)) {
+			err = snd_pcm_poll_descriptors_revents(play->handle, fds,
+							       play->pollfd_count,
+							       &prevents);
+			if (err < 0)
+				return err;
+			idx += play->pollfd_count;
+		}
+		if (share_owner(capt) && !loop->ring) {
+			err = snd_pcm_poll_descriptors_revents(capt->handle, fds + idx,
+							       capt->pollfd_count,
+							       &crevents);
+			if (err < 0)
+				return err;
+			idx += capt->pollfd_count;
+		}
 		if (loop->xrun) {
 			if (prevents || crevents) {
 				loop->xrun_last_wake = loop->xrun_last_wake0;
@@ -1839,8 +3332,26 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	}
 	if (verbose > 9)
 		snd_output_printf(loop->output, "%s: prevents = 0x%x, crevents = 0x%x\n", loop->id, prevents, crevents);
+	control_flush(loop, 0);
 	if (!loop->running)
 		goto __pcm_end;
+	if (loop->direct) {
+		if ((err = direct_copy(loop)) < 0)
+			return err;
+		if (err > 0 && loop->restart_pending)
+			restart_done(loop);
+		goto __reinit;
+	}
+	if (loop->ring) {
+		/* the capture half runs in split_capture_thread() */
+		if ((err = split_writeit(loop)) < 0)
+			return err;
+		if (err > 0 && loop->restart_pending)
+			restart_done(loop);
+		if (__atomic_load_n(&loop->ring->error, __ATOMIC_ACQUIRE))
+			loop->reinit = 1;
+		goto __reinit;
+	}
 	do {
 		ccount = readit(capt);
 		buf_add(loop, ccount);
@@ -1850,6 +3361,10 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		   buffer, feed them there */
 		pcount = writeit(play);
 		buf_remove(loop, pcount);
+		/* the mixed legs other than the owner do not write */
+		if (loop->restart_pending && capt->counter > 0 &&
+		    (pcount > 0 || (!share_owner(play) && ccount > 0)))
+			restart_done(loop);
 		if (play->xrun_pending || loop->reinit)
 			break;
 		loopcount--;
@@ -1858,17 +3373,19 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		if ((err = xrun_sync(loop)) < 0)
 			return err;
 	}
+      __reinit:
 	if (loop->reinit) {
-		err = pcmjob_stop(loop);
-		if (err < 0)
-			return err;
-		err = pcmjob_start(loop);
+		err = pcmjob_reconfig(loop);
 		if (err < 0)
 			return err;
 	}
+	if (loop->sync != SYNC_TYPE_NONE && loop->pll.bandwidth > 0) {
+		pll_sync(loop);
+		goto __sync_end;
+	}
 	if (loop->sync != SYNC_TYPE_NONE &&
 	    play->counter >= play->sync_point &&
-	    capt->counter >= play->sync_point) {
+	    (loop->ring || capt->counter >= play->sync_point)) {
 		snd_pcm_sframes_t diff, lat = get_whole_latency(loop);
 		diff = ((double)(((double)play->total_queued * play->pitch) +
 				 ((double)capt->total_queued * capt->pitch)) /
@@ -1894,15 +3411,17 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 			loop->pitch_diff_max = diff;
 		update_pitch(loop);
 		play->counter -= play->sync_point;
-		capt->counter -= play->sync_point;
+		if (!loop->ring)
+			capt->counter -= play->sync_point;
 		play->total_queued = 0;
 		capt->total_queued = 0;
 		loop->total_queued_count = 0;
 	}
 	if (loop->sync != SYNC_TYPE_NONE) {
 		snd_pcm_sframes_t pqueued, cqueued;
-		pqueued = get_queued_playback_samples(loop);
-		cqueued = get_queued_capture_samples(loop);
+		double now;
+		if (get_queued_samples(loop, &pqueued, &cqueued, &now) < 0)
+			pqueued = cqueued = 0;
 		if (verbose > 4)
 			snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
 		if (pqueued > 0)
@@ -1912,6 +3431,7 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		if (pqueued > 0 || cqueued > 0)
 			loop->total_queued_count += 1;
 	}
+      __sync_end:
 	if (verbose > 12) {
 		snd_pcm_sframes_t pdelay, cdelay;
 		if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0)
@@ -1948,6 +3468,8 @@ static void show_handle(struct loopback_handle *lhandle, const char *id)
 	OUT("  %s: %s:\n", id, lhandle->id);
 	OUT("    device = '%s', ctldev '%s'\n", lhandle->device, lhandle->ctldev);
 	OUT("    card_number = %i\n", lhandle->card_number);
+	if (lhandle->share)
+		OUT("    share = '%s', owner = %i, running legs = %i\n", lhandle->share->name, lhandle->share->owner == lhandle, lhandle->share->running);
 	if (!loop->running)
 		return;
 	OUT("    access = %s, format = %s, rate = %u, channels = %u\n", snd_pcm_access_name(lhandle->access), snd_pcm_format_name(lhandle->format), lhandle->rate, lhandle->channels);
@@ -1955,6 +3477,8 @@ static void show_handle(struct loopback_handle *lhandle, const char *id)
 	OUT("    xrun_pending = %i\n", lhandle->xrun_pending);
 	OUT("    buf_size = %li, buf_pos = %li, buf_count = %li, buf_over = %li\n", lhandle->buf_size, lhandle->buf_pos, lhandle->buf_count, lhandle->buf_over);
 	OUT("    pitch = %.8f\n", lhandle->pitch);
+	if (lhandle->audio_tstamp)
+		OUT("    audio clock ratio = %.8f\n", lhandle->tstamp_ratio);
 }
 
 void pcmjob_state(struct loopback *loop)
@@ -1965,11 +3489,23 @@ void pcmjob_state(struct loopback *loop)
 	OUT("  running = %i\n", loop->running);
 	OUT("  sync = %i\n", loop->sync);
 	OUT("  slave = %i\n", loop->slave);
+	OUT("  startup: init = %.3fms, start = %.3fms, ready after %.3fms\n", loop->startup_init, loop->startup_start, loop->startup_ready);
+	if (loop->controls)
+		OUT("  controls: events = %lu, writes = %lu, pending = %i\n", loop->control_events, loop->control_writes, loop->controls_pending != NULL);
+	if (loop->restarts)
+		OUT("  restarts = %u, first frame latency: last = %.3fms, max = %.3fms\n", loop->restarts, (double)loop->restart_last / 1000, (double)loop->restart_max / 1000);
 	if (!loop->running)
 		goto __skip;
 	OUT("  pollfd_count = %i\n", loop->pollfd_count);
 	OUT("  pitch = %.8f, delta = %.8f, diff = %li, min = %li, max = %li\n", loop->pitch, loop->pitch_delta, loop->pitch_diff, loop->pitch_diff_min, loop->pitch_diff_max);
+	OUT("  queue measurement: skew max = %.1fus, fallbacks = %lu\n", loop->queued_skew, loop->queued_fallbacks);
+	if (loop->pll.bandwidth > 0)
+		OUT("  pll: bandwidth = %.4fHz, damping = %.3f, error = %.8fs, integral = %.8f\n", loop->pll.bandwidth, loop->pll.damping, loop->pll.error, loop->pll.integral);
 	OUT("  use_samplerate = %i\n", loop->use_samplerate);
+	if (loop->direct)
+		OUT("  direct: drift = %.3f\n", loop->direct_drift);
+	if (loop->ring)
+		OUT("  split ring: size = %li, head = %li, tail = %li, fill = %li, capture delay = %li\n", loop->ring->size, loop->ring->head, loop->ring->tail, ring_fill(loop->ring), ring_capt_delay(loop->ring));
       __skip:
 	show_handle(loop->play, "playback");
 	show_handle(loop->capt, "capture");
@@ -0,0 +1,149 @@
+/*
+ *  A simple PCM loopback utility
+ *
+ *  Drift compensation - second order (PI) clock recovery loop
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+/*
+ * The loop works on the latency error expressed in seconds:
+ *
+ *   e = (queued_frames - latency) / rate
+ *
+ * The queue integrates the clock difference between the capture and
+ * playback devices minus the applied correction (pitch - 1), so together
+ * with the PI filter
+ *
+ *   pitch = 1 + kp * e + ki * integral(e dt)
+ *
+ * we get a classic type-2 loop with the characteristic polynomial
+ * s^2 + kp * s + ki. For the natural frequency wn = 2 * PI * bandwidth
+ * and damping factor zeta: kp = 2 * zeta * wn, ki = wn^2.
+ */
+
+void pll_init(struct loopback_pll *pll)
+{
+	double wn;
+
+	if (pll->damping <= 0)
+		pll->damping = PLL_DEFAULT_DAMPING;
+	if (pll->limit <= 0)
+		pll->limit = PLL_DEFAULT_LIMIT;
+	wn = 2.0 * M_PI * pll->bandwidth;
+	pll->kp = 2.0 * pll->damping * wn;
+	pll->ki = wn * wn;
+	/* pre-filter measurement jitter well above the loop bandwidth */
+	pll->tau = pll->bandwidth > 0 ? 1.0 / (2.0 * M_PI * pll->bandwidth * 10.0) : 0;
+	pll_reset(pll);
+}
+
+void pll_reset(struct loopback_pll *pll)
+{
+	pll->integral = 0;
+	pll->error = 0;
+	pll->last_time = 0;
+	pll->pitch = 1.0;
+	pll->valid = 0;
+}
+
+/*
+ * Feed one measurement (latency error in seconds taken at time 'now',
+ * also in seconds) and return the new pitch.
+ */
+double pll_update(struct loopback_pll *pll, double error, double now)
+{
+	double dt, alpha, p, i;
+
+	if (!pll->valid) {
+		pll->error = error;
+		pll->last_time = now;
+		pll->valid = 1;
+		return pll->pitch;
+	}
+	dt = now - pll->last_time;
+	if (dt <= 0)
+		return pll->pitch;
+	/* big gaps (xrun, stop) - do not integrate stale data */
+	if (dt > 1.0)
+		dt = 1.0;
+	pll->last_time = now;
+	if (pll->tau > 0) {
+		alpha = dt / (pll->tau + dt);
+		pll->error += alpha * (error - pll->error);
+	} else {
+		pll->error = error;
+	}
+	i = pll->integral + pll->ki * pll->error * dt;
+	p = pll->kp * pll->error;
+	/* anti-windup: freeze the integrator when the output saturates */
+	if (fabs(i + p) <= pll->limit)
+		pll->integral = i;
+	p += pll->integral;
+	if (p > pll->limit)
+		p = pll->limit;
+	else if (p < -pll->limit)
+		p = -pll->limit;
+	pll->pitch = 1.0 + p;
+	return pll->pitch;
+}
+
+/*
+ * Offline simulation: two free running clocks differing by 'ppm' with
+ * uniform measurement jitter of 'jitter' seconds, the controller is fed
+ * every 'period' seconds. Prints a trace and returns the final error
+ * in frames.
+ */
+double pll_simulate(struct loopback_pll *cfg, snd_output_t *output,
+		    unsigned int rate, double ppm, double jitter,
+		    double period, double duration)
+{
+	struct loopback_pll pll = *cfg;
+	double t, queued = 0, err = 0, pitch = 1.0, drift = ppm / 1000000.0;
+	double max = 0, next_print = 0;
+	unsigned int seed = 1;
+
+	pll_init(&pll);
+	snd_output_printf(output, "# pll simulation: rate=%u drift=%.2fppm jitter=%.1fus bw=%.4fHz damping=%.3f\n",
+			  rate, ppm, jitter * 1000000, pll.bandwidth, pll.damping);
+	snd_output_printf(output, "# time[s] error[frames] pitch\n");
+	for (t = 0; t < duration; t += period) {
+		/* queue integrates the clock difference minus correction */
+		queued += (drift - (pitch - 1.0)) * period;
+		err = queued;
+		if (jitter > 0)
+			err += jitter * (2.0 * rand_r(&seed) / RAND_MAX - 1.0);
+		pitch = pll_update(&pll, err, t);
+		if (t >= duration / 2 && fabs(queued) > max)
+			max = fabs(queued);
+		if (t >= next_print) {
+			snd_output_printf(output, "%.3f %.3f %.8f\n", t, queued * rate, pitch);
+			next_print += 0.5;
+		}
+	}
+	snd_output_printf(output, "# final error %.3f frames, max error (second half) %.3f frames, pitch %.8f\n",
+			  queued * rate, max * rate, pitch);
+	return queued * rate;
+}
@@ -0,0 +1,656 @@
+/*
+ *  A simple PCM loopback utility
+ *
+ *  Offline simulation - virtual PCM devices driven by a virtual clock
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+#include "alsaloop.h"
+
+/*
+ * The simulated devices are alsa-lib I/O plugins, so the loop code uses
+ * the usual snd_pcm_* calls. The hardware position is derived from the
+ * virtual clock (the capture clock runs 'skew' ppm faster than nominal),
+ * the main loop jumps the clock to the next wakeup instead of sleeping.
+ * The rate shift sync modes are emulated by changing the device clocks,
+ * a pitch above one drains the queue on both sides.
+ *
+ * The capture device produces a ramp (frame index + 1, low 16 bits in
+ * the first channel), the playback device decodes it to measure the
+ * real end-to-end latency. This works only when the samples are not
+ * modified by the loop (no resampling or effects).
+ */
+
+#define SIM_MAX_STREAMS		64
+#define SIM_MAX_XRUNS		32
+#define SIM_MIN_STEP		0.00002		/* 20us */
+
+struct sim_stream {
+	snd_pcm_ioplug_t io;
+	struct loopback_handle *lhandle;
+	int fds[2];			/* dummy poll descriptor */
+	double rate;			/* effective rate (skew, rate shift) */
+	double shift;			/* emulated rate shift */
+	double t0;			/* virtual time of the last rate change */
+	snd_pcm_uframes_t hw0;		/* hw position at t0 */
+	snd_pcm_uframes_t base;		/* capture: absolute frame at start */
+	snd_pcm_uframes_t hw;		/* frames processed by the device */
+	snd_pcm_uframes_t appl;		/* frames transferred by the application */
+	unsigned int running:1;
+	unsigned int xrun:1;
+	unsigned long xruns;
+	/* playback: measured latency */
+	double latency;			/* last, in seconds (< 0 = unknown) */
+	double latency_min;
+	double latency_max;
+	double latency_sum;
+	unsigned long latency_count;
+};
+
+static struct sim {
+	unsigned int enabled:1;
+	double now;			/* virtual clock (seconds) */
+	double skew;			/* capture clock skew in ppm */
+	double jitter;			/* wakeup jitter in seconds */
+	double duration;
+	double interval;		/* trace interval */
+	double stall;			/* xrun injection: stall length */
+	double xrun[SIM_MAX_XRUNS];	/* xrun injection times */
+	int xrun_count;
+	unsigned int cperiod;		/* forced period sizes */
+	unsigned int pperiod;
+	unsigned int seed;
+	struct sim_stream *streams[SIM_MAX_STREAMS];
+	int streams_count;
+} sim = {
+	.duration = 60,
+	.interval = 0.1,
+	.seed = 1,
+};
+
+int sim_enabled(void)
+{
+	return sim.enabled;
+}
+
+/* virtual time for the drift compensation */
+int sim_time(double *now)
+{
+	if (!sim.enabled)
+		return -ENODEV;
+	*now = sim.now;
+	return 0;
+}
+
+static int sim_time_cmp(const void *a, const void *b)
+{
+	double t1 = *(const double *)a, t2 = *(const double *)b;
+
+	return t1 < t2 ? -1 : t1 > t2;
+}
+
+/*
+ * Argument: KEY=VALUE[,KEY=VALUE...]
+ *   skew=PPM, jitter=US, cperiod=FRAMES, pperiod=FRAMES, seconds=SECS,
+ *   interval=MS, xrun=SECS (repeatable), stall=MS, seed=N
+ */
+int sim_parse(const char *arg)
+{
+	char *str, *key, *val, *saveptr = NULL;
+	int err = 0;
+
+	sim.enabled = 1;
+	str = strdup(arg);
+	if (str == NULL)
+		return -ENOMEM;
+	for (key = strtok_r(str, ",", &saveptr); key;
+	     key = strtok_r(NULL, ",", &saveptr)) {
+		val = strchr(key, '=');
+		if (val == NULL) {
+			if (*key == '\0' || strcmp(key, "on") == 0)
+				continue;
+			err = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+		if (strcmp(key, "skew") == 0) {
+			sim.skew = atof(val);
+		} else if (strcmp(key, "jitter") == 0) {
+			sim.jitter = atof(val) / 1000000.0;
+		} else if (strcmp(key, "cperiod") == 0) {
+			sim.cperiod = atoi(val);
+		} else if (strcmp(key, "pperiod") == 0) {
+			sim.pperiod = atoi(val);
+		} else if (strcmp(key, "seconds") == 0) {
+			sim.duration = atof(val);
+		} else if (strcmp(key, "interval") == 0) {
+			sim.interval = atof(val) / 1000.0;
+		} else if (strcmp(key, "stall") == 0) {
+			sim.stall = atof(val) / 1000.0;
+		} else if (strcmp(key, "seed") == 0) {
+			sim.seed = atoi(val);
+		} else if (strcmp(key, "xrun") == 0) {
+			if (sim.xrun_count >= SIM_MAX_XRUNS) {
+				err = -E2BIG;
+				break;
+			}
+			sim.xrun[sim.xrun_count++] = atof(val);
+		} else {
+			err = -EINVAL;
+			break;
+		}
+	}
+	if (err < 0)
+		logit(LOG_CRIT, "Wrong simulation argument '%s'\n", key);
+	free(str);
+	/* sim_run() injects the xruns in the time order */
+	qsort(sim.xrun, sim.xrun_count, sizeof(sim.xrun[0]), sim_time_cmp);
+	if (sim.duration <= 0)
+		sim.duration = 60;
+	if (sim.interval <= 0)
+		sim.interval = 0.1;
+	return err;
+}
+
+static snd_pcm_uframes_t sim_hw(struct sim_stream *sp)
+{
+	if (!sp->running)
+		return sp->hw;
+	return sp->hw0 + (snd_pcm_uframes_t)((sim.now - sp->t0) * sp->rate);
+}
+
+static void sim_set_rate(struct sim_stream *sp)
+{
+	double rate = sp->io.rate;
+
+	if (sp->io.stream == SND_PCM_STREAM_PLAYBACK) {
+		rate *= sp->shift;
+	} else {
+		rate *= 1.0 + sim.skew / 1000000.0;
+		rate /= sp->shift;
+	}
+	/* continue from the current position with the new clock */
+	sp->hw0 = sim_hw(sp);
+	sp->t0 = sim.now;
+	sp->rate = rate;
+}
+
+int sim_rate_shift(struct loopback_handle *lhandle, double pitch)
+{
+	int i;
+
+	for (i = 0; i < sim.streams_count; i++) {
+		if (sim.streams[i]->lhandle == lhandle) {
+			sim.streams[i]->shift = pitch;
+			sim_set_rate(sim.streams[i]);
+			return 0;
+		}
+	}
+	return -ENODEV;
+}
+
+/* time when the absolute capture frame was sampled */
+static double sim_capture_time(struct sim_stream *sp, snd_pcm_uframes_t idx)
+{
+	return sp->t0 + ((double)(idx - sp->base) - (double)sp->hw0) / sp->rate;
+}
+
+static int sim_start(snd_pcm_ioplug_t *io)
+{
+	struct sim_stream *sp = io->private_data;
+
+	/* the capture ramp continues after restarts */
+	sp->base += sp->hw;
+	sp->hw = sp->hw0 = 0;
+	sp->t0 = sim.now;
+	sp->running = 1;
+	return 0;
+}
+
+static int sim_stop(snd_pcm_ioplug_t *io)
+{
+	struct sim_stream *sp = io->private_data;
+
+	sp->hw = sim_hw(sp);
+	sp->running = 0;
+	return 0;
+}
+
+static int sim_prepare(snd_pcm_ioplug_t *io)
+{
+	struct sim_stream *sp = io->private_data;
+
+	sp->base += sp->hw;
+	sp->hw = sp->appl = 0;
+	sp->running = 0;
+	sp->xrun = 0;
+	return 0;
+}
+
+static snd_pcm_sframes_t sim_pointer(snd_pcm_ioplug_t *io)
+{
+	struct sim_stream *sp = io->private_data;
+	snd_pcm_uframes_t hw;
+
+	if (sp->xrun)
+		return -EPIPE;
+	hw = sim_hw(sp);
+	if (sp->running &&
+	    (io->stream == SND_PCM_STREAM_PLAYBACK ?
+	     hw >= sp->appl : hw - sp->appl >= io->buffer_size)) {
+		sp->xrun = 1;
+		sp->xruns++;
+		sp->hw = hw;
+		sp->running = 0;
+		return -EPIPE;
+	}
+	sp->hw = hw;
+	return hw % io->buffer_size;
+}
+
+static unsigned int sim_sample_get(snd_pcm_ioplug_t *io,
+				   const snd_pcm_channel_area_t *area,
+				   snd_pcm_uframes_t offset)
+{
+	char *ptr = (char *)area->addr + (area->first + area->step * offset) / 8;
+
+	if (io->format == SND_PCM_FORMAT_S16)
+		return *(uint16_t *)ptr;
+	return (*(uint32_t *)ptr >> 16) & 0xffff;
+}
+
+static void sim_sample_set(snd_pcm_ioplug_t *io,
+			   const snd_pcm_channel_area_t *area,
+			   snd_pcm_uframes_t offset, unsigned int val)
+{
+	char *ptr = (char *)area->addr + (area->first + area->step * offset) / 8;
+
+	if (io->format == SND_PCM_FORMAT_S16)
+		*(uint16_t *)ptr = val;
+	else
+		*(uint32_t *)ptr = val << 16;
+}
+
+static struct sim_stream *sim_capture_peer(struct sim_stream *sp)
+{
+	struct loopback_handle *capt = sp->lhandle->loopback->capt;
+	int i;
+
+	for (i = 0; i < sim.streams_count; i++)
+		if (sim.streams[i]->lhandle == capt)
+			return sim.streams[i];
+	return NULL;
+}
+
+static void sim_latency(struct sim_stream *sp, unsigned int val)
+{
+	struct sim_stream *cp = sim_capture_peer(sp);
+	snd_pcm_uframes_t cnow, idx;
+	double played;
+
+	sp->latency = -1;
+	if (val == 0 || cp == NULL)
+		return;
+	/* unwrap the 16-bit ramp against the current capture position */
+	cnow = cp->base + sim_hw(cp);
+	idx = cnow - ((cnow - (val - 1)) & 0xffff);
+	/* the first frame of this chunk will be played after the queue */
+	played = sim.now + (double)(sp->appl - sim_hw(sp)) / sp->rate;
+	sp->latency = played - sim_capture_time(cp, idx);
+	if (sp->latency_count == 0 || sp->latency < sp->latency_min)
+		sp->latency_min = sp->latency;
+	if (sp->latency_count == 0 || sp->latency > sp->latency_max)
+		sp->latency_max = sp->latency;
+	sp->latency_sum += sp->latency;
+	sp->latency_count++;
+}
+
+static snd_pcm_sframes_t sim_transfer(snd_pcm_ioplug_t *io,
+				      const snd_pcm_channel_area_t *areas,
+				      snd_pcm_uframes_t offset,
+				      snd_pcm_uframes_t size)
+{
+	struct sim_stream *sp = io->private_data;
+	snd_pcm_uframes_t i;
+	unsigned int ch;
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		sim_latency(sp, sim_sample_get(io, &areas[0], offset));
+	} else {
+		for (i = 0; i < size; i++) {
+			sim_sample_set(io, &areas[0], offset + i,
+				       (sp->base + sp->appl + i + 1) & 0xffff);
+			for (ch = 1; ch < io->channels; ch++)
+				sim_sample_set(io, &areas[ch], offset + i, 0);
+		}
+	}
+	sp->appl += size;
+	return size;
+}
+
+static int sim_close(snd_pcm_ioplug_t *io)
+{
+	struct sim_stream *sp = io->private_data;
+	int i;
+
+	for (i = 0; i < sim.streams_count; i++) {
+		if (sim.streams[i] == sp) {
+			sim.streams[i] = sim.streams[--sim.streams_count];
+			break;
+		}
+	}
+	close(sp->fds[0]);
+	close(sp->fds[1]);
+	free(sp);
+	return 0;
+}
+
+static int sim_hw_params(snd_pcm_ioplug_t *io,
+			 snd_pcm_hw_params_t *params ATTRIBUTE_UNUSED)
+{
+	struct sim_stream *sp = io->private_data;
+
+	sim_set_rate(sp);
+	return 0;
+}
+
+static const snd_pcm_ioplug_callback_t sim_callback = {
+	.start = sim_start,
+	.stop = sim_stop,
+	.pointer = sim_pointer,
+	.transfer = sim_transfer,
+	.close = sim_close,
+	.hw_params = sim_hw_params,
+	.prepare = sim_prepare,
+};
+
+int sim_open(snd_pcm_t **pcm, struct loopback_handle *lhandle,
+	     snd_pcm_stream_t stream)
+{
+	static const unsigned int accesses[] = {
+		SND_PCM_ACCESS_RW_INTERLEAVED,
+		SND_PCM_ACCESS_MMAP_INTERLEAVED,
+	};
+	static const unsigned int formats[] = {
+		SND_PCM_FORMAT_S16,
+		SND_PCM_FORMAT_S32,
+	};
+	struct sim_stream *sp;
+	unsigned int period, bytes;
+	int err;
+
+	if (sim.streams_count >= SIM_MAX_STREAMS)
+		return -EMFILE;
+	sp = calloc(1, sizeof(*sp));
+	if (sp == NULL)
+		return -ENOMEM;
+	if (pipe(sp->fds) < 0) {
+		err = -errno;
+		free(sp);
+		return err;
+	}
+	sp->lhandle = lhandle;
+	sp->shift = 1.0;
+	sp->latency = -1;
+	sp->io.version = SND_PCM_IOPLUG_VERSION;
+	sp->io.name = "alsaloop simulated PCM";
+	sp->io.callback = &sim_callback;
+	sp->io.private_data = sp;
+	sp->io.poll_fd = sp->fds[0];
+	sp->io.poll_events = stream == SND_PCM_STREAM_PLAYBACK ?
+						POLLOUT : POLLIN;
+	err = snd_pcm_ioplug_create(&sp->io, lhandle->device, stream,
+				    SND_PCM_NONBLOCK);
+	if (err < 0) {
+		close(sp->fds[0]);
+		close(sp->fds[1]);
+		free(sp);
+		return err;
+	}
+	bytes = lhandle->channels *
+		(snd_pcm_format_physical_width(lhandle->format) / 8);
+	period = stream == SND_PCM_STREAM_PLAYBACK ? sim.pperiod : sim.cperiod;
+	if ((err = snd_pcm_ioplug_set_param_list(&sp->io, SND_PCM_IOPLUG_HW_ACCESS,
+						 2, accesses)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_list(&sp->io, SND_PCM_IOPLUG_HW_FORMAT,
+						 2, formats)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&sp->io, SND_PCM_IOPLUG_HW_CHANNELS,
+						   1, 1024)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&sp->io, SND_PCM_IOPLUG_HW_RATE,
+						   4000, 768000)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&sp->io, SND_PCM_IOPLUG_HW_PERIODS,
+						   2, 1024)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&sp->io, SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+						   64, 16 * 1024 * 1024)) < 0)
+		goto __error;
+	if (period > 0 && bytes > 0)
+		err = snd_pcm_ioplug_set_param_minmax(&sp->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+						      period * bytes, period * bytes);
+	else
+		err = snd_pcm_ioplug_set_param_minmax(&sp->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+						      32, 8 * 1024 * 1024);
+	if (err < 0)
+		goto __error;
+	sim.streams[sim.streams_count++] = sp;
+	*pcm = sp->io.pcm;
+	return 0;
+      __error:
+	snd_pcm_ioplug_delete(&sp->io);
+	close(sp->fds[0]);
+	close(sp->fds[1]);
+	free(sp);
+	return err;
+}
+
+/* time until the device wakes up the application */
+static double sim_wait(struct sim_stream *sp)
+{
+	snd_pcm_uframes_t hw = sim_hw(sp);
+	snd_pcm_sframes_t avail;
+
+	if (sp->xrun)
+		return 0;
+	if (!sp->running)
+		return HUGE_VAL;
+	if (sp->io.stream == SND_PCM_STREAM_PLAYBACK)
+		avail = sp->io.buffer_size - (sp->appl - hw);
+	else
+		avail = hw - sp->appl;
+	if (avail >= (snd_pcm_sframes_t)sp->lhandle->avail_min)
+		return 0;
+	return (double)(sp->lhandle->avail_min - avail) / sp->rate;
+}
+
+static struct sim_stream *sim_find(struct loopback_handle *lhandle)
+{
+	int i;
+
+	for (i = 0; i < sim.streams_count; i++)
+		if (sim.streams[i]->lhandle == lhandle)
+			return sim.streams[i];
+	return NULL;
+}
+
+static double sim_buffer_time(void)
+{
+	struct sim_stream *sp;
+	double t, max = 0;
+	int i;
+
+	for (i = 0; i < sim.streams_count; i++) {
+		sp = sim.streams[i];
+		if (sp->rate > 0) {
+			t = (double)sp->io.buffer_size / sp->rate;
+			if (t > max)
+				max = t;
+		}
+	}
+	return max;
+}
+
+static void sim_trace(struct loopback **loops, int count, snd_output_t *output)
+{
+	struct sim_stream *pp, *cp;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		pp = sim_find(loops[i]->play);
+		cp = sim_find(loops[i]->capt);
+		if (pp == NULL || cp == NULL)
+			continue;
+		snd_output_printf(output, "%.4f %i ", sim.now, i);
+		if (pp->latency >= 0)
+			snd_output_printf(output, "%.3f", pp->latency * 1000);
+		else
+			snd_output_printf(output, "-");
+		snd_output_printf(output, " %li %.8f %lu %lu\n",
+				  (long)loops[i]->pitch_diff, loops[i]->pitch,
+				  cp->xruns, pp->xruns);
+	}
+}
+
+static void sim_summary(struct loopback **loops, int count,
+			snd_output_t *output, unsigned long wakeups,
+			double proctime, double realtime)
+{
+	struct sim_stream *pp, *cp;
+	int i;
+
+	snd_output_printf(output, "# summary: %.1fs simulated in %.3fs (%.1fx), %lu wakeups, %.2fus/wakeup\n",
+			  sim.now, realtime, realtime > 0 ? sim.now / realtime : 0,
+			  wakeups, wakeups > 0 ? proctime * 1000000 / wakeups : 0);
+	for (i = 0; i < count; i++) {
+		pp = sim_find(loops[i]->play);
+		cp = sim_find(loops[i]->capt);
+		if (pp == NULL || cp == NULL)
+			continue;
+		snd_output_printf(output, "# job %i: latency ", i);
+		if (pp->latency_count > 0)
+			snd_output_printf(output, "min %.3fms avg %.3fms max %.3fms",
+					  pp->latency_min * 1000,
+					  pp->latency_sum * 1000 / pp->latency_count,
+					  pp->latency_max * 1000);
+		else
+			snd_output_printf(output, "unknown");
+		snd_output_printf(output, ", requested %.3fms, pitch %.8f, xruns %lu/%lu\n",
+				  (double)loops[i]->latency * 1000 / loops[i]->play->rate_req,
+				  loops[i]->pitch, cp->xruns, pp->xruns);
+	}
+}
+
+static double realtime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Run all jobs in one thread as fast as possible. The trace line is:
+ *   time[s] job latency[ms] queue_error[frames] pitch capt_xruns play_xruns
+ */
+int sim_run(struct loopback **loops, int count, snd_output_t *output)
+{
+	struct pollfd *pfds = NULL;
+	double step, t, next_trace = 0, proctime = 0, start, t1;
+	unsigned long wakeups = 0;
+	int i, err, pfds_count = 0, xrun_idx = 0;
+
+	for (i = 0; i < count; i++) {
+		if (loops[i]->split) {
+			logit(LOG_CRIT, "Split threads cannot be simulated\n");
+			return -EINVAL;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if ((err = pcmjob_init(loops[i])) < 0)
+			goto __error;
+	}
+	for (i = 0; i < count; i++) {
+		if ((err = pcmjob_start(loops[i])) < 0)
+			goto __error;
+		if (loops[i]->pollfd_count > pfds_count)
+			pfds_count = loops[i]->pollfd_count;
+	}
+	pfds = calloc(pfds_count > 0 ? pfds_count : 1, sizeof(struct pollfd));
+	if (pfds == NULL) {
+		err = -ENOMEM;
+		goto __error;
+	}
+	if (sim.stall <= 0)
+		sim.stall = sim_buffer_time() * 2;
+	snd_output_printf(output, "# simulation: skew=%.2fppm jitter=%.1fus duration=%.1fs\n",
+			  sim.skew, sim.jitter * 1000000, sim.duration);
+	snd_output_printf(output, "# time[s] job latency[ms] queue_error[frames] pitch capt_xruns play_xruns\n");
+	start = realtime();
+	while (sim.now < sim.duration) {
+		step = HUGE_VAL;
+		for (i = 0; i < sim.streams_count; i++) {
+			t = sim_wait(sim.streams[i]);
+			if (t < step)
+				step = t;
+		}
+		if (step == HUGE_VAL || step < SIM_MIN_STEP)
+			step = SIM_MIN_STEP;
+		if (sim.jitter > 0)
+			step += sim.jitter * rand_r(&sim.seed) / RAND_MAX;
+		sim.now += step;
+		if (xrun_idx < sim.xrun_count && sim.now >= sim.xrun[xrun_idx]) {
+			/* the process was not scheduled for a while */
+			snd_output_printf(output, "# %.4f stall %.3fms\n", sim.now, sim.stall * 1000);
+			sim.now += sim.stall;
+			xrun_idx++;
+		}
+		t1 = realtime();
+		for (i = 0; i < count; i++) {
+			if ((err = pcmjob_pollfds_init(loops[i], pfds)) < 0)
+				goto __error;
+			if ((err = pcmjob_pollfds_handle(loops[i], pfds)) < 0)
+				goto __error;
+		}
+		proctime += realtime() - t1;
+		wakeups++;
+		if (sim.now >= next_trace) {
+			sim_trace(loops, count, output);
+			next_trace += sim.interval;
+		}
+	}
+	sim_summary(loops, count, output, wakeups, proctime, realtime() - start);
+	err = 0;
+      __error:
+	if (err < 0)
+		logit(LOG_CRIT, "Simulation failed: %s\n", snd_strerror(err));
+	free(pfds);
+	for (i = 0; i < count; i++) {
+		pcmjob_stop(loops[i]);
+		pcmjob_done(loops[i]);
+	}
+	return err;
+}
@@ -75,6 +75,22 @@ EOF
   $DBG ./alsaloop --config $CFGFILE $ARGS
 }
 
+test6() {
+  echo "TEST6 (simulation, no hardware)"
+  $DBG ./alsaloop -C sim:capture -P sim:playback --tlatency 50000 \
+    --sync playshift --pll 0.5 \
+    --simulate "skew=200,jitter=500,cperiod=441,pperiod=1024,seconds=120,xrun=60" \
+    $ARGS
+}
+
+test7() {
+  echo "TEST7 (simulation, direct mmap copy with simple sync)"
+  $DBG ./alsaloop -C sim:capture -P sim:playback --tlatency 50000 \
+    --direct --sync simple \
+    --simulate "skew=200,jitter=500,cperiod=441,pperiod=1024,seconds=120" \
+    $ARGS
+}
+
 sigusr1() {
 	pid=$(ps ax | grep alsaloop | grep -v grep | colrm 7 255)
 	if test -n "$pid"; then
@@ -83,12 +99,23 @@ sigusr1() {
 	fi
 }
 
+sighup() {
+	pid=$(ps ax | grep alsaloop | grep -v grep | colrm 7 255)
+	if test -n "$pid"; then
+		echo "Reloading alsaloop $pid..."
+		kill -SIGHUP $pid
+	fi
+}
+
 case "$1" in
 test1) shift; ARGS="$@"; test1 ;;
 test2) shift; ARGS="$@"; test2 ;;
 test3) shift; ARGS="$@"; test3 ;;
 test4) shift; ARGS="$@"; test4 ;;
 test5) shift; ARGS="$@"; test5 ;;
+test6) shift; ARGS="$@"; test6 ;;
+test7) shift; ARGS="$@"; test7 ;;
+hup) sighup ;;
 usr|sig*) sigusr1 ;;
 *) ARGS="$@"; test1 ;;
 esac
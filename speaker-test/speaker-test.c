@@ -288,87 +288,100 @@ static const int	supported_formats[] = {
   -1
 };
 
-static void generate_sine(uint8_t *frames, int channel, int count, double *_phase) {
-  double phase = *_phase;
-  double max_phase = 1.0 / freq;
-  double step = 1.0 / (double)rate;
-  double res;
-  float fres;
-  int    chn;
+/*
+ * The sine samples of the active channel are stored with the stride of
+ * the frame. The other channels are not touched, they are zeroed once
+ * in write_loop().
+ */
+static void store_sine(uint8_t *frames, int channel, int offset, const double *smp, int count) {
+  int8_t *samp8 = (int8_t*) frames + offset * channels + channel;
+  int16_t *samp16 = (int16_t*) frames + offset * channels + channel;
+  int32_t *samp32 = (int32_t*) frames + offset * channels + channel;
+  float   *samp_f = (float*) frames + offset * channels + channel;
   int32_t  ires;
-  int8_t *samp8 = (int8_t*) frames;
-  int16_t *samp16 = (int16_t*) frames;
-  int32_t *samp32 = (int32_t*) frames;
-  float   *samp_f = (float*) frames;
+  int      i;
 
-  while (count-- > 0) {
-    for(chn=0;chn<channels;chn++) {
-      switch (format) {
-      case SND_PCM_FORMAT_S8:
-        if (chn==channel) {
-          res = (sin((phase * 2 * M_PI) / max_phase - M_PI)) * 0x03fffffff; /* Don't use MAX volume */
-          ires = res;
-          *samp8++ = ires >> 24;
-        } else {
-          *samp8++ = 0;
-        }
-        break;
-      case SND_PCM_FORMAT_S16_LE:
-        if (chn==channel) {
-          res = (sin((phase * 2 * M_PI) / max_phase - M_PI)) * 0x03fffffff; /* Don't use MAX volume */
-          ires = res;
-          *samp16++ = LE_SHORT(ires >> 16);
-        } else {
-          *samp16++ = 0;
-        }
-        break;
-      case SND_PCM_FORMAT_S16_BE:
-        if (chn==channel) {
-          res = (sin((phase * 2 * M_PI) / max_phase - M_PI)) * 0x03fffffff; /* Don't use MAX volume */
-          ires = res;
-          *samp16++ = BE_SHORT(ires >> 16);
-        } else {
-          *samp16++ = 0;
-        }
-        break;
-      case SND_PCM_FORMAT_FLOAT_LE:
-        if (chn==channel) {
-          res = (sin((phase * 2 * M_PI) / max_phase - M_PI)) * 0.75 ; /* Don't use MAX volume */
-          fres = res;
-	  *samp_f++ = fres;
-        } else {
-	  *samp_f++ = 0.0;
-        }
-        break;
-      case SND_PCM_FORMAT_S32_LE:
-        if (chn==channel) {
-          res = (sin((phase * 2 * M_PI) / max_phase - M_PI)) * 0x03fffffff; /* Don't use MAX volume */
-          ires = res;
-          *samp32++ = LE_INT(ires);
-        } else {
-          *samp32++ = 0;
-        }
-        break;
-      case SND_PCM_FORMAT_S32_BE:
-        if (chn==channel) {
-          res = (sin((phase * 2 * M_PI) / max_phase - M_PI)) * 0x03fffffff; /* Don't use MAX volume */
-          ires = res;
-          *samp32++ = BE_INT(ires);
-        } else {
-          *samp32++ = 0;
-        }
-        break;
-      default:
-        ;
-      }
+  switch (format) {
+  case SND_PCM_FORMAT_S8:
+    for (i = 0; i < count; i++, samp8 += channels) {
+      ires = smp[i] * 0x03fffffff; /* Don't use MAX volume */
+      *samp8 = ires >> 24;
+    }
+    break;
+  case SND_PCM_FORMAT_S16_LE:
+    for (i = 0; i < count; i++, samp16 += channels) {
+      ires = smp[i] * 0x03fffffff; /* Don't use MAX volume */
+      *samp16 = LE_SHORT(ires >> 16);
+    }
+    break;
+  case SND_PCM_FORMAT_S16_BE:
+    for (i = 0; i < count; i++, samp16 += channels) {
+      ires = smp[i] * 0x03fffffff; /* Don't use MAX volume */
+      *samp16 = BE_SHORT(ires >> 16);
+    }
+    break;
+  case SND_PCM_FORMAT_FLOAT_LE:
+    for (i = 0; i < count; i++, samp_f += channels)
+      *samp_f = smp[i] * 0.75; /* Don't use MAX volume */
+    break;
+  case SND_PCM_FORMAT_S32_LE:
+    for (i = 0; i < count; i++, samp32 += channels) {
+      ires = smp[i] * 0x03fffffff; /* Don't use MAX volume */
+      *samp32 = LE_INT(ires);
+    }
+    break;
+  case SND_PCM_FORMAT_S32_BE:
+    for (i = 0; i < count; i++, samp32 += channels) {
+      ires = smp[i] * 0x03fffffff; /* Don't use MAX volume */
+      *samp32 = BE_INT(ires);
     }
+    break;
+  default:
+    ;
+  }
+}
 
-    phase += step;
-    if (phase >= max_phase)
-      phase -= max_phase;
+#define SINE_CHUNK	256
+
+static double sine_step;			/* phase step of the table */
+static double sine_rot_re[SINE_CHUNK + 1];	/* rotation by 0..SINE_CHUNK frames */
+static double sine_rot_im[SINE_CHUNK + 1];
+
+/*
+ * The sine is generated without calling sin() for each frame: the
+ * samples of one chunk are the phasor of the chunk start rotated by the
+ * table values, then the phasor is rotated to the next chunk. The
+ * phasor is started from the exact phase (in radians) for each period,
+ * so the rounding errors are not accumulated.
+ */
+static void generate_sine(uint8_t *frames, int channel, int count, double *_phase) {
+  double phase = *_phase;
+  double step = 2 * M_PI * freq / rate;
+  double re, im, t;
+  double smp[SINE_CHUNK];
+  int    i, n, len;
+
+  if (step != sine_step) {
+    for (i = 0; i <= SINE_CHUNK; i++) {
+      sine_rot_re[i] = cos(step * i);
+      sine_rot_im[i] = sin(step * i);
+    }
+    sine_step = step;
+  }
+
+  re = cos(phase - M_PI);
+  im = sin(phase - M_PI);
+  for (n = 0; n < count; n += len) {
+    len = count - n < SINE_CHUNK ? count - n : SINE_CHUNK;
+    for (i = 0; i < len; i++)
+      smp[i] = im * sine_rot_re[i] + re * sine_rot_im[i];
+    store_sine(frames, channel, n, smp, len);
+    t = re * sine_rot_re[SINE_CHUNK] - im * sine_rot_im[SINE_CHUNK];
+    im = im * sine_rot_re[SINE_CHUNK] + re * sine_rot_im[SINE_CHUNK];
+    re = t;
   }
 
-  *_phase = phase;
+  *_phase = fmod(phase + step * count, 2 * M_PI);
 }
 
 /* Pink noise is a better test than sine wave because we can tell
@@ -953,6 +966,10 @@ static int write_loop(snd_pcm_t *handle, int channel, int periods, uint8_t *fram
   if (periods <= 0)
     periods = 1;
 
+  /* the sine generator writes only the active channel */
+  if (test_type == TEST_SINE)
+    memset(frames, 0, snd_pcm_format_size(format, period_size * channels));
+
   for(n = 0; n < periods && !in_aborting; n++) {
     if (test_type == TEST_PINK_NOISE)
       generate_pink_noise(frames, channel, period_size);
@@ -961,16 +978,49 @@ static int write_loop(snd_pcm_t *handle, int channel, int periods, uint8_t *fram
     else
       generate_sine(frames, channel, period_size, &phase);
 
+    /* no device in the benchmark mode */
+    if (handle == NULL)
+      continue;
     if ((err = write_buffer(handle, frames, period_size)) < 0)
       return err;
   }
-  if (buffer_size > n * period_size && !in_aborting) {
+  if (handle && buffer_size > n * period_size && !in_aborting) {
     snd_pcm_drain(handle);
     snd_pcm_prepare(handle);
   }
   return 0;
 }
 
+/*
+ * Benchmark mode - generate the test signal for all channels like
+ * the playback loop, but without a device, and print the speed
+ */
+static void benchmark(uint8_t *frames, unsigned int nloops)
+{
+  unsigned long long total = 0;
+  struct timeval tv1, tv2;
+  double time;
+  unsigned int n;
+  int chn, periods;
+
+  periods = (rate*3)/period_size;
+  if (periods <= 0)
+    periods = 1;
+  gettimeofday(&tv1, NULL);
+  for (n = 0; n < nloops && !in_aborting; n++) {
+    for (chn = 0; chn < channels && !in_aborting; chn++) {
+      write_loop(NULL, get_speaker_channel(chn), periods, frames);
+      total += (unsigned long long)periods * period_size;
+    }
+  }
+  gettimeofday(&tv2, NULL);
+  time = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+  if (time <= 0)
+    time = 1e-6;
+  printf(_("Generated %llu frames in %.3lf s (%.0lf frames/s, %.1lf times realtime)\n"),
+	 total, time, total / time, total / time / rate);
+}
+
 static int prg_exit(int code)
 {
   if (pcm_handle)
@@ -1017,6 +1067,7 @@ static void help(void)
 	   "-W,--wavdir	Specify the directory containing WAV files\n"
 	   "-m,--chmap	Specify the channel map to override\n"
 	   "-X,--force-frequency	force frequencies outside the 30-8000hz range\n"
+	   "-B,--benchmark	measure the signal generation speed (no playback)\n"
 	   "\n"));
   printf(_("Recognized sample formats are:"));
   for (fmt = supported_formats; *fmt >= 0; fmt++) {
@@ -1039,6 +1090,7 @@ int main(int argc, char *argv[]) {
   double		time1,time2,time3;
   unsigned int		n, nloops;
   struct   timeval	tv1,tv2;
+  int			bench = 0;
 #ifdef CONFIG_SUPPORT_CHMAP
   const char *chmap = NULL;
 #endif
@@ -1060,6 +1112,7 @@ int main(int argc, char *argv[]) {
     {"wavdir",    1, NULL, 'W'},
     {"debug",	  0, NULL, 'd'},
     {"force-frequency",	  0, NULL, 'X'},
+    {"benchmark", 0, NULL, 'B'},
 #ifdef CONFIG_SUPPORT_CHMAP
     {"chmap",	  1, NULL, 'm'},
 #endif
@@ -1081,7 +1134,7 @@ int main(int argc, char *argv[]) {
   while (1) {
     int c;
     
-    if ((c = getopt_long(argc, argv, "hD:r:c:f:F:b:p:P:t:l:s:w:W:d:X"
+    if ((c = getopt_long(argc, argv, "hD:r:c:f:F:b:p:P:t:l:s:w:W:d:XB"
 #ifdef CONFIG_SUPPORT_CHMAP
 			 "m:"
 #endif
@@ -1177,6 +1230,9 @@ int main(int argc, char *argv[]) {
     case 'X':
       force_frequency = 1;
       break;
+    case 'B':
+      bench = 1;
+      break;
 #ifdef CONFIG_SUPPORT_CHMAP
     case 'm':
       chmap = optarg;
@@ -1223,6 +1279,30 @@ int main(int argc, char *argv[]) {
   signal(SIGTERM, signal_handler);
   signal(SIGABRT, signal_handler);
 
+  if (bench) {
+    if (test_type == TEST_WAV) {
+      fprintf(stderr, _("The benchmark mode cannot be used with WAV files\n"));
+      exit(EXIT_FAILURE);
+    }
+    /* the period time given by -p or 100ms */
+    if (period_time > 0)
+      period_size = (unsigned long long)rate * period_time / 1000000;
+    else
+      period_size = rate / 10;
+    if (period_size == 0)
+      period_size = 1;
+    frames = malloc(snd_pcm_format_size(format, period_size * channels));
+    if (frames == NULL) {
+      fprintf(stderr, _("No enough memory\n"));
+      exit(EXIT_FAILURE);
+    }
+    if (test_type == TEST_PINK_NOISE)
+      initialize_pink_noise(&pink, 16);
+    benchmark(frames, nloops ? nloops : 1);
+    free(frames);
+    return EXIT_SUCCESS;
+  }
+
   if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
     printf(_("Playback open error: %d,%s\n"), err,snd_strerror(err));
     prg_exit(EXIT_FAILURE);